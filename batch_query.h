@@ -0,0 +1,640 @@
+#ifndef BATCH_QUERY_H
+#define BATCH_QUERY_H
+
+#include <cv.h>
+#include <highgui.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <cfloat>
+#include <limits>
+#include "options.h"
+#include "lap_partition.h"
+#include "thread_pool.h"
+#include "surf_extract.h"
+
+/*
+ * 認識プログラムの照合とバッチ処理
+ *
+ * 照合は各認識プログラムのインデックスでk-NNの物体IDと距離を求める関数（nnSearch）だけを差し替え、
+ * 投票と集計はここで共通に行う。対話モードでは1画像、バッチモードでは複数画像のキーポイントを
+ * ラプラシアンの区画ごとに1つの行列にまとめ、インデックスを1回の大きな呼び出しで引く。
+ *
+ * バッチモードはマニフェスト（1行に1つのクエリ画像名）を読み、画像のデコードとSURFの抽出を
+ * 先読みスレッドで進めながら、抽出の終わった画像をまとめて照合する。結果は1画像1行のTSVで、
+ *
+ *   クエリ名  状態(ok/error)  識別結果  得票数  キーポイント数  decode_ms  extract_ms  match_ms
+ *
+ * match_msはバッチ全体の照合時間をキーポイント数で按分したもの。行の順番は抽出の終わった順になる。
+ *
+ * 既定では各キーポイントが1-NNの物体に1票を入れる。VoteParamsで曖昧な照合を捨てられる
+ * （2-NNとの距離の比によるratio test、距離の上限）ほか、距離で重みをつけた票にしたり、
+ * 1位の物体の票差が十分についた画像の残りのキーポイントを照合せずに打ち切ったりできる。
+ *
+ * nnSearchの形式:
+ *   void nnSearch(int p, const CvMat* queries, int begin, int end, int k, int* labels, float* dists)
+ *   区画pのインデックスでqueriesのbegin〜end行目のk-NNを求め、クエリbegin+jのn番目に近い点の物体IDと
+ *   距離の2乗をlabels[j * k + n]とdists[j * k + n]に書く（見つからなければ-1とFLT_MAX）。
+ *   異なるチャンクが並列に呼ばれる。
+ *
+ * クエリごとに使う行列や配列はワーカーごとのQueryWorkspaceに持たせ、一番大きなクエリに合わせて伸ばしたものを
+ * 次のクエリでも使う。先読みスレッドが返すQueryImageも照合が終わったらrecycle()で戻して使い回す。
+ */
+
+const double RATIO_THRESHOLD = 0.8;  // -filter でのratio test（1-NNと2-NNの距離の比の上限）
+const double DIST_THRESHOLD = 0.25;  // -filter での1-NNまでの距離の上限
+const double VOTE_THRESHOLD = 50;    // -filter で照合を打ち切る1位と2位の票差
+
+/**
+ * 照合と投票のパラメータ（既定ではすべて使わず、1-NNの物体に1票）
+ */
+struct VoteParams {
+    float ratio;          // 1-NNと2-NNの距離の比の上限（0なら使わない、使うときは2-NNまで探す）
+    float distThreshold;  // 1-NNまでの距離の上限（0なら使わない）
+    bool weighted;        // 1-NNまでの距離で重みをつけた票を入れる
+    float voteMargin;     // 1位と2位の票差がこれに達した画像は残りを照合しない（0なら打ち切らない）
+
+    VoteParams() : ratio(0.0f), distThreshold(0.0f), weighted(false), voteMargin(0.0f) {}
+
+    /**
+     * 探す近傍の数
+     */
+    int k() const {
+        return ratio > 0.0f ? 2 : 1;
+    }
+
+    /**
+     * 照合を捨てるオプションを使うか（使わなければ従来どおりどの物体にも票がなくても棄却しない）
+     */
+    bool rejects() const {
+        return ratio > 0.0f || distThreshold > 0.0f || weighted || voteMargin > 0.0f;
+    }
+};
+
+/**
+ * コマンドライン引数から照合と投票のパラメータを読む
+ * -filter でratio test、距離の上限、重みつきの票、打ち切りをまとめて既定値で使い、
+ * -ratio、-dist、-weighted、-margin でそれぞれを指定する（0で使わない）
+ */
+inline VoteParams parseVoteOptions(int argc, char** argv) {
+    VoteParams params;
+    if (hasOption(argc, argv, "-filter")) {
+        params.ratio = (float)RATIO_THRESHOLD;
+        params.distThreshold = (float)DIST_THRESHOLD;
+        params.weighted = true;
+        params.voteMargin = (float)VOTE_THRESHOLD;
+    }
+    params.ratio = (float)doubleOption(argc, argv, "-ratio", params.ratio);
+    params.distThreshold = (float)doubleOption(argc, argv, "-dist", params.distThreshold);
+    params.weighted = params.weighted || hasOption(argc, argv, "-weighted");
+    params.voteMargin = (float)doubleOption(argc, argv, "-margin", params.voteMargin);
+    return params;
+}
+
+/**
+ * 1つのキーポイントの照合結果から票の重みを求める
+ *
+ * @param[in] params  照合と投票のパラメータ
+ * @param[in] labels  k-NNの物体ID
+ * @param[in] dists   k-NNまでの距離の2乗
+ *
+ * @return 1-NNの物体に入れる票（捨てるなら0、1を超えない）
+ */
+inline float matchWeight(const VoteParams& params, const int* labels, const float* dists) {
+    if (labels[0] < 0) {
+        return 0.0f;
+    }
+    float d = std::sqrt(dists[0]);
+    if (params.distThreshold > 0.0f && d > params.distThreshold) {
+        return 0.0f;
+    }
+    // 2-NNが別の物体なのに距離が近ければどちらとも決められない（同じ物体なら曖昧ではない）
+    if (params.ratio > 0.0f && labels[1] >= 0 && labels[1] != labels[0] && d > params.ratio * std::sqrt(dists[1])) {
+        return 0.0f;
+    }
+    if (!params.weighted) {
+        return 1.0f;
+    }
+    return params.distThreshold > 0.0f ? 1.0f - d / params.distThreshold : 1.0f / (1.0f + d);
+}
+
+/**
+ * 先読みスレッドがSURFを抽出した1画像分のクエリ
+ */
+struct QueryImage {
+    std::string name;         // マニフェストに書かれたクエリ名
+    bool ok;                  // 画像をロードできたか
+    int numKeypoints;         // キーポイント数
+    std::vector<float> descriptors[NUM_LAP_PARTITIONS];  // ラプラシアンの区画ごとの特徴ベクトル
+    double decodeTime;        // デコード時間（ms）
+    double extractTime;       // SURFの抽出時間（ms）
+
+    QueryImage() : ok(false), numKeypoints(0), decodeTime(0.0), extractTime(0.0) {}
+};
+
+/**
+ * 1つのワーカーがクエリごとに使い回す作業領域
+ * SURFの抽出、区画ごとのクエリの行列、k-NNの結果と得票の配列をクエリごとに確保・解放せず、
+ * これまでで一番大きなクエリに合わせて伸ばしたものを次のクエリでも使う（縮めない）。
+ * 複数のスレッドで同時に使ってはいけない。
+ */
+class QueryWorkspace {
+public:
+    QueryWorkspace() {
+        for (int p = 0; p < NUM_LAP_PARTITIONS; p++) {
+            queryMats[p] = NULL;
+            buffers[p] = NULL;
+        }
+    }
+
+    ~QueryWorkspace() {
+        for (int p = 0; p < NUM_LAP_PARTITIONS; p++) {
+            if (buffers[p] != NULL) {
+                cvReleaseMat(&buffers[p]);
+            }
+        }
+    }
+
+    /**
+     * 区画pのクエリの行列をrows行にする（確保済みの行数が足りなければ1.5倍以上に確保し直す）
+     *
+     * @param[in] p     区画
+     * @param[in] rows  行数
+     * @param[in] dim   特徴ベクトルの次元数
+     *
+     * @return queryMats[p]（rowsが0ならNULL）、次に呼ぶまで有効
+     */
+    CvMat* resizeQueryMat(int p, int rows, int dim) {
+        if (rows <= 0) {
+            queryMats[p] = NULL;
+            return NULL;
+        }
+        if (buffers[p] == NULL || buffers[p]->rows < rows || buffers[p]->cols != dim) {
+            int capacity = rows;
+            if (buffers[p] != NULL) {
+                if (buffers[p]->cols == dim) {
+                    capacity = std::max(rows, buffers[p]->rows + buffers[p]->rows / 2);
+                }
+                cvReleaseMat(&buffers[p]);
+            }
+            buffers[p] = cvCreateMat(capacity, dim, CV_32FC1);
+        }
+        queryMats[p] = cvGetRows(buffers[p], &views[p], 0, rows);
+        return queryMats[p];
+    }
+
+    SurfWorkspace surf;                         // SURFの抽出
+    QueryImage query;                           // 1画像ずつ照合するときのクエリ
+    CvMat* queryMats[NUM_LAP_PARTITIONS];       // mergeQueryImages()がまとめた区画ごとの特徴ベクトル（空ならNULL）
+    std::vector<int> owners[NUM_LAP_PARTITIONS];  // queryMatsの各行がどの画像のものか
+    std::vector<float> votes;                   // voteByNN()が集めた各画像の各物体の得票数
+
+    // voteByNN()の作業用
+    std::vector<int> remaining;  // 画像ごとのまだ照合していないキーポイント数
+    std::vector<char> decided;   // 1位が決まった画像
+    std::vector<int> labels;     // k-NNの物体ID
+    std::vector<float> dists;    // k-NNまでの距離の2乗
+
+private:
+    QueryWorkspace(const QueryWorkspace&);
+    QueryWorkspace& operator=(const QueryWorkspace&);
+
+    CvMat* buffers[NUM_LAP_PARTITIONS];  // 区画ごとに確保した行列（queryMatsはこの先頭の行を指す）
+    CvMat views[NUM_LAP_PARTITIONS];
+};
+
+/**
+ * マニフェストを読み込む（空行と#で始まる行は無視）
+ *
+ * @param[in]  filename  マニフェストのファイル
+ * @param[out] names     クエリ画像名
+ *
+ * @return 成功ならtrue、失敗ならfalse
+ */
+inline bool loadManifest(const char* filename, std::vector<std::string>& names) {
+    std::ifstream fin(filename);
+    if (!fin.is_open()) {
+        std::cerr << "cannot open file: " << filename << std::endl;
+        return false;
+    }
+    names.clear();
+    std::string line;
+    while (getline(fin, line)) {
+        while (!line.empty() && (line[line.size() - 1] == '\r' || line[line.size() - 1] == ' ')) {
+            line.erase(line.size() - 1);
+        }
+        if (!line.empty() && line[0] != '#') {
+            names.push_back(line);
+        }
+    }
+    return true;
+}
+
+/**
+ * クエリ画像をデコードしてSURFを抽出し、特徴ベクトルをラプラシアンの区画ごとに詰める
+ *
+ * @param[in]     queryFile  クエリ画像のパス
+ * @param[in]     surf       SURFの抽出のパラメータ
+ * @param[in]     dim        特徴ベクトルの次元数
+ * @param[in,out] work       SURFの抽出の作業領域
+ * @param[out]    query      抽出したクエリ（ロードできなければokがfalse、前の内容は容量を残して上書きする）
+ */
+inline void extractQueryImage(const char* queryFile, const SurfOptions& surf, int dim, SurfWorkspace& work,
+                              QueryImage& query) {
+    query.ok = false;
+    query.numKeypoints = 0;
+    query.extractTime = 0.0;
+    for (int p = 0; p < NUM_LAP_PARTITIONS; p++) {
+        query.descriptors[p].clear();
+    }
+
+    double tt = (double)cvGetTickCount();
+    IplImage* queryImage = loadGrayImage(queryFile, surf.maxSize);
+    query.decodeTime = ((double)cvGetTickCount() - tt) / (cvGetTickFrequency() * 1000.0);
+    if (queryImage == NULL) {
+        std::cerr << "cannot load image file: " << queryFile << std::endl;
+        return;
+    }
+
+    tt = (double)cvGetTickCount();
+    CvSeq* queryKeypoints = 0;
+    CvSeq* queryDescriptors = 0;
+    extractSurf(queryImage, surf, work, &queryKeypoints, &queryDescriptors);
+
+    // 残すキーポイントの特徴ベクトルをラプラシアンの符号ごとに詰める（CvSeqは次の画像で捨てられる）
+    const std::vector<int>& selected = work.selected;
+    query.numKeypoints = (int)selected.size();
+    for (size_t s = 0; s < selected.size(); s++) {
+        int k = selected[s];
+        CvSURFPoint* kp = (CvSURFPoint*)cvGetSeqElem(queryKeypoints, k);
+        float* desc = (float*)cvGetSeqElem(queryDescriptors, k);
+        std::vector<float>& dst = query.descriptors[lapPartition(kp->laplacian)];
+        dst.insert(dst.end(), desc, desc + dim);
+    }
+    query.ok = true;
+    query.extractTime = ((double)cvGetTickCount() - tt) / (cvGetTickFrequency() * 1000.0);
+
+    cvReleaseImage(&queryImage);
+}
+
+/**
+ * クエリ画像のデコードとSURFの抽出を先読みするスレッド群
+ * 各スレッドがマニフェストの次の画像を取ってデコードと抽出を行い、終わった順にキューへ入れる
+ * 照合の終わったクエリをrecycle()で戻すと、次の画像の抽出にそのQueryImageの配列を使い回す
+ */
+class QueryPrefetcher {
+public:
+    /**
+     * @param[in] names       クエリ画像名
+     * @param[in] imageDir    クエリ画像のディレクトリ
+     * @param[in] surf        SURFの抽出のパラメータ
+     * @param[in] dim         特徴ベクトルの次元数
+     * @param[in] numThreads  先読みスレッド数
+     * @param[in] depth       抽出済みで照合待ちにしておける画像数
+     */
+    QueryPrefetcher(const std::vector<std::string>& names, const char* imageDir, const SurfOptions& surf, int dim,
+                    int numThreads, int depth)
+        : names(names), imageDir(imageDir), surf(surf), dim(dim), next(0),
+          running(std::max(numThreads, 1)), queue(depth) {
+        for (int i = 0; i < std::max(numThreads, 1); i++) {
+            threads.push_back(std::thread(&QueryPrefetcher::extractLoop, this));
+        }
+    }
+
+    ~QueryPrefetcher() {
+        // 途中でやめた場合も残りを捨ててスレッドを終わらせる
+        next = (int)names.size();
+        QueryImage* query;
+        while (queue.pop(query)) {
+            delete query;
+        }
+        for (size_t i = 0; i < threads.size(); i++) {
+            threads[i].join();
+        }
+        for (size_t i = 0; i < spares.size(); i++) {
+            delete spares[i];
+        }
+    }
+
+    /**
+     * 抽出の終わったクエリを1つ取り出す（使い終わったらrecycle()で戻すかdeleteする）
+     * @return すべて取り出し終わったらfalse
+     */
+    bool pop(QueryImage*& query) {
+        return queue.pop(query);
+    }
+
+    /**
+     * 使い終わったクエリを戻し、次の画像の抽出に使い回す
+     */
+    void recycle(QueryImage* query) {
+        std::lock_guard<std::mutex> lock(sparesMutex);
+        spares.push_back(query);
+    }
+
+private:
+    void extractLoop() {
+        SurfWorkspace work;
+        int i;
+        while ((i = next++) < (int)names.size()) {
+            QueryImage* query = NULL;
+            {
+                std::lock_guard<std::mutex> lock(sparesMutex);
+                if (!spares.empty()) {
+                    query = spares.back();
+                    spares.pop_back();
+                }
+            }
+            if (query == NULL) {
+                query = new QueryImage();
+            }
+            query->name = names[i];
+
+            char queryFile[1024];
+            snprintf(queryFile, sizeof queryFile, "%s/%s", imageDir, names[i].c_str());
+            extractQueryImage(queryFile, surf, dim, work, *query);
+            queue.push(query);
+        }
+
+        // 最後のスレッドが終わったらキューを閉じる
+        if (--running == 0) {
+            queue.close();
+        }
+    }
+
+    const std::vector<std::string>& names;
+    const char* imageDir;
+    SurfOptions surf;
+    int dim;
+    std::atomic<int> next;     // 次に処理するマニフェストの行
+    std::atomic<int> running;  // 動いている先読みスレッド数
+    BoundedQueue<QueryImage*> queue;
+    std::vector<std::thread> threads;
+    std::mutex sparesMutex;
+    std::vector<QueryImage*> spares;  // recycle()で戻されたクエリ
+};
+
+/**
+ * 複数画像のクエリを区画ごとに1つの行列にまとめて照合し、画像ごとに得票する
+ * 打ち切るときは区画ごとに少しずつ照合し、そのたびに1位と2位の票差を確かめる。
+ * 票差がvoteMarginに達するか残りのキーポイントがすべて2位に入っても逆転できなくなった画像は、
+ * それ以降のキーポイントを照合しない。
+ *
+ * @param[in]     pool        照合用のスレッドプール
+ * @param[in]     chunk       1スレッドが一度に照合するキーポイント数
+ * @param[in,out] work        mergeQueryImages()でクエリをまとめた作業領域、得票数をwork.votesに
+ *                            （numImages x numObjects）書く
+ * @param[in]     numImages   画像数
+ * @param[in]     numObjects  データベース中の物体数
+ * @param[in]     params      照合と投票のパラメータ
+ * @param[in]     nnSearch    k-NNの物体IDと距離を求める関数
+ *
+ * @return 照合したキーポイント数
+ */
+template <class NNSearchFunc>
+inline int voteByNN(ThreadPool& pool, int chunk, QueryWorkspace& work, int numImages, int numObjects,
+                    const VoteParams& params, NNSearchFunc nnSearch) {
+    CvMat* const* queryMats = work.queryMats;
+    const std::vector<int>* owners = work.owners;
+    std::vector<float>& votes = work.votes;
+    votes.assign((size_t)numImages * numObjects, 0.0f);
+    int k = params.k();
+    bool early = params.voteMargin > 0.0f;
+    int roundRows = early ? chunk * pool.size() : std::numeric_limits<int>::max();
+
+    std::vector<int>& remaining = work.remaining;
+    std::vector<char>& decided = work.decided;
+    remaining.assign(numImages, 0);
+    decided.assign(numImages, 0);
+    int pos[NUM_LAP_PARTITIONS];  // 区画ごとの次に照合する行
+    for (int p = 0; p < NUM_LAP_PARTITIONS; p++) {
+        pos[p] = 0;
+        for (size_t i = 0; i < owners[p].size(); i++) {
+            remaining[owners[p][i]]++;
+        }
+    }
+
+    int matched = 0;
+    std::vector<int>& labels = work.labels;
+    std::vector<float>& dists = work.dists;
+    bool more = true;
+    while (more) {
+        more = false;
+        for (int p = 0; p < NUM_LAP_PARTITIONS; p++) {
+            const CvMat* queries = queryMats[p];
+            if (queries == NULL || pos[p] >= queries->rows) {
+                continue;
+            }
+            int begin = pos[p];
+            int end = queries->rows - begin > roundRows ? begin + roundRows : queries->rows;
+            pos[p] = end;
+            more = more || end < queries->rows;
+
+            // 各キーポイントのk-NNを並列に求め（チャンクごとに出力先は重ならない）、最後にまとめて得票する
+            // 1位が決まった画像のキーポイントだけのチャンクは照合しない
+            labels.assign((size_t)(end - begin) * k, -1);
+            dists.assign((size_t)(end - begin) * k, FLT_MAX);
+            const std::vector<int>& owner = owners[p];
+            pool.parallelFor(end - begin, chunk, [&](int b, int e, int worker) {
+                bool active = !early;
+                for (int i = b; i < e && !active; i++) {
+                    active = !decided[owner[begin + i]];
+                }
+                if (active) {
+                    nnSearch(p, queries, begin + b, begin + e, k, &labels[(size_t)b * k], &dists[(size_t)b * k]);
+                }
+            });
+            for (int i = 0; i < end - begin; i++) {
+                int o = owner[begin + i];
+                remaining[o]--;
+                if (decided[o]) {
+                    continue;
+                }
+                matched++;
+                float w = matchWeight(params, &labels[(size_t)i * k], &dists[(size_t)i * k]);
+                if (w > 0.0f) {
+                    votes[(size_t)o * numObjects + labels[(size_t)i * k]] += w;
+                }
+            }
+        }
+
+        // 1票は1を超えないので、票差が残りのキーポイント数を超えれば逆転できない
+        for (int o = 0; early && o < numImages; o++) {
+            if (decided[o]) {
+                continue;
+            }
+            const float* imageVotes = &votes[(size_t)o * numObjects];
+            float first = 0.0f;
+            float second = 0.0f;
+            for (int j = 0; j < numObjects; j++) {
+                if (imageVotes[j] > first) {
+                    second = first;
+                    first = imageVotes[j];
+                } else if (imageVotes[j] > second) {
+                    second = imageVotes[j];
+                }
+            }
+            decided[o] = first - second >= params.voteMargin || first - second > remaining[o];
+        }
+    }
+    return matched;
+}
+
+/**
+ * 複数画像のクエリの特徴ベクトルを区画ごとに1つの行列にまとめる
+ *
+ * @param[in]     batch  クエリ
+ * @param[in]     dim    特徴ベクトルの次元数
+ * @param[in,out] work   区画ごとの特徴ベクトルをwork.queryMats（空ならNULL、次にまとめるまで有効）に、
+ *                       その各行がbatchの何番目の画像のものかをwork.ownersに書く
+ *
+ * @return キーポイント数の合計
+ */
+inline int mergeQueryImages(const std::vector<QueryImage*>& batch, int dim, QueryWorkspace& work) {
+    int totalKeypoints = 0;
+    for (int p = 0; p < NUM_LAP_PARTITIONS; p++) {
+        std::vector<int>& owners = work.owners[p];
+        owners.clear();
+        size_t rows = 0;
+        for (size_t b = 0; b < batch.size(); b++) {
+            rows += batch[b]->descriptors[p].size() / dim;
+        }
+        CvMat* queryMat = work.resizeQueryMat(p, (int)rows, dim);
+        size_t row = 0;
+        for (size_t b = 0; b < batch.size(); b++) {
+            const std::vector<float>& desc = batch[b]->descriptors[p];
+            int n = (int)(desc.size() / dim);
+            if (n > 0) {
+                memcpy(queryMat->data.ptr + row * queryMat->step, &desc[0], desc.size() * sizeof(float));
+            }
+            owners.insert(owners.end(), n, (int)b);
+            row += n;
+        }
+        totalKeypoints += (int)rows;
+    }
+    return totalKeypoints;
+}
+
+/**
+ * 投票数が最大の物体IDを求める
+ *
+ * @param[in] votes       各物体の得票数
+ * @param[in] numObjects  物体数
+ * @param[in] params      照合と投票のパラメータ
+ *
+ * @return 物体ID（照合を捨てるオプションを使っていてどの物体にも票が入らなければ-1、
+ *         使っていなければ従来どおり票がなくても先頭の物体）
+ */
+inline int maxVotedObject(const float* votes, int numObjects, const VoteParams& params) {
+    int maxId = -1;
+    float maxVal = params.rejects() ? 0.0f : -1.0f;
+    for (int i = 0; i < numObjects; i++) {
+        if (votes[i] > maxVal) {
+            maxId = i;
+            maxVal = votes[i];
+        }
+    }
+    return maxId;
+}
+
+/**
+ * マニフェストのクエリ画像をバッチで認識して結果をTSVで出力する
+ *
+ * @param[in] manifestFile  マニフェストのファイル
+ * @param[in] outFile       出力ファイル（NULLなら標準出力）
+ * @param[in] imageDir      クエリ画像のディレクトリ
+ * @param[in] surf          SURFの抽出のパラメータ
+ * @param[in] dim           特徴ベクトルの次元数
+ * @param[in] batchSize     1回の照合にまとめる画像数
+ * @param[in] numExtract    先読みスレッド数
+ * @param[in] id2name       物体ID->物体名
+ * @param[in] pool          照合用のスレッドプール
+ * @param[in] chunk         1スレッドが一度に照合するキーポイント数
+ * @param[in] params        照合と投票のパラメータ
+ * @param[in] nnSearch      k-NNの物体IDと距離を求める関数
+ *
+ * @return 成功なら0、失敗なら1
+ */
+template <class NNSearchFunc>
+inline int runBatchRecognition(const char* manifestFile, const char* outFile, const char* imageDir,
+                               const SurfOptions& surf, int dim, int batchSize, int numExtract, std::map<int, std::string>& id2name,
+                               ThreadPool& pool, int chunk, const VoteParams& params,
+                               NNSearchFunc nnSearch) {
+    std::vector<std::string> names;
+    if (!loadManifest(manifestFile, names)) {
+        return 1;
+    }
+    std::ofstream fout;
+    if (outFile != NULL) {
+        fout.open(outFile);
+        if (!fout.is_open()) {
+            std::cerr << "cannot open file: " << outFile << std::endl;
+            return 1;
+        }
+    }
+    std::ostream& out = outFile != NULL ? fout : std::cout;
+    out << "#query\tstatus\tresult\tvotes\tkeypoints\tdecode_ms\textract_ms\tmatch_ms" << std::endl;
+
+    batchSize = std::max(batchSize, 1);
+    int numObjects = (int)id2name.size();
+    int numDone = 0;
+    double tt = (double)cvGetTickCount();
+    QueryPrefetcher prefetcher(names, imageDir, surf, dim, numExtract, 2 * batchSize);
+    QueryWorkspace work;
+    std::vector<QueryImage*> batch;
+
+    bool more = true;
+    while (more) {
+        // 抽出の終わった画像をバッチにまとめる（失敗した画像はすぐに出力）
+        batch.clear();
+        QueryImage* query;
+        while ((int)batch.size() < batchSize && (more = prefetcher.pop(query))) {
+            if (query->ok) {
+                batch.push_back(query);
+            } else {
+                out << query->name << "\terror\t-\t0\t0\t" << query->decodeTime << "\t0\t0" << std::endl;
+                numDone++;
+                prefetcher.recycle(query);
+            }
+        }
+        if (batch.empty()) {
+            continue;
+        }
+
+        // バッチ中の全画像の特徴ベクトルを区画ごとに1つの行列にまとめる
+        double matchStart = (double)cvGetTickCount();
+        int totalKeypoints = mergeQueryImages(batch, dim, work);
+        voteByNN(pool, chunk, work, (int)batch.size(), numObjects, params, nnSearch);
+        double matchTime = ((double)cvGetTickCount() - matchStart) / (cvGetTickFrequency() * 1000.0);
+
+        for (size_t b = 0; b < batch.size(); b++) {
+            const float* imageVotes = &work.votes[b * numObjects];
+            int maxId = maxVotedObject(imageVotes, numObjects, params);
+            double share = totalKeypoints > 0 ? (double)batch[b]->numKeypoints / totalKeypoints
+                                              : 1.0 / batch.size();
+            out << batch[b]->name << "\tok\t" << (maxId >= 0 ? id2name[maxId] : "-") << "\t"
+                << (maxId >= 0 ? imageVotes[maxId] : 0) << "\t" << batch[b]->numKeypoints << "\t"
+                << batch[b]->decodeTime << "\t" << batch[b]->extractTime << "\t" << matchTime * share << "\n";
+            prefetcher.recycle(batch[b]);
+        }
+        numDone += (int)batch.size();
+        out.flush();
+    }
+
+    tt = (double)cvGetTickCount() - tt;
+    double elapsed = tt / (cvGetTickFrequency() * 1000.0);
+    std::cerr << "Batch Recognition: " << numDone << " images, " << elapsed << "ms ("
+              << (elapsed > 0 ? numDone * 1000.0 / elapsed : 0.0) << " images/s)" << std::endl;
+
+    return 0;
+}
+
+#endif
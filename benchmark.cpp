@@ -0,0 +1,461 @@
+#include <cv.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cmath>
+#include "options.h"
+#include "descdb.h"
+#include "thread_pool.h"
+#include "batch_query.h"
+#include "nn_backend.h"
+#include "recognizer.h"
+
+using namespace std;
+
+const char* BENCHMARK_BACKENDS = "linear,kdtree,lsh";  // 比べるバックエンドの既定値（-backends）
+const char* BENCHMARK_THREADS = "1,2,4";              // 照合スレッド数の既定値（-threads）
+const int BENCHMARK_REPEAT = 3;                       // レイテンシを測るときに全クエリを繰り返す回数（-repeat）
+
+/**
+ * 1つのスレッド数での測定結果
+ */
+struct BenchmarkRun {
+    int threads;
+    vector<double> latencies;  // 1画像ずつ照合したときの照合時間（ms）
+    double throughput;         // バッチで照合したときの画像数/秒
+};
+
+/**
+ * 1つのバックエンドの測定結果
+ */
+struct BenchmarkResult {
+    string name;
+    string params;
+    double buildTime;   // インデックスを作る時間（ms）
+    size_t memory;      // インデックスの大きさ（バイト数）
+    int correct;        // 識別結果が正解だったクエリ数（棄却したクエリは含まない）
+    int rejected;       // どの物体にも票が入らず棄却したクエリ数
+    long long nnHits;   // 1-NNが全探索の1-NNと一致したキーポイント数
+    vector<BenchmarkRun> runs;
+};
+
+// プロトタイプ宣言
+bool loadLabeledManifest(const char* filename, map<string, int>& name2id, vector<string>& names,
+                         vector<int>& expected);
+vector<int> parseIntList(const char* list);
+vector<string> parseNameList(const char* list);
+int recognizeBatch(const NNBackend& backend, ThreadPool& pool, const vector<QueryImage*>& batch, int dim,
+                   int numObjects, const VoteParams& params, QueryWorkspace& work, int* results);
+void searchAll(const NNBackend& backend, ThreadPool& pool, CvMat* queryMats[NUM_LAP_PARTITIONS],
+               vector<int> ids[NUM_LAP_PARTITIONS], vector<float> dists[NUM_LAP_PARTITIONS]);
+double percentile(const vector<double>& sorted, double q);
+string jsonString(const string& s);
+void writeJSON(ostream& out, const char* manifest, int numQueries, int numFailed, int numKeypoints, int dbKeypoints,
+               const SurfOptions& surf, const VoteParams& params, const vector<BenchmarkResult>& results);
+
+/**
+ * 認識のベンチマーク
+ * ラベル付きのクエリ集合を複数のバックエンドで同じパイプラインのまま認識し、
+ * 識別精度、全探索に対する1-NNの再現率、照合のレイテンシ（p50/p95/p99）、インデックスを作る時間と大きさ、
+ * スレッド数ごとのスループットをJSONで出力する。
+ *
+ * benchmark マニフェスト [-backends linear,kdtree,lsh] [-threads 1,2,4] [-repeat N] [-bs N] [-o 出力ファイル]
+ * マニフェストは1行に「クエリ画像名<TAB>正解の物体名」（正解を省くとクエリ画像名が正解）。
+ * -trees、-checks、-candidates、-m、-rerank、-cells、-nprobe はそれぞれのバックエンドに渡す。
+ * -filter、-ratio、-dist、-weighted、-margin で照合と投票のしかたを変える（parseVoteOptions()を参照）。
+ * -maxsize、-maxkp でクエリ画像の縮小とキーポイント数の上限を指定する（parseSurfOptions()を参照）。
+ */
+int main(int argc, char** argv) {
+    if (argc < 2 || argv[1][0] == '-') {
+        cerr << "usage: benchmark manifest [-backends " << BENCHMARK_BACKENDS << "] [-threads " << BENCHMARK_THREADS
+             << "] [-repeat N] [-bs N] [-o result.json]" << endl;
+        return 1;
+    }
+    const char* manifest = argv[1];
+    RecognizerConfig config;
+    vector<string> backendNames = parseNameList(stringOption(argc, argv, "-backends", BENCHMARK_BACKENDS));
+    vector<int> threadCounts = parseIntList(stringOption(argc, argv, "-threads", BENCHMARK_THREADS));
+    int repeat = max(intOption(argc, argv, "-repeat", BENCHMARK_REPEAT), 1);
+    int batchSize = max(intOption(argc, argv, "-bs", config.batchSize), 1);
+    VoteParams params = parseVoteOptions(argc, argv);
+    SurfOptions surf = parseSurfOptions(argc, argv, config.surf);
+    if (backendNames.empty() || threadCounts.empty()) {
+        cerr << "no backends or thread counts" << endl;
+        return 1;
+    }
+    int maxThreads = *max_element(threadCounts.begin(), threadCounts.end());
+
+    // 物体ID->物体名と、その逆引き
+    map<int, string> id2name;
+    if (!loadObjectId(config.objIdFile, id2name)) {
+        cerr << "cannot load object id file" << endl;
+        return 1;
+    }
+    map<string, int> name2id;
+    for (map<int, string>::iterator it = id2name.begin(); it != id2name.end(); ++it) {
+        name2id[it->second] = it->first;
+    }
+    int numObjects = (int)id2name.size();
+
+    vector<string> names;
+    vector<int> expected;
+    if (!loadLabeledManifest(manifest, name2id, names, expected)) {
+        return 1;
+    }
+
+    // 物体モデルデータベースはすべてのバックエンドと全探索の正解で共有する
+    cerr << "物体モデルデータベースをロードします ... " << flush;
+    ModelDB model;
+    if (!loadModelDB(config.descDBFile, config.descFile, config.dim, model)) {
+        cerr << "cannot load description file" << endl;
+        return 1;
+    }
+    cerr << "OK" << endl;
+
+    // クエリのSURFはバックエンドによらないので最初に一度だけ抽出する
+    cerr << "クエリからSURF特徴量を抽出します ... " << flush;
+    ThreadPool extractPool(maxThreads);
+    vector<QueryImage*> extracted(names.size());
+    vector<SurfWorkspace> surfWork(extractPool.size());
+    extractPool.parallelFor((int)names.size(), 1, [&](int begin, int end, int worker) {
+        for (int i = begin; i < end; i++) {
+            extracted[i] = new QueryImage();
+            extracted[i]->name = names[i];
+            string queryFile = names[i][0] == '/' ? names[i] : string(config.imageDir) + "/" + names[i];
+            extractQueryImage(queryFile.c_str(), surf, config.dim, surfWork[worker], *extracted[i]);
+        }
+    });
+    vector<QueryImage*> queries;
+    vector<int> queryExpected;
+    int numFailed = 0;
+    for (size_t i = 0; i < extracted.size(); i++) {
+        if (extracted[i]->ok) {
+            queries.push_back(extracted[i]);
+            queryExpected.push_back(expected[i]);
+        } else {
+            numFailed++;
+            delete extracted[i];
+        }
+    }
+    if (queries.empty()) {
+        cerr << "no queries" << endl;
+        return 1;
+    }
+    QueryWorkspace all;  // 全クエリをまとめた行列（再現率の計算に使う）
+    int numKeypoints = mergeQueryImages(queries, config.dim, all);
+    CvMat** queryMats = all.queryMats;
+    cerr << "OK (" << queries.size() << " images, " << numKeypoints << " keypoints)" << endl;
+
+    // 全探索の1-NNを再現率の正解にする
+    ThreadPool buildPool(maxThreads);
+    vector<int> exactIds[NUM_LAP_PARTITIONS];
+    vector<float> exactDists[NUM_LAP_PARTITIONS];
+    {
+        NNBackend* exact = createNNBackend("linear", argc, argv);
+        exact->build(model, buildPool);
+        searchAll(*exact, buildPool, queryMats, exactIds, exactDists);
+        delete exact;
+    }
+
+    vector<BenchmarkResult> results;
+    for (size_t b = 0; b < backendNames.size(); b++) {
+        NNBackend* backend = createNNBackend(backendNames[b], argc, argv);
+        if (backend == NULL) {
+            cerr << "unknown backend: " << backendNames[b] << " (" << NN_BACKEND_NAMES << ")" << endl;
+            continue;
+        }
+        BenchmarkResult result;
+        result.name = backend->name();
+        result.correct = 0;
+        result.rejected = 0;
+        cerr << result.name << ": インデキシングします ... " << flush;
+        double bt = (double)cvGetTickCount();
+        if (!backend->build(model, buildPool)) {
+            cerr << "cannot build " << result.name << " index" << endl;
+            delete backend;
+            continue;
+        }
+        result.buildTime = ((double)cvGetTickCount() - bt) / (cvGetTickFrequency() * 1000.0);
+        result.memory = backend->memoryUsage();
+        result.params = backend->describe();
+        cerr << "OK (" << result.buildTime << "ms)" << endl;
+
+        // 1-NNの再現率（距離が同じなら別の点でも正解とする）
+        vector<int> ids[NUM_LAP_PARTITIONS];
+        vector<float> dists[NUM_LAP_PARTITIONS];
+        searchAll(*backend, buildPool, queryMats, ids, dists);
+        result.nnHits = 0;
+        for (int p = 0; p < NUM_LAP_PARTITIONS; p++) {
+            for (size_t i = 0; i < ids[p].size(); i++) {
+                if (ids[p][i] == exactIds[p][i] ||
+                    (ids[p][i] >= 0 && fabs(dists[p][i] - exactDists[p][i]) <= 1e-6f * exactDists[p][i])) {
+                    result.nnHits++;
+                }
+            }
+        }
+
+        for (size_t t = 0; t < threadCounts.size(); t++) {
+            ThreadPool pool(threadCounts[t]);
+            BenchmarkRun run;
+            run.threads = pool.size();
+
+            // 1画像ずつ照合したときのレイテンシ（識別精度は最初の1回で数える）
+            QueryWorkspace work;
+            vector<QueryImage*> single(1);
+            for (int r = 0; r < repeat; r++) {
+                for (size_t q = 0; q < queries.size(); q++) {
+                    single[0] = queries[q];
+                    int maxId;
+                    double tt = (double)cvGetTickCount();
+                    recognizeBatch(*backend, pool, single, config.dim, numObjects, params, work, &maxId);
+                    run.latencies.push_back(((double)cvGetTickCount() - tt) / (cvGetTickFrequency() * 1000.0));
+                    // 棄却は正解がデータベースにない物体（-1）でも正解に数えない
+                    if (t == 0 && r == 0) {
+                        if (maxId < 0) {
+                            result.rejected++;
+                        } else if (maxId == queryExpected[q]) {
+                            result.correct++;
+                        }
+                    }
+                }
+            }
+
+            // バッチで照合したときのスループット
+            vector<int> maxIds(batchSize);
+            double tt = (double)cvGetTickCount();
+            for (size_t begin = 0; begin < queries.size(); begin += batchSize) {
+                vector<QueryImage*> batch(queries.begin() + begin,
+                                          queries.begin() + min(queries.size(), begin + batchSize));
+                recognizeBatch(*backend, pool, batch, config.dim, numObjects, params, work, &maxIds[0]);
+            }
+            tt = ((double)cvGetTickCount() - tt) / (cvGetTickFrequency() * 1000.0);
+            run.throughput = tt > 0 ? queries.size() * 1000.0 / tt : 0.0;
+            result.runs.push_back(run);
+            cerr << result.name << ": threads=" << run.threads << " throughput=" << run.throughput << " images/s"
+                 << endl;
+        }
+        results.push_back(result);
+        delete backend;
+    }
+
+    const char* outFile = stringOption(argc, argv, "-o", NULL);
+    int ret = 0;
+    if (outFile != NULL) {
+        ofstream fout(outFile);
+        if (!fout.is_open()) {
+            cerr << "cannot open file: " << outFile << endl;
+            ret = 1;
+        } else {
+            writeJSON(fout, manifest, (int)queries.size(), numFailed, numKeypoints, model.objMat->rows, surf, params,
+                      results);
+        }
+    } else {
+        writeJSON(cout, manifest, (int)queries.size(), numFailed, numKeypoints, model.objMat->rows, surf, params,
+                  results);
+    }
+
+    // 後始末（クエリの行列はallが解放する）
+    for (size_t q = 0; q < queries.size(); q++) {
+        delete queries[q];
+    }
+    releaseModelDB(model);
+
+    return ret;
+}
+
+/**
+ * 正解の物体名つきのマニフェストを読み込む
+ *
+ * @param[in]  filename  マニフェスト（1行に「クエリ画像名<TAB>正解の物体名」、正解を省くとクエリ画像名）
+ * @param[in]  name2id   物体名->物体ID
+ * @param[out] names     クエリ画像名
+ * @param[out] expected  正解の物体ID（データベースにない物体名なら-1）
+ *
+ * @return 成功ならtrue、失敗ならfalse
+ */
+bool loadLabeledManifest(const char* filename, map<string, int>& name2id, vector<string>& names,
+                         vector<int>& expected) {
+    vector<string> lines;
+    if (!loadManifest(filename, lines)) {
+        return false;
+    }
+    for (size_t i = 0; i < lines.size(); i++) {
+        size_t tab = lines[i].find('\t');
+        string name = lines[i].substr(0, tab);
+        string label = tab != string::npos ? lines[i].substr(tab + 1) : name;
+        map<string, int>::iterator it = name2id.find(label);
+        names.push_back(name);
+        expected.push_back(it != name2id.end() ? it->second : -1);
+    }
+    return true;
+}
+
+/**
+ * "1,2,4" のような整数のリスト
+ */
+vector<int> parseIntList(const char* list) {
+    vector<int> values;
+    vector<string> items = parseNameList(list);
+    for (size_t i = 0; i < items.size(); i++) {
+        values.push_back(atoi(items[i].c_str()));
+    }
+    return values;
+}
+
+/**
+ * "linear,kdtree" のようなカンマ区切りのリスト
+ */
+vector<string> parseNameList(const char* list) {
+    vector<string> items;
+    istringstream ss(list);
+    string s;
+    while (getline(ss, s, ',')) {
+        if (!s.empty()) {
+            items.push_back(s);
+        }
+    }
+    return items;
+}
+
+/**
+ * 複数画像のクエリをまとめて照合し、それぞれの得票数が最大の物体IDを求める
+ *
+ * @param[in]  backend     最近傍探索のバックエンド
+ * @param[in]  pool        照合用のスレッドプール
+ * @param[in]  batch       クエリ
+ * @param[in]  dim         特徴ベクトルの次元数
+ * @param[in]  numObjects  データベース中の物体数
+ * @param[in]  params      照合と投票のパラメータ
+ * @param[in]  work        照合の作業領域（呼び出しごとに使い回す）
+ * @param[out] results     各画像の識別結果の物体ID（棄却したら-1）
+ *
+ * @return 照合したキーポイント数
+ */
+int recognizeBatch(const NNBackend& backend, ThreadPool& pool, const vector<QueryImage*>& batch, int dim,
+                   int numObjects, const VoteParams& params, QueryWorkspace& work, int* results) {
+    mergeQueryImages(batch, dim, work);
+    auto nnSearch = [&backend](int p, const CvMat* queries, int begin, int end, int k, int* labels, float* dists) {
+        backend.search(p, queries, begin, end, k, NULL, labels, dists);
+    };
+    int matched = voteByNN(pool, backend.queryChunk(), work, (int)batch.size(), numObjects, params, nnSearch);
+    for (size_t b = 0; b < batch.size(); b++) {
+        results[b] = maxVotedObject(&work.votes[b * numObjects], numObjects, params);
+    }
+    return matched;
+}
+
+/**
+ * クエリのすべてのキーポイントの1-NNを求める
+ *
+ * @param[in]  backend    最近傍探索のバックエンド
+ * @param[in]  pool       スレッドプール
+ * @param[in]  queryMats  区画ごとのクエリの特徴ベクトル（NULLなら空）
+ * @param[out] ids        区画ごとの1-NNの元の行番号
+ * @param[out] dists      区画ごとの1-NNまでの距離の2乗
+ */
+void searchAll(const NNBackend& backend, ThreadPool& pool, CvMat* queryMats[NUM_LAP_PARTITIONS],
+               vector<int> ids[NUM_LAP_PARTITIONS], vector<float> dists[NUM_LAP_PARTITIONS]) {
+    for (int p = 0; p < NUM_LAP_PARTITIONS; p++) {
+        const CvMat* queries = queryMats[p];
+        int rows = queries != NULL ? queries->rows : 0;
+        ids[p].assign(rows, -1);
+        dists[p].assign(rows, FLT_MAX);
+        pool.parallelFor(rows, backend.queryChunk(), [&](int begin, int end, int worker) {
+            backend.search(p, queries, begin, end, 1, &ids[p][begin], NULL, &dists[p][begin]);
+        });
+    }
+}
+
+/**
+ * ソート済みのレイテンシのq分位点
+ */
+double percentile(const vector<double>& sorted, double q) {
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    return sorted[min(sorted.size() - 1, (size_t)(q * sorted.size()))];
+}
+
+/**
+ * JSONの文字列（"と\と制御文字をエスケープする）
+ */
+string jsonString(const string& s) {
+    string out = "\"";
+    for (size_t i = 0; i < s.size(); i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof buf, "\\u%04x", c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+/**
+ * 測定結果をJSONで書く
+ *
+ * @param[out] out           出力先
+ * @param[in]  manifest      マニフェストのファイル名
+ * @param[in]  numQueries    認識したクエリ画像数
+ * @param[in]  numFailed     ロードできなかったクエリ画像数
+ * @param[in]  numKeypoints  クエリのキーポイント数の合計
+ * @param[in]  dbKeypoints   データベース中のキーポイント数
+ * @param[in]  surf          SURFの抽出のパラメータ
+ * @param[in]  params        照合と投票のパラメータ
+ * @param[in]  results       バックエンドごとの測定結果
+ */
+void writeJSON(ostream& out, const char* manifest, int numQueries, int numFailed, int numKeypoints, int dbKeypoints,
+               const SurfOptions& surf, const VoteParams& params, const vector<BenchmarkResult>& results) {
+    const char* simdName;
+    selectL2Bounded(&simdName);
+    out << "{\n";
+    out << "  \"manifest\": " << jsonString(manifest) << ",\n";
+    out << "  \"queries\": " << numQueries << ",\n";
+    out << "  \"failed_queries\": " << numFailed << ",\n";
+    out << "  \"query_keypoints\": " << numKeypoints << ",\n";
+    out << "  \"database_keypoints\": " << dbKeypoints << ",\n";
+    out << "  \"simd\": " << jsonString(simdName) << ",\n";
+    out << "  \"surf\": { \"hessian_threshold\": " << surf.hessianThreshold << ", \"max_size\": " << surf.maxSize
+        << ", \"max_keypoints\": " << surf.maxKeypoints << " },\n";
+    out << "  \"vote\": { \"ratio\": " << params.ratio << ", \"dist_threshold\": " << params.distThreshold
+        << ", \"weighted\": " << (params.weighted ? "true" : "false") << ", \"margin\": " << params.voteMargin
+        << " },\n";
+    out << "  \"backends\": [";
+    for (size_t b = 0; b < results.size(); b++) {
+        const BenchmarkResult& r = results[b];
+        out << (b > 0 ? "," : "") << "\n    {\n";
+        out << "      \"name\": " << jsonString(r.name) << ",\n";
+        out << "      \"params\": " << jsonString(r.params) << ",\n";
+        out << "      \"build_ms\": " << r.buildTime << ",\n";
+        out << "      \"memory_bytes\": " << r.memory << ",\n";
+        out << "      \"top1_accuracy\": " << (numQueries > 0 ? (double)r.correct / numQueries : 0.0) << ",\n";
+        out << "      \"rejected\": " << r.rejected << ",\n";
+        out << "      \"nn_recall\": " << (numKeypoints > 0 ? (double)r.nnHits / numKeypoints : 0.0) << ",\n";
+        out << "      \"runs\": [";
+        for (size_t t = 0; t < r.runs.size(); t++) {
+            vector<double> sorted = r.runs[t].latencies;
+            sort(sorted.begin(), sorted.end());
+            double sum = 0.0;
+            for (size_t i = 0; i < sorted.size(); i++) {
+                sum += sorted[i];
+            }
+            out << (t > 0 ? "," : "") << "\n        { \"threads\": " << r.runs[t].threads
+                << ", \"latency_ms\": { \"mean\": " << (sorted.empty() ? 0.0 : sum / sorted.size())
+                << ", \"p50\": " << percentile(sorted, 0.50) << ", \"p95\": " << percentile(sorted, 0.95)
+                << ", \"p99\": " << percentile(sorted, 0.99) << ", \"max\": " << (sorted.empty() ? 0.0 : sorted.back())
+                << " }, \"throughput_images_per_s\": " << r.runs[t].throughput << " }";
+        }
+        out << "\n      ]\n    }";
+    }
+    out << "\n  ]\n}" << endl;
+}
@@ -0,0 +1,70 @@
+#include <cv.h>
+#include <iostream>
+#include <string>
+#include "options.h"
+#include "descdb.h"
+#include "thread_pool.h"
+#include "nn_backend.h"
+#include "recognizer.h"
+
+using namespace std;
+
+/**
+ * 物体モデルデータベースからインデックスを作ってスナップショットに保存する
+ * 認識プログラムは起動時にスナップショットをmmapするだけなのでインデキシングの時間がかからない
+ * build_index kdtree|lsh|pq|ivf [出力スナップショット] [-trees 木の数] [-m 部分空間の数] [-cells セル数] [-t スレッド数]
+ */
+int main(int argc, char** argv) {
+    RecognizerConfig config;
+    NNBackend* backend = argc > 1 ? createNNBackend(argv[1], argc, argv) : NULL;
+    if (backend == NULL || backend->snapshotType() == 0) {
+        cerr << "usage: build_index kdtree|lsh|pq|ivf [snapshot] [-trees N] [-m N] [-cells N] [-t N]" << endl;
+        delete backend;
+        return 1;
+    }
+    string indexFile = argc > 2 && argv[2][0] != '-' ? argv[2] : defaultIndexFile(config, *backend);
+
+    double tt = (double)cvGetTickCount();
+
+    cout << "物体モデルデータベースをロードします ... " << flush;
+    ModelDB model;
+    if (!loadDescriptionDB(config.descDBFile, config.dim, model.db, model.labels, model.laplacians, model.objMat)) {
+        cerr << "cannot load description database" << endl;
+        delete backend;
+        return 1;
+    }
+    cout << "OK" << endl;
+    cout << "データベース中のキーポイント数: " << model.objMat->rows << endl;
+
+    // 区画ごとにインデックスを作り、配列をスナップショットに並べる
+    // （-trees でkd-treeの木の数、-m で直積量子化の部分空間の数、-cells で転置ファイルのセル数を指定）
+    ThreadPool pool(parseThreadOption(argc, argv));
+    cout << "物体モデルデータベースをインデキシングします ... " << flush;
+    double bt = (double)cvGetTickCount();
+    if (!backend->build(model, pool)) {
+        cerr << "cannot build " << backend->name() << " index" << endl;
+        delete backend;
+        releaseModelDB(model);
+        return 1;
+    }
+    bt = (double)cvGetTickCount() - bt;
+    cout << "OK" << endl;
+    cout << "Indexing Time = " << bt / (cvGetTickFrequency() * 1000.0) << "ms" << endl;
+
+    cout << "スナップショットを保存します: " << indexFile << " ... " << flush;
+    if (!backend->save(indexFile.c_str())) {
+        cerr << "cannot write index snapshot" << endl;
+        delete backend;
+        releaseModelDB(model);
+        return 1;
+    }
+    cout << "OK" << endl;
+
+    delete backend;
+    releaseModelDB(model);
+
+    tt = (double)cvGetTickCount() - tt;
+    cout << "Total Time = " << tt / (cvGetTickFrequency() * 1000.0) << "ms" << endl;
+
+    return 0;
+}
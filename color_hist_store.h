@@ -0,0 +1,308 @@
+#ifndef COLOR_HIST_STORE_H
+#define COLOR_HIST_STORE_H
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <stdint.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "color_histogram.h"
+
+/*
+ * 色ヒストグラムをまとめたバイナリ形式
+ *
+ *   ColorHistStoreHeader                 64バイト
+ *   int32 records[numRecords][stride]    recordOffset から（64バイト境界）
+ *   int64 pathStarts[numRecords + 1]     pathOffset から
+ *   char  paths[]                        画像のパス（NUL終端）を続けて並べたもの
+ *
+ * 1画像のレコードは固定長で、先頭numBins個が各ビンの画素数、残りは0で埋めて64バイト境界に揃える
+ * （4x4x4なら256バイト）。i番目の画像のパスは paths + pathStarts[i] から始まる。
+ * レコードはパスの昇順に並べるので、パスからレコードを二分探索で引ける。
+ * 数値はすべてネイティブのバイトオーダーで、読み込みはmmapした領域を直接参照する。
+ */
+
+const char COLOR_HIST_STORE_MAGIC[8] = { 'C', 'H', 'I', 'S', 'T', '0', '0', '1' };
+const int64_t COLOR_HIST_STORE_ALIGN = 64;
+
+struct ColorHistStoreHeader {
+    char magic[8];
+    int32_t levels[3];     // 赤、緑、青の分割数
+    int32_t numBins;       // ビン数
+    int32_t stride;        // 1レコードのint32の数
+    int32_t reserved;
+    int64_t numRecords;    // 画像数
+    int64_t recordOffset;  // レコードの先頭
+    int64_t pathOffset;    // パスの表の先頭
+    int64_t length;        // ファイルの長さ
+};
+
+/**
+ * mmapした色ヒストグラムのファイル
+ */
+struct ColorHistStore {
+    void* addr;                 // mmapした領域
+    size_t length;              // mmapした長さ
+    int levels[3];              // 赤、緑、青の分割数
+    int numBins;                // ビン数
+    int stride;                 // 1レコードのint32の数
+    int numRecords;             // 画像数
+    const int32_t* records;     // レコード（mmap領域を直接指す）
+    const int64_t* pathStarts;  // 各画像のパスの位置
+    const char* paths;          // 画像のパス
+
+    ColorHistStore()
+        : addr(NULL), length(0), numBins(0), stride(0), numRecords(0), records(NULL), pathStarts(NULL),
+          paths(NULL) {
+        levels[0] = levels[1] = levels[2] = 0;
+    }
+};
+
+/**
+ * @param[in] numBins  ビン数
+ * @return 64バイト境界に揃えた1レコードのint32の数
+ */
+inline int colorHistStride(int numBins) {
+    int perLine = (int)(COLOR_HIST_STORE_ALIGN / sizeof(int32_t));
+    return (numBins + perLine - 1) / perLine * perLine;
+}
+
+/**
+ * 画像のディレクトリかマニフェストから入力画像のパスを集める
+ * ディレクトリなら.で始まらないファイルをすべて、ファイルなら1行に1つのパス（空行と#で始まる行は無視）。
+ * レコードをパスの昇順に並べるため、パスは並べ替えて重複を除く。
+ *
+ * @param[in]  input  画像のディレクトリかマニフェストのファイル
+ * @param[out] paths  画像のパス（ディレクトリならディレクトリ名を付ける）
+ *
+ * @return 成功ならtrue、失敗ならfalse
+ */
+inline bool listColorHistInputs(const char* input, std::vector<std::string>& paths) {
+    paths.clear();
+    struct stat st;
+    if (stat(input, &st) != 0) {
+        std::cerr << "cannot open file: " << input << std::endl;
+        return false;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        DIR* dp = opendir(input);
+        if (dp == NULL) {
+            std::cerr << "cannot open directory: " << input << std::endl;
+            return false;
+        }
+        struct dirent* entry;
+        while ((entry = readdir(dp)) != NULL) {
+            if (entry->d_name[0] != '.') {
+                paths.push_back(std::string(input) + "/" + entry->d_name);
+            }
+        }
+        closedir(dp);
+    } else {
+        std::ifstream fin(input);
+        if (!fin.is_open()) {
+            std::cerr << "cannot open file: " << input << std::endl;
+            return false;
+        }
+        std::string line;
+        while (getline(fin, line)) {
+            while (!line.empty() && (line[line.size() - 1] == '\r' || line[line.size() - 1] == ' ')) {
+                line.erase(line.size() - 1);
+            }
+            if (!line.empty() && line[0] != '#') {
+                paths.push_back(line);
+            }
+        }
+    }
+    std::sort(paths.begin(), paths.end());
+    paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+    return true;
+}
+
+/**
+ * 色ヒストグラムをまとめてファイルに書き込む（一時ファイルに書いてから置き換える）
+ *
+ * @param[in] filename  出力ファイル名
+ * @param[in] q         ビン番号の表
+ * @param[in] paths     画像のパス（昇順で重複なし）
+ * @param[in] records   各画像のレコード（paths.size() x colorHistStride(q.numBins)）
+ *
+ * @return 成功ならtrue、失敗ならfalse
+ */
+inline bool writeColorHistStore(const char* filename, const ColorQuantizer& q, const std::vector<std::string>& paths,
+                                const std::vector<int32_t>& records) {
+    int64_t numRecords = (int64_t)paths.size();
+    int stride = colorHistStride(q.numBins);
+    std::vector<int64_t> pathStarts(numRecords + 1, 0);
+    for (int64_t i = 0; i < numRecords; i++) {
+        pathStarts[i + 1] = pathStarts[i] + (int64_t)paths[i].size() + 1;
+    }
+
+    ColorHistStoreHeader header;
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, COLOR_HIST_STORE_MAGIC, sizeof header.magic);
+    for (int c = 0; c < 3; c++) {
+        header.levels[c] = q.levels[c];
+    }
+    header.numBins = q.numBins;
+    header.stride = stride;
+    header.numRecords = numRecords;
+    header.recordOffset = COLOR_HIST_STORE_ALIGN;
+    header.pathOffset = header.recordOffset + numRecords * stride * (int64_t)sizeof(int32_t);
+    header.length = header.pathOffset + (numRecords + 1) * (int64_t)sizeof(int64_t) + pathStarts[numRecords];
+
+    std::string tmpFile = std::string(filename) + ".tmp";
+    FILE* fp = fopen(tmpFile.c_str(), "wb");
+    if (fp == NULL) {
+        std::cerr << "cannot open file: " << tmpFile << std::endl;
+        return false;
+    }
+    static const char zeros[COLOR_HIST_STORE_ALIGN] = { 0 };
+    fwrite(&header, sizeof header, 1, fp);
+    fwrite(zeros, 1, (size_t)(header.recordOffset - sizeof header), fp);
+    if (numRecords > 0) {
+        fwrite(&records[0], sizeof(int32_t), (size_t)(numRecords * stride), fp);
+    }
+    fwrite(&pathStarts[0], sizeof(int64_t), pathStarts.size(), fp);
+    for (int64_t i = 0; i < numRecords; i++) {
+        fwrite(paths[i].c_str(), 1, paths[i].size() + 1, fp);
+    }
+    if (fclose(fp) != 0 || rename(tmpFile.c_str(), filename) != 0) {
+        std::cerr << "cannot write file: " << filename << std::endl;
+        remove(tmpFile.c_str());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * 色ヒストグラムのファイルをmmapする
+ *
+ * @param[in]  filename  色ヒストグラムのファイル
+ * @param[out] store     mmapしたファイル（使い終わったらcloseColorHistStore()で解放）
+ *
+ * @return 成功ならtrue、失敗ならfalse
+ */
+inline bool openColorHistStore(const char* filename, ColorHistStore& store) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "cannot open file: " << filename << std::endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(ColorHistStoreHeader)) {
+        std::cerr << "invalid color histogram file: " << filename << std::endl;
+        close(fd);
+        return false;
+    }
+    size_t length = (size_t)st.st_size;
+    void* addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        std::cerr << "cannot mmap file: " << filename << std::endl;
+        return false;
+    }
+    // ヘッダの値とレコード、パスの表、パスの範囲を確かめ、利用側では範囲を確かめずに読めるようにする
+    const ColorHistStoreHeader* header = (const ColorHistStoreHeader*)addr;
+    bool valid = memcmp(header->magic, COLOR_HIST_STORE_MAGIC, sizeof header->magic) == 0 &&
+                 header->length == (int64_t)length && header->numRecords >= 0 &&
+                 header->numRecords < std::min((int64_t)INT_MAX, (int64_t)(length / sizeof(int64_t)));
+    int64_t numBins = 1;
+    for (int c = 0; c < 3 && valid; c++) {
+        valid = header->levels[c] >= 1 && header->levels[c] <= 256;
+        numBins *= valid ? header->levels[c] : 1;
+    }
+    valid = valid && header->numBins == numBins && header->stride == colorHistStride(header->numBins) &&
+            header->recordOffset >= (int64_t)sizeof(ColorHistStoreHeader) &&
+            header->recordOffset % COLOR_HIST_STORE_ALIGN == 0 && header->recordOffset <= header->length &&
+            header->numRecords <= (header->length - header->recordOffset) / ((int64_t)header->stride * 4) &&
+            header->recordOffset + header->numRecords * header->stride * (int64_t)sizeof(int32_t) <=
+                header->pathOffset &&
+            header->pathOffset <= header->length &&
+            (header->numRecords + 1) * (int64_t)sizeof(int64_t) <= header->length - header->pathOffset;
+    if (valid) {
+        // パスは昇順の位置に並び、それぞれNULで終わり、findColorHist()で二分探索できるように昇順であること
+        const int64_t* pathStarts = (const int64_t*)((const char*)addr + header->pathOffset);
+        const char* paths = (const char*)(pathStarts + header->numRecords + 1);
+        int64_t pathBytes = (const char*)addr + header->length - paths;
+        valid = pathStarts[0] == 0 && pathStarts[header->numRecords] <= pathBytes;
+        for (int64_t i = 0; i < header->numRecords && valid; i++) {
+            valid = pathStarts[i] < pathStarts[i + 1] && pathStarts[i + 1] <= pathBytes &&
+                    paths[pathStarts[i + 1] - 1] == '\0' &&
+                    (i == 0 || strcmp(paths + pathStarts[i - 1], paths + pathStarts[i]) < 0);
+        }
+    }
+    if (!valid) {
+        std::cerr << "invalid color histogram file: " << filename << std::endl;
+        munmap(addr, length);
+        return false;
+    }
+    madvise(addr, length, MADV_WILLNEED);
+
+    const char* base = (const char*)addr;
+    store = ColorHistStore();
+    store.addr = addr;
+    store.length = length;
+    for (int c = 0; c < 3; c++) {
+        store.levels[c] = header->levels[c];
+    }
+    store.numBins = header->numBins;
+    store.stride = header->stride;
+    store.numRecords = (int)header->numRecords;
+    store.records = (const int32_t*)(base + header->recordOffset);
+    store.pathStarts = (const int64_t*)(base + header->pathOffset);
+    store.paths = (const char*)(store.pathStarts + store.numRecords + 1);
+    return true;
+}
+
+/**
+ * mmapした色ヒストグラムのファイルを解放する
+ *
+ * @param[in,out] store  mmapしたファイル
+ */
+inline void closeColorHistStore(ColorHistStore& store) {
+    if (store.addr != NULL) {
+        munmap(store.addr, store.length);
+    }
+    store = ColorHistStore();
+}
+
+inline const int32_t* colorHistRecord(const ColorHistStore& store, int i) {
+    return store.records + (size_t)i * store.stride;
+}
+
+inline const char* colorHistPath(const ColorHistStore& store, int i) {
+    return store.paths + store.pathStarts[i];
+}
+
+/**
+ * パスから画像のレコードを二分探索する
+ *
+ * @param[in] store  mmapした色ヒストグラムのファイル
+ * @param[in] path   画像のパス
+ *
+ * @return レコードの番号、なければ-1
+ */
+inline int findColorHist(const ColorHistStore& store, const char* path) {
+    int lo = 0;
+    int hi = store.numRecords;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (strcmp(colorHistPath(store, mid), path) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < store.numRecords && strcmp(colorHistPath(store, lo), path) == 0 ? lo : -1;
+}
+
+#endif
@@ -0,0 +1,320 @@
+#ifndef COLOR_HISTOGRAM_H
+#define COLOR_HISTOGRAM_H
+
+#include <cv.h>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <stdint.h>
+#include "thread_pool.h"
+
+#if defined(__x86_64__)
+#define COLOR_HIST_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+ * 色ヒストグラムのカーネル
+ *
+ * RGBの各チャンネルを等分した段階の組をビンとして画素を数える（既定は4x4x4=64色）。
+ * 画素ごとの除算をなくすため、輝度からビン番号への寄与を表（ColorQuantizer）に持つ。
+ * 分割数が2のべきで全体のビン数が256以下なら、SSSE3で16画素ずつBGRを並べ替えて
+ * シフトとマスクでビン番号を求める。
+ *
+ * 1つのヒストグラムに連続して加算すると同じビンへの書き込みと読み出しが直列になるので、
+ * 隣り合う画素を COLOR_HIST_SUBHISTS 個の部分ヒストグラムに振り分けて最後に足す。
+ * 画像は行の帯に分けてスレッドプールで並列に数え、部分ヒストグラムはワーカーごとに持つ。
+ */
+
+const int COLOR_HIST_LEVELS = 4;      // 各チャンネルの分割数の既定値
+const int COLOR_HIST_SUBHISTS = 4;    // 隣り合う画素を振り分ける部分ヒストグラムの数
+const int COLOR_HIST_BAND_ROWS = 32;  // 1スレッドが一度に数える行数
+
+/**
+ * 輝度からビン番号を求める表
+ * ビン番号は 赤の段階 * (緑の分割数 * 青の分割数) + 緑の段階 * 青の分割数 + 青の段階
+ * （4x4x4なら 16 * (赤/64) + 4 * (緑/64) + 青/64）
+ */
+struct ColorQuantizer {
+    int levels[3];         // 赤、緑、青の分割数
+    int bits[3];           // 分割数が2のべきならそのビット数（でなければ-1）
+    int numBins;           // ビン数
+    bool simd;             // シフトとマスクでビン番号を求められるか
+    uint16_t lut[3][256];  // 赤、緑、青の輝度 -> ビン番号への寄与
+};
+
+/**
+ * ビン番号の表を作る
+ *
+ * @param[in]  red    赤の分割数（1〜256）
+ * @param[in]  green  緑の分割数（1〜256）
+ * @param[in]  blue   青の分割数（1〜256）
+ * @param[out] q      ビン番号の表
+ *
+ * @return 成功ならtrue、分割数が範囲外かビン数が65536を超えればfalse
+ */
+inline bool initColorQuantizer(int red, int green, int blue, ColorQuantizer& q) {
+    int levels[3] = { red, green, blue };
+    for (int c = 0; c < 3; c++) {
+        if (levels[c] < 1 || levels[c] > 256) {
+            return false;
+        }
+    }
+    if (red * green * blue > 65536) {
+        return false;
+    }
+    int stride[3] = { green * blue, blue, 1 };
+    int totalBits = 0;
+    q.simd = true;
+    for (int c = 0; c < 3; c++) {
+        q.levels[c] = levels[c];
+        q.bits[c] = -1;
+        for (int b = 0; b <= 8; b++) {
+            if ((1 << b) == levels[c]) {
+                q.bits[c] = b;
+            }
+        }
+        q.simd = q.simd && q.bits[c] >= 0;
+        totalBits += std::max(q.bits[c], 0);
+        for (int v = 0; v < 256; v++) {
+            q.lut[c][v] = (uint16_t)(v * levels[c] / 256 * stride[c]);
+        }
+    }
+    q.numBins = red * green * blue;
+    q.simd = q.simd && totalBits <= 8;  // ビン番号が1バイトに収まる
+    return true;
+}
+
+/**
+ * 1行分の画素を部分ヒストグラムに数える関数
+ *
+ * @param[in]     row    BGRの画素の並び
+ * @param[in]     width  画素数
+ * @param[in]     q      ビン番号の表
+ * @param[in,out] sub    COLOR_HIST_SUBHISTS個の部分ヒストグラム（各numBins個）
+ */
+typedef void (*ColorHistRowFunc)(const uint8_t* row, int width, const ColorQuantizer& q, uint32_t* sub);
+
+/**
+ * 1行分の画素を数える（スカラー版、表を引いて足すだけで除算はしない）
+ */
+inline void colorHistRowScalar(const uint8_t* row, int width, const ColorQuantizer& q, uint32_t* sub) {
+    const uint16_t* lr = q.lut[0];
+    const uint16_t* lg = q.lut[1];
+    const uint16_t* lb = q.lut[2];
+    uint32_t* h0 = sub;
+    uint32_t* h1 = sub + q.numBins;
+    uint32_t* h2 = sub + 2 * q.numBins;
+    uint32_t* h3 = sub + 3 * q.numBins;
+    int x = 0;
+    for (; x + 4 <= width; x += 4, row += 12) {
+        h0[lr[row[2]] + lg[row[1]] + lb[row[0]]]++;
+        h1[lr[row[5]] + lg[row[4]] + lb[row[3]]]++;
+        h2[lr[row[8]] + lg[row[7]] + lb[row[6]]]++;
+        h3[lr[row[11]] + lg[row[10]] + lb[row[9]]]++;
+    }
+    for (; x < width; x++, row += 3) {
+        h0[lr[row[2]] + lg[row[1]] + lb[row[0]]]++;
+    }
+}
+
+#ifdef COLOR_HIST_X86
+
+/**
+ * 48バイト（16画素）のBGRからチャンネルcの16バイトを集めるpshufbのマスク
+ * masks[c][s]は s番目の16バイトからチャンネルcの輝度を取り出す（取らない位置は0x80）
+ */
+struct ColorShuffleMasks {
+    uint8_t masks[3][3][16];
+
+    ColorShuffleMasks() {
+        memset(masks, 0x80, sizeof masks);
+        for (int c = 0; c < 3; c++) {
+            for (int i = 0; i < 16; i++) {
+                int index = 3 * i + c;
+                masks[c][index / 16][i] = (uint8_t)(index % 16);
+            }
+        }
+    }
+};
+
+__attribute__((target("ssse3")))
+inline __m128i colorHistGather(__m128i a0, __m128i a1, __m128i a2, const uint8_t masks[3][16]) {
+    __m128i v = _mm_shuffle_epi8(a0, _mm_loadu_si128((const __m128i*)masks[0]));
+    v = _mm_or_si128(v, _mm_shuffle_epi8(a1, _mm_loadu_si128((const __m128i*)masks[1])));
+    return _mm_or_si128(v, _mm_shuffle_epi8(a2, _mm_loadu_si128((const __m128i*)masks[2])));
+}
+
+/**
+ * チャンネルの16バイトの輝度を段階にしてビン番号の位置までずらす
+ * 16ビット単位のシフトで隣のバイトから入ったビットはマスクで落とす
+ */
+__attribute__((target("ssse3")))
+inline __m128i colorHistLevel(__m128i v, int bits, int offset) {
+    v = _mm_srl_epi16(v, _mm_cvtsi32_si128(8 - bits));
+    v = _mm_and_si128(v, _mm_set1_epi8((char)((1 << bits) - 1)));
+    return _mm_sll_epi16(v, _mm_cvtsi32_si128(offset));
+}
+
+/**
+ * 1行分の画素を数える（SSSE3版、16画素ずつビン番号を求める）
+ */
+__attribute__((target("ssse3")))
+inline void colorHistRowSSSE3(const uint8_t* row, int width, const ColorQuantizer& q, uint32_t* sub) {
+    if (!q.simd) {
+        colorHistRowScalar(row, width, q, sub);
+        return;
+    }
+    static const ColorShuffleMasks shuffle;
+    int n = q.numBins;
+    int redOffset = q.bits[1] + q.bits[2];
+    int greenOffset = q.bits[2];
+    uint32_t* h0 = sub;
+    uint32_t* h1 = sub + n;
+    uint32_t* h2 = sub + 2 * n;
+    uint32_t* h3 = sub + 3 * n;
+    int x = 0;
+    for (; x + 16 <= width; x += 16, row += 48) {
+        __m128i a0 = _mm_loadu_si128((const __m128i*)row);
+        __m128i a1 = _mm_loadu_si128((const __m128i*)(row + 16));
+        __m128i a2 = _mm_loadu_si128((const __m128i*)(row + 32));
+        __m128i b = colorHistLevel(colorHistGather(a0, a1, a2, shuffle.masks[0]), q.bits[2], 0);
+        __m128i g = colorHistLevel(colorHistGather(a0, a1, a2, shuffle.masks[1]), q.bits[1], greenOffset);
+        __m128i r = colorHistLevel(colorHistGather(a0, a1, a2, shuffle.masks[2]), q.bits[0], redOffset);
+        __m128i bins = _mm_or_si128(_mm_or_si128(r, g), b);
+
+        // メモリを経由せずに8画素ずつ汎用レジスタに移してビン番号を1バイトずつ取り出す
+        uint64_t lo = (uint64_t)_mm_cvtsi128_si64(bins);
+        uint64_t hi = (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(bins, bins));
+        for (int j = 0; j < 64; j += 32) {
+            h0[(lo >> j) & 0xFF]++;
+            h1[(lo >> (j + 8)) & 0xFF]++;
+            h2[(lo >> (j + 16)) & 0xFF]++;
+            h3[(lo >> (j + 24)) & 0xFF]++;
+        }
+        for (int j = 0; j < 64; j += 32) {
+            h0[(hi >> j) & 0xFF]++;
+            h1[(hi >> (j + 8)) & 0xFF]++;
+            h2[(hi >> (j + 16)) & 0xFF]++;
+            h3[(hi >> (j + 24)) & 0xFF]++;
+        }
+    }
+    colorHistRowScalar(row, width - x, q, sub);
+}
+
+#endif  // COLOR_HIST_X86
+
+/**
+ * 実行中のCPUで使える一番速いカーネルを返す
+ *
+ * @param[out] name  選んだ実装の名前（NULL可）
+ *
+ * @return 1行分の画素を数える関数
+ */
+inline ColorHistRowFunc selectColorHistRow(const char** name = 0) {
+    ColorHistRowFunc func = colorHistRowScalar;
+    const char* selected = "scalar";
+#ifdef COLOR_HIST_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        func = colorHistRowSSSE3;
+        selected = "ssse3";
+    }
+#endif
+    if (name != 0) {
+        *name = selected;
+    }
+    return func;
+}
+
+/**
+ * 選択済みのカーネルを返す（最初の呼び出しで1回だけCPUを調べる）
+ */
+inline ColorHistRowFunc colorHistRow() {
+    static const ColorHistRowFunc func = selectColorHistRow();
+    return func;
+}
+
+/**
+ * 画像の行の範囲を部分ヒストグラムに数える
+ *
+ * @param[in]     data   先頭の行
+ * @param[in]     width  幅
+ * @param[in]     begin  最初の行
+ * @param[in]     end    最後の行の次
+ * @param[in]     step   1行のバイト数
+ * @param[in]     q      ビン番号の表
+ * @param[in,out] sub    COLOR_HIST_SUBHISTS個の部分ヒストグラム（各q.numBins個）
+ */
+inline void accumulateColorHistogram(const uint8_t* data, int width, int begin, int end, int step,
+                                     const ColorQuantizer& q, uint32_t* sub) {
+    ColorHistRowFunc rowFunc = colorHistRow();
+    for (int y = begin; y < end; y++) {
+        rowFunc(data + (size_t)y * step, width, q, sub);
+    }
+}
+
+/**
+ * 部分ヒストグラムを足し合わせる
+ *
+ * @param[in]  subs       部分ヒストグラム（numSubs x numBins）
+ * @param[in]  numSubs    部分ヒストグラムの数
+ * @param[in]  numBins    ビン数
+ * @param[out] histogram  各ビンの画素数
+ */
+inline void mergeColorHistogram(const uint32_t* subs, size_t numSubs, int numBins, int* histogram) {
+    for (int i = 0; i < numBins; i++) {
+        histogram[i] = 0;
+    }
+    for (size_t s = 0; s < numSubs; s++) {
+        const uint32_t* sub = subs + s * numBins;
+        for (int i = 0; i < numBins; i++) {
+            histogram[i] += (int)sub[i];
+        }
+    }
+}
+
+/**
+ * BGRの画素の色ヒストグラムを数える
+ *
+ * @param[in]  data       先頭の行
+ * @param[in]  width      幅
+ * @param[in]  height     高さ
+ * @param[in]  step       1行のバイト数
+ * @param[in]  q          ビン番号の表
+ * @param[in]  pool       行の帯を並列に数えるスレッドプール
+ * @param[out] histogram  各ビンの画素数（q.numBins個）
+ */
+inline void calcColorHistogram(const uint8_t* data, int width, int height, int step, const ColorQuantizer& q,
+                               ThreadPool& pool, std::vector<int>& histogram) {
+    int n = q.numBins;
+    int stride = COLOR_HIST_SUBHISTS * n;
+    std::vector<uint32_t> subs((size_t)pool.size() * stride, 0);
+    pool.parallelFor(height, COLOR_HIST_BAND_ROWS, [&](int begin, int end, int worker) {
+        accumulateColorHistogram(data, width, begin, end, step, q, &subs[(size_t)worker * stride]);
+    });
+    histogram.resize(n);
+    mergeColorHistogram(&subs[0], subs.size() / n, n, &histogram[0]);
+}
+
+/**
+ * 画像の色ヒストグラムを数える
+ *
+ * @param[in]  img        3チャンネル8ビットのBGR画像
+ * @param[in]  q          ビン番号の表
+ * @param[in]  pool       行の帯を並列に数えるスレッドプール
+ * @param[out] histogram  各ビンの画素数（q.numBins個）
+ *
+ * @return 成功ならtrue、画像の形式が違えばfalse
+ */
+inline bool calcColorHistogram(const IplImage* img, const ColorQuantizer& q, ThreadPool& pool,
+                               std::vector<int>& histogram) {
+    if (img->nChannels != 3 || img->depth != IPL_DEPTH_8U) {
+        return false;
+    }
+    calcColorHistogram((const uint8_t*)img->imageData, img->width, img->height, img->widthStep, q, pool,
+                       histogram);
+    return true;
+}
+
+#endif
@@ -0,0 +1,131 @@
+#include <cv.h>
+#include <highgui.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cstring>
+#include "options.h"
+#include "thread_pool.h"
+#include "color_histogram.h"
+#include "color_hist_store.h"
+#include "color_search.h"
+
+using namespace std;
+
+const char* COLOR_HIST_FILE = "color_histograms.bin";  // hist.exe -batch で作成
+const int TOP_K = 10;                                   // 表示する検索結果の数
+
+/**
+ * 色ヒストグラムの類似画像検索
+ * color_search [-hist ファイル] [-k 検索結果の数] [-metric intersect|chi2|l1] [-noprune] [-t スレッド数]
+ * クエリはファイル中の画像のパスかファイル名、どちらでもなければ画像ファイルとしてロードしてヒストグラムを計算する
+ */
+int main(int argc, char** argv) {
+    double tt = (double)cvGetTickCount();
+
+    const char* histFile = stringOption(argc, argv, "-hist", COLOR_HIST_FILE);
+    int topK = intOption(argc, argv, "-k", TOP_K);
+    int metric = parseColorMetric(stringOption(argc, argv, "-metric", COLOR_METRIC_NAMES[COLOR_INTERSECT]));
+    bool prune = !hasOption(argc, argv, "-noprune");
+    if (metric < 0 || topK < 1) {
+        cerr << "usage: color_search [-hist file] [-k N] [-metric intersect|chi2|l1] [-noprune] [-t N]" << endl;
+        return 1;
+    }
+    ThreadPool pool(parseThreadOption(argc, argv));
+
+    cout << "色ヒストグラムをロードします ... " << flush;
+    ColorHistStore store;
+    if (!openColorHistStore(histFile, store)) {
+        cerr << "cannot load color histogram file" << endl;
+        return 1;
+    }
+    ColorIndex index;
+    if (!buildColorIndex(store, pool, index)) {
+        cerr << "invalid color histogram levels: " << histFile << endl;
+        return 1;
+    }
+    cout << "OK" << endl;
+
+    // 画像のパスはファイルを二分探索して引き、ファイル名（ディレクトリ名を除いたもの）は表で引く
+    // パスの表示にも使うのでファイルは最後まで閉じない
+    map<string, int> name2id;
+    for (int i = 0; i < index.numRecords; i++) {
+        const char* slash = strrchr(colorHistPath(store, i), '/');
+        if (slash != NULL) {
+            name2id.insert(make_pair(string(slash + 1), i));
+        }
+    }
+
+    // ファイルにない画像はファイルと同じ分割数でヒストグラムを計算する
+    ColorQuantizer q;
+    if (!initColorQuantizer(index.levels[0], index.levels[1], index.levels[2], q)) {
+        cerr << "invalid number of bins: " << index.levels[0] << "," << index.levels[1] << "," << index.levels[2]
+             << endl;
+        closeColorHistStore(store);
+        return 1;
+    }
+
+    const char* kernel;
+    selectColorDist((ColorMetric)metric, &kernel);
+    cout << "画像数: " << index.numRecords << endl;
+    cout << "ビン数: " << index.numBins << " (" << index.levels[0] << "x" << index.levels[1] << "x" << index.levels[2]
+         << ")" << endl;
+    cout << "距離: " << COLOR_METRIC_NAMES[metric] << " (" << kernel << (prune ? ", 粗い段で絞り込み" : "") << ")"
+         << endl;
+    tt = (double)cvGetTickCount() - tt;
+    cout << "Loading Index Time = " << tt / (cvGetTickFrequency() * 1000.0) << "ms" << endl;
+
+    vector<float> query(index.stride);
+    vector<float> coarse(COLOR_COARSE_BINS);
+    vector<int> counts;
+    vector<int> ids;
+    vector<float> dists;
+    while (1) {
+        string input;
+        cout << "query? > ";
+        if (!(cin >> input)) {
+            break;
+        }
+
+        tt = (double)cvGetTickCount();
+
+        int id = findColorHist(store, input.c_str());
+        if (id < 0) {
+            map<string, int>::iterator it = name2id.find(input);
+            id = it != name2id.end() ? it->second : -1;
+        }
+        if (id >= 0) {
+            cout << colorHistPath(store, id) << endl;
+            copy(&index.hists[(size_t)id * index.stride], &index.hists[(size_t)(id + 1) * index.stride], query.begin());
+            copy(&index.coarse[(size_t)id * COLOR_COARSE_BINS], &index.coarse[(size_t)(id + 1) * COLOR_COARSE_BINS],
+                 coarse.begin());
+        } else {
+            IplImage* img = cvLoadImage(input.c_str(), CV_LOAD_IMAGE_COLOR);
+            if (img == NULL) {
+                cerr << "no histogram for image: " << input << endl;
+                continue;
+            }
+            calcColorHistogram(img, q, pool, counts);
+            cvReleaseImage(&img);
+            cout << input << endl;
+            normalizeColorHistogram(index, &counts[0], &query[0], &coarse[0]);
+        }
+
+        // 全画像を並列に走査してk-NNを求める
+        int compared = searchColorIndex(index, &query[0], prune ? &coarse[0] : NULL, (ColorMetric)metric, topK, pool,
+                                        ids, dists);
+
+        // 検索結果を距離の昇順に表示
+        for (size_t i = 0; i < ids.size(); i++) {
+            cout << i + 1 << "\t" << colorHistPath(store, ids[i]) << "\t" << dists[i] << endl;
+        }
+        cout << "比較した画像数: " << compared << " / " << index.numRecords << endl;
+
+        tt = (double)cvGetTickCount() - tt;
+        cout << "Retrieval Time = " << tt / (cvGetTickFrequency() * 1000.0) << "ms" << endl;
+    }
+
+    closeColorHistStore(store);
+    return 0;
+}
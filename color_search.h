@@ -0,0 +1,393 @@
+#ifndef COLOR_SEARCH_H
+#define COLOR_SEARCH_H
+
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <stdint.h>
+#include "simd_nn.h"
+#include "knn.h"
+#include "thread_pool.h"
+#include "color_hist_store.h"
+
+/*
+ * 色ヒストグラムの類似画像検索
+ *
+ * 画素数で正規化したヒストグラムをレコードと同じ幅（64バイト境界）のfloatの配列に並べ、
+ * クエリとの距離を全件走査してk-NNを求める。距離は小さいほど似ている。
+ *   intersect  1 - Σmin(a, b)（ヒストグラムインターセクション）
+ *   chi2       Σ(a - b)^2 / (a + b)
+ *   l1         Σ|a - b|
+ * 距離カーネルは32ビンごとに途中までの値をk番目の距離と比べて打ち切る。
+ * intersectは途中までの Σmin に残りのビンで増やせる分を足しても届かなければ打ち切る。
+ *
+ * 粗い段では各チャンネルを2段階にまとめた8ビンのヒストグラムで同じ距離を測る。
+ * ビンをまとめると3つの距離はどれも小さくなる（chi2はCauchy-Schwarzの不等式による）ので、
+ * 粗い距離がk番目の距離を超えた画像は細かいヒストグラムを見ずに捨てても結果は変わらない。
+ */
+
+enum ColorMetric {
+    COLOR_INTERSECT = 0,
+    COLOR_CHI2 = 1,
+    COLOR_L1 = 2
+};
+
+const char* const COLOR_METRIC_NAMES[] = { "intersect", "chi2", "l1" };
+const int NUM_COLOR_METRICS = 3;
+
+const int COLOR_DIST_BLOCK = 32;      // 打ち切りを調べるビンの間隔
+const int COLOR_COARSE_BINS = 8;      // 粗い段のビン数（2x2x2）
+const int COLOR_SEARCH_CHUNK = 4096;  // 1スレッドが一度に走査する画像数
+
+/**
+ * @param[in] a      ヒストグラム1（長さは8の倍数）
+ * @param[in] b      ヒストグラム2
+ * @param[in] n      ビン数
+ * @param[in] bound  これを超えたら計算を打ち切る距離
+ *
+ * @return 距離（打ち切った場合はboundより大きい値）
+ */
+typedef float (*ColorDistFunc)(const float* a, const float* b, int n, float bound);
+
+/**
+ * 途中までの和から距離（intersectなら最終的な距離の下限）を求める
+ */
+template <int Metric>
+inline float colorDistValue(float sum, float sumA, float sumB) {
+    return Metric == COLOR_INTERSECT ? std::max(sumA, sumB) - sum : sum;
+}
+
+template <int Metric>
+inline float colorDistScalar(const float* a, const float* b, int n, float bound) {
+    float sum = 0.0f;
+    float sumA = 0.0f;
+    float sumB = 0.0f;
+    for (int i = 0; i < n;) {
+        int end = std::min(i + COLOR_DIST_BLOCK, n);
+        for (; i < end; i++) {
+            if (Metric == COLOR_L1) {
+                sum += fabsf(a[i] - b[i]);
+            } else if (Metric == COLOR_CHI2) {
+                float s = a[i] + b[i];
+                if (s > 0.0f) {
+                    float d = a[i] - b[i];
+                    sum += d * d / s;
+                }
+            } else {
+                sum += std::min(a[i], b[i]);
+                sumA += a[i];
+                sumB += b[i];
+            }
+        }
+        float partial = colorDistValue<Metric>(sum, sumA, sumB);
+        if (partial > bound) {
+            return partial;
+        }
+    }
+    return colorDistValue<Metric>(sum, sumA, sumB);
+}
+
+#ifdef SIMD_NN_X86
+
+template <int Metric>
+__attribute__((target("sse2")))
+inline float colorDistSSE(const float* a, const float* b, int n, float bound) {
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 acc = zero;
+    __m128 accA = zero;
+    __m128 accB = zero;
+    float partial = 0.0f;
+    for (int i = 0; i < n;) {
+        int end = std::min(i + COLOR_DIST_BLOCK, n);
+        for (; i < end; i += 4) {
+            __m128 va = _mm_loadu_ps(a + i);
+            __m128 vb = _mm_loadu_ps(b + i);
+            if (Metric == COLOR_L1) {
+                acc = _mm_add_ps(acc, _mm_and_ps(_mm_sub_ps(va, vb), absMask));
+            } else if (Metric == COLOR_CHI2) {
+                // 0/0のビンはNaNになるのでa + b > 0のマスクで落とす
+                __m128 s = _mm_add_ps(va, vb);
+                __m128 d = _mm_sub_ps(va, vb);
+                __m128 q = _mm_div_ps(_mm_mul_ps(d, d), s);
+                acc = _mm_add_ps(acc, _mm_and_ps(q, _mm_cmpgt_ps(s, zero)));
+            } else {
+                acc = _mm_add_ps(acc, _mm_min_ps(va, vb));
+                accA = _mm_add_ps(accA, va);
+                accB = _mm_add_ps(accB, vb);
+            }
+        }
+        partial = colorDistValue<Metric>(simdHsum128(acc), simdHsum128(accA), simdHsum128(accB));
+        if (partial > bound) {
+            return partial;
+        }
+    }
+    return partial;
+}
+
+__attribute__((target("avx2,fma")))
+inline float colorHsum256(__m256 v) {
+    return simdHsum128(_mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+}
+
+template <int Metric>
+__attribute__((target("avx2,fma")))
+inline float colorDistAVX2(const float* a, const float* b, int n, float bound) {
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256 acc = zero;
+    __m256 accA = zero;
+    __m256 accB = zero;
+    float partial = 0.0f;
+    for (int i = 0; i < n;) {
+        int end = std::min(i + COLOR_DIST_BLOCK, n);
+        for (; i < end; i += 8) {
+            __m256 va = _mm256_loadu_ps(a + i);
+            __m256 vb = _mm256_loadu_ps(b + i);
+            if (Metric == COLOR_L1) {
+                acc = _mm256_add_ps(acc, _mm256_and_ps(_mm256_sub_ps(va, vb), absMask));
+            } else if (Metric == COLOR_CHI2) {
+                __m256 s = _mm256_add_ps(va, vb);
+                __m256 d = _mm256_sub_ps(va, vb);
+                __m256 q = _mm256_div_ps(_mm256_mul_ps(d, d), s);
+                acc = _mm256_add_ps(acc, _mm256_and_ps(q, _mm256_cmp_ps(s, zero, _CMP_GT_OQ)));
+            } else {
+                acc = _mm256_add_ps(acc, _mm256_min_ps(va, vb));
+                accA = _mm256_add_ps(accA, va);
+                accB = _mm256_add_ps(accB, vb);
+            }
+        }
+        partial = colorDistValue<Metric>(colorHsum256(acc), colorHsum256(accA), colorHsum256(accB));
+        if (partial > bound) {
+            return partial;
+        }
+    }
+    return partial;
+}
+
+#endif  // SIMD_NN_X86
+
+template <int Metric>
+inline ColorDistFunc selectColorDistFor(const char** name) {
+    ColorDistFunc func = colorDistScalar<Metric>;
+    const char* selected = "scalar";
+#ifdef SIMD_NN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        func = colorDistAVX2<Metric>;
+        selected = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        func = colorDistSSE<Metric>;
+        selected = "sse";
+    }
+#endif
+    if (name != 0) {
+        *name = selected;
+    }
+    return func;
+}
+
+/**
+ * 実行中のCPUで使える一番速い距離カーネルを返す
+ *
+ * @param[in]  metric  距離の種類
+ * @param[out] name    選んだ実装の名前（NULL可）
+ *
+ * @return 距離カーネルの関数ポインタ
+ */
+inline ColorDistFunc selectColorDist(ColorMetric metric, const char** name = 0) {
+    switch (metric) {
+    case COLOR_CHI2:
+        return selectColorDistFor<COLOR_CHI2>(name);
+    case COLOR_L1:
+        return selectColorDistFor<COLOR_L1>(name);
+    default:
+        return selectColorDistFor<COLOR_INTERSECT>(name);
+    }
+}
+
+/**
+ * 選択済みの距離カーネルを返す（最初の呼び出しで1回だけCPUを調べる）
+ */
+inline ColorDistFunc colorDist(ColorMetric metric) {
+    static const ColorDistFunc funcs[NUM_COLOR_METRICS] = {
+        selectColorDist(COLOR_INTERSECT), selectColorDist(COLOR_CHI2), selectColorDist(COLOR_L1)
+    };
+    return funcs[metric];
+}
+
+/**
+ * @param[in] name  距離の名前（intersect、chi2、l1）
+ * @return 距離の種類、知らない名前なら-1
+ */
+inline int parseColorMetric(const char* name) {
+    for (int m = 0; m < NUM_COLOR_METRICS; m++) {
+        if (strcmp(name, COLOR_METRIC_NAMES[m]) == 0) {
+            return m;
+        }
+    }
+    return -1;
+}
+
+/**
+ * 色ヒストグラムの検索用インデックス
+ */
+struct ColorIndex {
+    int levels[3];              // 赤、緑、青の分割数
+    int numBins;                // ビン数
+    int stride;                 // 1画像のfloatの数（64バイト境界、余りは0）
+    int numRecords;             // 画像数
+    std::vector<float> hists;   // 正規化したヒストグラム（numRecords x stride）
+    std::vector<float> coarse;  // 粗い段のヒストグラム（numRecords x COLOR_COARSE_BINS）
+    std::vector<int> coarseMap; // 細かいビン -> 粗いビン
+};
+
+/**
+ * 画素数を合計1に正規化し、粗い段のヒストグラムも作る
+ *
+ * @param[in]  index   ビンの数と対応表
+ * @param[in]  counts  各ビンの画素数
+ * @param[out] hist    正規化したヒストグラム（index.stride個）
+ * @param[out] coarse  粗い段のヒストグラム（COLOR_COARSE_BINS個）
+ */
+inline void normalizeColorHistogram(const ColorIndex& index, const int32_t* counts, float* hist, float* coarse) {
+    double total = 0.0;
+    for (int i = 0; i < index.numBins; i++) {
+        total += counts[i];
+    }
+    float scale = total > 0.0 ? (float)(1.0 / total) : 0.0f;
+    std::fill(hist, hist + index.stride, 0.0f);
+    std::fill(coarse, coarse + COLOR_COARSE_BINS, 0.0f);
+    for (int i = 0; i < index.numBins; i++) {
+        hist[i] = counts[i] * scale;
+        coarse[index.coarseMap[i]] += hist[i];
+    }
+}
+
+/**
+ * ヒストグラムのファイルから検索用インデックスを作る
+ *
+ * @param[in]  store  mmapした色ヒストグラムのファイル
+ * @param[in]  pool   正規化に使うスレッドプール
+ * @param[out] index  検索用インデックス
+ *
+ * @return 成功ならtrue、分割数が不正（0以下、または積がビン数と一致しない）ならfalse
+ */
+inline bool buildColorIndex(const ColorHistStore& store, ThreadPool& pool, ColorIndex& index) {
+    int64_t numBins = 1;
+    for (int c = 0; c < 3; c++) {
+        if (store.levels[c] < 1) {
+            return false;
+        }
+        numBins *= store.levels[c];
+    }
+    if (numBins != store.numBins) {
+        return false;
+    }
+    for (int c = 0; c < 3; c++) {
+        index.levels[c] = store.levels[c];
+    }
+    index.numBins = store.numBins;
+    index.stride = colorHistStride(store.numBins);
+    index.numRecords = store.numRecords;
+
+    // 各チャンネルの段階を前半と後半の2段階にまとめる
+    int levels[3] = { store.levels[0], store.levels[1], store.levels[2] };
+    index.coarseMap.resize(index.numBins);
+    for (int i = 0; i < index.numBins; i++) {
+        int r = i / (levels[1] * levels[2]);
+        int g = i / levels[2] % levels[1];
+        int b = i % levels[2];
+        index.coarseMap[i] = (r * 2 / levels[0]) * 4 + (g * 2 / levels[1]) * 2 + b * 2 / levels[2];
+    }
+
+    index.hists.resize((size_t)index.numRecords * index.stride);
+    index.coarse.resize((size_t)index.numRecords * COLOR_COARSE_BINS);
+    pool.parallelFor(index.numRecords, COLOR_SEARCH_CHUNK, [&](int begin, int end, int worker) {
+        for (int r = begin; r < end; r++) {
+            normalizeColorHistogram(index, colorHistRecord(store, r), &index.hists[(size_t)r * index.stride],
+                                    &index.coarse[(size_t)r * COLOR_COARSE_BINS]);
+        }
+    });
+    return true;
+}
+
+/**
+ * 全スレッドで共有するk番目の距離の上限を下げる
+ * どれか1つのスレッドがk個見つけていれば、全体のk番目の距離はそのk番目の距離以下になる
+ */
+inline void lowerSharedBound(std::atomic<float>& shared, float bound) {
+    float current = shared.load(std::memory_order_relaxed);
+    while (bound < current && !shared.compare_exchange_weak(current, bound, std::memory_order_relaxed)) {
+    }
+}
+
+/**
+ * クエリに近い色ヒストグラムのk-NNを全件走査で求める
+ * 画像をチャンクに分けて並列に走査し、スレッドごとのk-NNを最後にまとめる
+ *
+ * @param[in]  index   検索用インデックス
+ * @param[in]  query   クエリの正規化したヒストグラム（index.stride個）
+ * @param[in]  coarse  クエリの粗い段のヒストグラム（NULLなら粗い段で絞り込まない）
+ * @param[in]  metric  距離の種類
+ * @param[in]  k       求める近傍の数
+ * @param[in]  pool    走査に使うスレッドプール
+ * @param[out] ids     近い順の画像の番号（見つかった数だけ）
+ * @param[out] dists   その距離
+ *
+ * @return 細かいヒストグラムで距離を計算した画像数
+ */
+inline int searchColorIndex(const ColorIndex& index, const float* query, const float* coarse, ColorMetric metric,
+                            int k, ThreadPool& pool, std::vector<int>& ids, std::vector<float>& dists) {
+    ColorDistFunc dist = colorDist(metric);
+
+    std::vector<KNearest> heaps(pool.size());
+    for (size_t w = 0; w < heaps.size(); w++) {
+        heaps[w].reset(k);
+    }
+    std::vector<int> compared(pool.size(), 0);
+    std::atomic<float> shared(FLT_MAX);
+    pool.parallelFor(index.numRecords, COLOR_SEARCH_CHUNK, [&](int begin, int end, int worker) {
+        KNearest& heap = heaps[worker];
+        int n = 0;
+        for (int r = begin; r < end; r++) {
+            float bound = std::min(heap.bound(), shared.load(std::memory_order_relaxed));
+            if (coarse != NULL &&
+                dist(coarse, &index.coarse[(size_t)r * COLOR_COARSE_BINS], COLOR_COARSE_BINS, bound) > bound) {
+                continue;
+            }
+            n++;
+            float d = dist(query, &index.hists[(size_t)r * index.stride], index.stride, bound);
+            if (d < bound) {
+                heap.push(d, r);
+                lowerSharedBound(shared, heap.bound());
+            }
+        }
+        compared[worker] += n;
+    });
+
+    // スレッドごとのk-NNをまとめる
+    KNearest result;
+    result.reset(k);
+    std::vector<int> workerIds(k);
+    std::vector<float> workerDists(k);
+    int total = 0;
+    for (size_t w = 0; w < heaps.size(); w++) {
+        heaps[w].sorted(&workerIds[0], &workerDists[0]);
+        for (int j = 0; j < k && workerIds[j] >= 0; j++) {
+            result.push(workerDists[j], workerIds[j]);
+        }
+        total += compared[w];
+    }
+    ids.resize(k);
+    dists.resize(k);
+    result.sorted(&ids[0], &dists[0]);
+    ids.resize(result.size());
+    dists.resize(result.size());
+    return total;
+}
+
+#endif
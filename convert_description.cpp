@@ -0,0 +1,41 @@
+#include <cv.h>
+#include <iostream>
+#include "descdb.h"
+
+using namespace std;
+
+const int DIM = 128;
+
+const char* DESC_FILE = "../dataset/description_caltech101_10.txt";
+const char* DESC_DB_FILE = "../dataset/description_caltech101_10.db";
+
+/**
+ * テキスト形式の特徴量ファイルを認識プログラム用のバイナリ形式に変換する
+ * convert_description [入力テキストファイル] [出力バイナリファイル]
+ */
+int main(int argc, char** argv) {
+    const char* tsvFile = argc > 1 ? argv[1] : DESC_FILE;
+    const char* dbFile = argc > 2 ? argv[2] : DESC_DB_FILE;
+
+    double tt = (double)cvGetTickCount();
+
+    cout << tsvFile << " -> " << dbFile << " ... " << flush;
+    if (!convertDescription(tsvFile, dbFile, DIM)) {
+        cerr << "cannot convert description file" << endl;
+        return 1;
+    }
+    cout << "OK" << endl;
+
+    DescDB db;
+    if (!openDescDB(dbFile, db)) {
+        cerr << "cannot open descriptor database" << endl;
+        return 1;
+    }
+    cout << "データベース中のキーポイント数: " << db.rows << endl;
+    closeDescDB(db);
+
+    tt = (double)cvGetTickCount() - tt;
+    cout << "Converting Time = " << tt / (cvGetTickFrequency() * 1000.0) << "ms" << endl;
+
+    return 0;
+}
@@ -0,0 +1,417 @@
+#ifndef DESCDB_H
+#define DESCDB_H
+
+#include <cv.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * 物体モデルデータベースのバイナリ形式
+ *
+ *   DescDBHeader                     64バイト
+ *   float descriptors[rows][dim]     descOffset から（64バイト境界）
+ *   int32 labels[rows]               labelOffset から
+ *   int32 laplacians[rows]           lapOffset から
+ *
+ * 数値はすべてネイティブのバイトオーダー。mmapした領域をそのままCvMatとして使えるように
+ * 特徴ベクトルは行優先で隙間なく並べる。
+ * 行はラプラシアンの符号ごとにまとめて並べるので、符号で分けた区画もコピーせずに参照できる。
+ */
+
+const char DESCDB_MAGIC[8] = { 'V', 'W', 'D', 'E', 'S', 'C', 'D', 'B' };
+const int32_t DESCDB_VERSION = 1;
+const int64_t DESCDB_ALIGN = 64;
+
+struct DescDBHeader {
+    char magic[8];
+    int32_t version;
+    int32_t dim;          // 特徴ベクトルの次元数
+    int64_t rows;         // キーポイント数
+    int64_t descOffset;   // 特徴ベクトルブロックの先頭オフセット
+    int64_t labelOffset;  // ラベル配列の先頭オフセット
+    int64_t lapOffset;    // ラプラシアン配列の先頭オフセット
+    char reserved[16];
+};
+
+/**
+ * mmapした物体モデルデータベース
+ */
+struct DescDB {
+    void* addr;           // mmapした領域
+    size_t length;        // 領域のバイト数
+    int rows;
+    int dim;
+    float* descriptors;   // rows x dim の特徴ベクトル（mmap領域を直接指す）
+    int* labels;
+    int* laplacians;
+
+    DescDB() : addr(NULL), length(0), rows(0), dim(0), descriptors(NULL), labels(NULL), laplacians(NULL) {}
+};
+
+const int NUM_LAP_PARTITIONS = 2;  // ラプラシアンの符号による区画の数
+
+/**
+ * ラプラシアンからそのキーポイントが属する区画番号を返す
+ *
+ * @param[in] laplacian  キーポイントのラプラシアン
+ *
+ * @return 正なら1、それ以外なら0
+ */
+inline int lapPartition(int laplacian) {
+    return laplacian > 0 ? 1 : 0;
+}
+
+inline int64_t descDBAlign(int64_t offset) {
+    return (offset + DESCDB_ALIGN - 1) / DESCDB_ALIGN * DESCDB_ALIGN;
+}
+
+/**
+ * テキスト形式（物体ID\tラプラシアン\t特徴ベクトル...）の特徴量ファイルをバイナリ形式に変換する
+ * 入力は1回だけ読み、特徴ベクトルは読んだそばから出力ファイルに書き出す
+ * 区画1（ラプラシアンが正）の行はいったん一時ファイルに書いて区画0の後ろに連結する
+ *
+ * @param[in] tsvFile  テキスト形式の特徴量ファイル
+ * @param[in] dbFile   出力するバイナリ形式のファイル
+ * @param[in] dim      特徴ベクトルの次元数
+ *
+ * @return 成功ならtrue、失敗ならfalse
+ */
+inline bool convertDescription(const char* tsvFile, const char* dbFile, int dim) {
+    FILE* in = fopen(tsvFile, "r");
+    if (in == NULL) {
+        std::cerr << "cannot open file: " << tsvFile << std::endl;
+        return false;
+    }
+    FILE* out = fopen(dbFile, "wb");
+    if (out == NULL) {
+        std::cerr << "cannot open file: " << dbFile << std::endl;
+        fclose(in);
+        return false;
+    }
+
+    // ヘッダは最後に書き直すのでここでは領域だけ確保
+    DescDBHeader header;
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, DESCDB_MAGIC, sizeof header.magic);
+    header.version = DESCDB_VERSION;
+    header.dim = dim;
+    header.descOffset = descDBAlign(sizeof header);
+    std::vector<char> pad(header.descOffset, 0);
+    fwrite(&pad[0], 1, pad.size(), out);
+
+    FILE* spill = tmpfile();
+    if (spill == NULL) {
+        std::cerr << "cannot create temporary file" << std::endl;
+        fclose(in);
+        fclose(out);
+        remove(dbFile);
+        return false;
+    }
+
+    std::vector<int32_t> labels[NUM_LAP_PARTITIONS];
+    std::vector<int32_t> laplacians[NUM_LAP_PARTITIONS];
+    std::vector<float> vec(dim);
+    std::vector<char> line(64 * 1024);
+    bool ok = true;
+    int lineNo = 0;
+    while (fgets(&line[0], (int)line.size(), in) != NULL) {
+        lineNo++;
+        char* p = &line[0];
+        if (*p == '\n' || *p == '\0') {
+            continue;
+        }
+        char* end;
+        long objId = strtol(p, &end, 10);
+        long laplacian = strtol(end, &end, 10);
+        for (int j = 0; j < dim; j++) {
+            p = end;
+            vec[j] = strtof(p, &end);
+            if (end == p) {
+                std::cerr << "too few columns at line " << lineNo << ": " << tsvFile << std::endl;
+                ok = false;
+                break;
+            }
+        }
+        if (!ok) {
+            break;
+        }
+        int part = lapPartition((int)laplacian);
+        labels[part].push_back((int32_t)objId);
+        laplacians[part].push_back((int32_t)laplacian);
+        fwrite(&vec[0], sizeof(float), dim, part == 0 ? out : spill);
+    }
+    if (ferror(in) != 0) {
+        ok = false;
+    }
+    fclose(in);
+
+    if (ok) {
+        // 区画1の特徴ベクトルを区画0の後ろに連結
+        rewind(spill);
+        std::vector<char> buf(1 << 20);
+        size_t n;
+        while ((n = fread(&buf[0], 1, buf.size(), spill)) > 0) {
+            if (fwrite(&buf[0], 1, n, out) != n) {
+                break;
+            }
+        }
+
+        header.rows = (int64_t)(labels[0].size() + labels[1].size());
+        header.labelOffset = header.descOffset + header.rows * dim * (int64_t)sizeof(float);
+        header.lapOffset = header.labelOffset + header.rows * (int64_t)sizeof(int32_t);
+        for (int p = 0; p < NUM_LAP_PARTITIONS; p++) {
+            if (!labels[p].empty()) {
+                fwrite(&labels[p][0], sizeof(int32_t), labels[p].size(), out);
+            }
+        }
+        for (int p = 0; p < NUM_LAP_PARTITIONS; p++) {
+            if (!laplacians[p].empty()) {
+                fwrite(&laplacians[p][0], sizeof(int32_t), laplacians[p].size(), out);
+            }
+        }
+
+        // 途中の書き込みが1つでも失敗していたら（ディスクが一杯など）ヘッダを書かずに消す
+        if (ferror(spill) != 0 || ferror(out) != 0) {
+            std::cerr << "cannot write file: " << dbFile << std::endl;
+            ok = false;
+        } else if (fseek(out, 0, SEEK_SET) != 0 || fwrite(&header, sizeof header, 1, out) != 1) {
+            std::cerr << "cannot write file: " << dbFile << std::endl;
+            ok = false;
+        }
+    }
+    fclose(spill);
+    if (fclose(out) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        remove(dbFile);
+    }
+
+    return ok;
+}
+
+/**
+ * バイナリ形式の物体モデルデータベースをmmapする
+ *
+ * @param[in]  filename  バイナリ形式のファイル
+ * @param[out] db        mmapしたデータベース
+ * @param[in]  prefetch  trueなら全体の先読みを促す、falseならランダムに読むことを伝える
+ *
+ * @return 成功ならtrue、失敗ならfalse
+ */
+inline bool openDescDB(const char* filename, DescDB& db, bool prefetch = true) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(DescDBHeader)) {
+        std::cerr << "invalid descriptor database: " << filename << std::endl;
+        close(fd);
+        return false;
+    }
+
+    // 書き込みはコピーオンライトになるのでファイルは変更されない
+    size_t length = (size_t)st.st_size;
+    void* addr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        std::cerr << "cannot mmap file: " << filename << std::endl;
+        return false;
+    }
+
+    // 特徴ベクトル、物体ID、ラプラシアンの各区画が重ならずにファイルに収まっているか確かめる
+    const DescDBHeader* header = (const DescDBHeader*)addr;
+    bool valid = memcmp(header->magic, DESCDB_MAGIC, sizeof header->magic) == 0 &&
+                 header->version == DESCDB_VERSION && header->dim > 0 && header->rows >= 0 &&
+                 header->rows <= (int64_t)length / ((int64_t)sizeof(float) * header->dim) &&
+                 header->descOffset >= (int64_t)sizeof(DescDBHeader) && header->descOffset <= (int64_t)length &&
+                 header->descOffset % DESCDB_ALIGN == 0;
+    if (valid) {
+        int64_t labelSize = header->rows * (int64_t)sizeof(int32_t);
+        int64_t descSize = labelSize * header->dim;
+        valid = header->descOffset + descSize <= header->labelOffset &&
+                header->labelOffset + labelSize <= header->lapOffset &&
+                header->lapOffset + labelSize <= (int64_t)length;
+    }
+    if (!valid) {
+        std::cerr << "invalid descriptor database: " << filename << std::endl;
+        munmap(addr, length);
+        return false;
+    }
+
+    // 先頭から順に読むことが多いので先読みを促す（一部の行しか読まないなら先読みさせない）
+    madvise(addr, length, prefetch ? MADV_WILLNEED : MADV_RANDOM);
+
+    char* base = (char*)addr;
+    db.addr = addr;
+    db.length = length;
+    db.rows = (int)header->rows;
+    db.dim = header->dim;
+    db.descriptors = (float*)(base + header->descOffset);
+    db.labels = (int*)(base + header->labelOffset);
+    db.laplacians = (int*)(base + header->lapOffset);
+
+    return true;
+}
+
+/**
+ * mmapした物体モデルデータベースを解放する
+ * descDBMat()で作った行列ヘッダはこれより前に解放すること
+ *
+ * @param[in,out] db  mmapしたデータベース
+ */
+inline void closeDescDB(DescDB& db) {
+    if (db.addr != NULL) {
+        munmap(db.addr, db.length);
+    }
+    db = DescDB();
+}
+
+/**
+ * mmap領域の特徴ベクトルをコピーせずに参照する行列ヘッダを作る
+ * cvReleaseMat()で解放してもヘッダだけが解放されmmap領域はそのまま残る
+ *
+ * @param[in] db  mmapしたデータベース
+ *
+ * @return 各行が1つの特徴ベクトルの行列
+ */
+inline CvMat* descDBMat(const DescDB& db) {
+    CvMat* mat = cvCreateMatHeader(db.rows, db.dim, CV_32FC1);
+    cvSetData(mat, db.descriptors, db.dim * sizeof(float));
+    return mat;
+}
+
+/**
+ * バイナリ形式の物体モデルデータベースをロードしlabelsとobjMatへ格納する
+ * loadDescription()と同じ出力になるが特徴ベクトルはmmap領域を直接参照する
+ *
+ * @param[in]  filename    バイナリ形式のファイル
+ * @param[in]  dim         期待する特徴ベクトルの次元数
+ * @param[out] db          mmapしたデータベース（objMatを使い終わったらcloseDescDB()で解放）
+ * @param[out] labels      特徴ベクトル抽出元の物体ID
+ * @param[out] laplacians  特徴ベクトルのラプラシアン
+ * @param[out] objMat      特徴量を格納した行列（各行に1つの特徴ベクトル）
+ * @param[in]  prefetch    trueなら全体の先読みを促す（openDescDB()を参照）
+ *
+ * @return 成功ならtrue、失敗ならfalse
+ */
+inline bool loadDescriptionDB(const char* filename, int dim, DescDB& db, std::vector<int>& labels,
+                              std::vector<int>& laplacians, CvMat*& objMat, bool prefetch = true) {
+    if (!openDescDB(filename, db, prefetch)) {
+        return false;
+    }
+    if (db.dim != dim) {
+        std::cerr << "dimension mismatch: " << filename << " (" << db.dim << " != " << dim << ")" << std::endl;
+        closeDescDB(db);
+        return false;
+    }
+    labels.assign(db.labels, db.labels + db.rows);
+    laplacians.assign(db.laplacians, db.laplacians + db.rows);
+    objMat = descDBMat(db);
+    return true;
+}
+
+/**
+ * キーポイントのラベル（抽出元の物体ID）とラプラシアンと特徴ベクトルをテキスト形式のファイルからロードする
+ *
+ * @param[in]  filename    特徴ベクトルを格納したファイル（1行が 物体ID ラプラシアン 特徴ベクトル のTSV）
+ * @param[in]  dim         特徴ベクトルの次元数
+ * @param[out] labels      特徴ベクトル抽出元の物体ID
+ * @param[out] laplacians  特徴ベクトルのラプラシアン
+ * @param[out] objMat      特徴量を格納した行列（各行に1つの特徴ベクトル）
+ *
+ * @return 成功ならtrue、失敗ならfalse
+ */
+inline bool loadDescription(const char* filename, int dim, std::vector<int>& labels, std::vector<int>& laplacians,
+                            CvMat*& objMat) {
+    // 物体IDと特徴ベクトルを格納したファイルを開く
+    std::ifstream descFile(filename);
+    if (descFile.fail()) {
+        std::cerr << "cannot open file: " << filename << std::endl;
+        return false;
+    }
+
+    // 行列のサイズを決定するためキーポイントの総数をカウント
+    int numKeypoints = 0;
+    std::string line;
+    while (getline(descFile, line, '\n')) {
+        numKeypoints++;
+    }
+    objMat = cvCreateMat(numKeypoints, dim, CV_32FC1);
+
+    // ファイルポインタを先頭に戻す
+    descFile.clear();
+    descFile.seekg(0);
+
+    // データを読み込んで行列へ格納
+    int cur = 0;
+    while (getline(descFile, line, '\n')) {
+        // タブで分割した文字列をldataへ格納
+        std::vector<std::string> ldata;
+        std::istringstream ss(line);
+        std::string s;
+        while (getline(ss, s, '\t')) {
+            ldata.push_back(s);
+        }
+        // 物体ID、ラプラシアン、dim次元ベクトルの要素の順（特徴ベクトルはldata[2]から）
+        labels.push_back(atol(ldata[0].c_str()));
+        laplacians.push_back(atoi(ldata[1].c_str()));
+        for (int j = 0; j < dim; j++) {
+            CV_MAT_ELEM(*objMat, float, cur, j) = (float)atof(ldata[j + 2].c_str());
+        }
+        cur++;
+    }
+
+    return true;
+}
+
+/**
+ * ロードした物体モデルデータベース
+ */
+struct ModelDB {
+    std::vector<int> labels;      // キーポイントのラベル（objMatに対応）
+    std::vector<int> laplacians;  // キーポイントのラプラシアン
+    CvMat* objMat;                // 各行が物体のキーポイントの特徴ベクトル
+    DescDB db;                    // バイナリ形式のデータベース（あればmmapして使う）
+
+    ModelDB() : objMat(NULL) {}
+};
+
+/**
+ * 物体モデルデータベースをロードする（バイナリ形式があればmmapし、なければテキスト形式を読む）
+ *
+ * @param[in]  dbFile    バイナリ形式のファイル（convert_descriptionで作成）
+ * @param[in]  descFile  テキスト形式のファイル
+ * @param[in]  dim       特徴ベクトルの次元数
+ * @param[out] model     ロードしたデータベース（使い終わったらreleaseModelDB()で解放）
+ * @param[in]  prefetch  trueならバイナリ形式のファイル全体の先読みを促す（openDescDB()を参照）
+ *
+ * @return 成功ならtrue、失敗ならfalse
+ */
+inline bool loadModelDB(const char* dbFile, const char* descFile, int dim, ModelDB& model, bool prefetch = true) {
+    return loadDescriptionDB(dbFile, dim, model.db, model.labels, model.laplacians, model.objMat, prefetch) ||
+           loadDescription(descFile, dim, model.labels, model.laplacians, model.objMat);
+}
+
+inline void releaseModelDB(ModelDB& model) {
+    if (model.objMat != NULL) {
+        cvReleaseMat(&model.objMat);
+    }
+    closeDescDB(model.db);
+    model.labels.clear();
+    model.laplacians.clear();
+}
+
+#endif
@@ -0,0 +1,41 @@
+#include <cv.h>
+#include <iostream>
+#include "hist_store.h"
+
+using namespace std;
+
+const char* HIST_FILE = "histograms.bin";
+const char* HIST_TSV_FILE = "histograms.txt";
+
+/**
+ * visual_wordsが出力したバイナリ形式のヒストグラムを以前のテキスト形式に変換する
+ * export_histograms [入力バイナリファイル] [出力テキストファイル]
+ */
+int main(int argc, char** argv) {
+    const char* histFile = argc > 1 ? argv[1] : HIST_FILE;
+    const char* tsvFile = argc > 2 ? argv[2] : HIST_TSV_FILE;
+
+    double tt = (double)cvGetTickCount();
+
+    HistStore store;
+    if (!openHistStore(histFile, store)) {
+        cerr << "cannot open histogram file: " << histFile << endl;
+        return 1;
+    }
+    cout << "画像数: " << store.records.size() << endl;
+    cout << "Visual Wordsの数: " << store.numWords << endl;
+
+    cout << histFile << " -> " << tsvFile << " ... " << flush;
+    if (!exportHistogramsTSV(store, tsvFile)) {
+        cerr << "cannot export histograms" << endl;
+        closeHistStore(store);
+        return 1;
+    }
+    cout << "OK" << endl;
+    closeHistStore(store);
+
+    tt = (double)cvGetTickCount() - tt;
+    cout << "Exporting Time = " << tt / (cvGetTickFrequency() * 1000.0) << "ms" << endl;
+
+    return 0;
+}
@@ -0,0 +1,381 @@
+#ifndef HIST_STORE_H
+#define HIST_STORE_H
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "inverted_index.h"
+
+/*
+ * Visual Wordsのヒストグラムの疎なバイナリ形式
+ *
+ *   HistStoreHeader
+ *   レコード（1画像につき1つ、追記できるようにファイルの末尾まで並べる）
+ *     HistRecordHeader
+ *     char    path[pathLength]（4バイト境界までNULで埋める）
+ *     int32   words[numEntries]   0でないビンのVisual Wordsの番号（昇順）
+ *     int32   counts[numEntries]  そのビンの得票数
+ *
+ * 0のビンを書かないのでファイルサイズは局所特徴点の数に比例し、Visual Wordsの数によらない。
+ * 得票数をそのまま持つので正規化したヒストグラムは counts / 得票数の合計 で求まる。
+ * 数値はすべてネイティブのバイトオーダーで、読み込みはmmapした領域を直接参照する。
+ * 同じ画像のレコードが複数あれば後のもの（最後に計算したとき）を使う。
+ */
+
+const char HIST_STORE_MAGIC[8] = { 'V', 'W', 'H', 'I', 'S', 'T', '0', '1' };
+
+struct HistStoreHeader {
+    char magic[8];
+    int32_t numWords;   // Visual Wordsの数（ヒストグラムのビン数）
+    int32_t reserved;
+};
+
+struct HistRecordHeader {
+    int32_t pathLength;  // 画像のパスの長さ（NULを含まない）
+    int32_t numEntries;  // 0でないビンの数
+};
+
+/**
+ * mmapしたヒストグラムの1画像分
+ */
+struct HistRecord {
+    const char* path;       // 画像のパス（NUL終端されていないのでpathLengthを使う）
+    int pathLength;
+    int numEntries;         // 0でないビンの数
+    const int32_t* words;   // 0でないビンのVisual Wordsの番号（mmap領域を直接指す）
+    const int32_t* counts;  // その得票数（mmap領域を直接指す）
+    int total;              // 得票数の合計（=局所特徴点の数）
+};
+
+/**
+ * mmapしたヒストグラムのファイル
+ */
+struct HistStore {
+    void* addr;                       // mmapした領域
+    size_t length;                    // mmapした長さ
+    int numWords;                     // Visual Wordsの数
+    std::vector<HistRecord> records;  // 各画像のレコード（画像ごとに最後のもの、ファイル中の順）
+
+    HistStore() : addr(NULL), length(0), numWords(0) {}
+};
+
+inline int histPadding(int length) {
+    return (4 - length % 4) % 4;
+}
+
+/**
+ * posから始まる1画像分のレコードを読む
+ *
+ * @param[in]  base      ファイルの先頭
+ * @param[in]  length    ファイルの長さ
+ * @param[in]  pos       レコードの位置
+ * @param[in]  numWords  Visual Wordsの数
+ * @param[out] record    読んだレコード（baseを直接指す）
+ * @param[out] end       次のレコードの位置
+ *
+ * @return 完全なレコードならtrue、途中で切れているか壊れていればfalse
+ */
+inline bool parseHistRecord(const char* base, size_t length, size_t pos, int numWords, HistRecord& record,
+                            size_t& end) {
+    if (pos + sizeof(HistRecordHeader) > length) {
+        return false;
+    }
+    const HistRecordHeader* rh = (const HistRecordHeader*)(base + pos);
+    if (rh->pathLength < 0 || rh->numEntries < 0) {
+        return false;
+    }
+    size_t pathBytes = (size_t)rh->pathLength + histPadding(rh->pathLength);
+    end = pos + sizeof(HistRecordHeader) + pathBytes + 2 * (size_t)rh->numEntries * sizeof(int32_t);
+    if (end > length) {
+        return false;
+    }
+    record.path = base + pos + sizeof(HistRecordHeader);
+    record.pathLength = rh->pathLength;
+    record.numEntries = rh->numEntries;
+    record.words = (const int32_t*)(record.path + pathBytes);
+    record.counts = record.words + record.numEntries;
+    record.total = 0;
+    for (int i = 0; i < record.numEntries; i++) {
+        if (record.words[i] < 0 || record.words[i] >= numWords) {
+            return false;
+        }
+        record.total += record.counts[i];
+    }
+    return true;
+}
+
+/**
+ * 先頭から完全なレコードをたどり、最後の完全なレコードの終わりの位置を求める
+ *
+ * @param[in] base      ファイルの先頭
+ * @param[in] length    ファイルの長さ
+ * @param[in] numWords  Visual Wordsの数
+ *
+ * @return 最後の完全なレコードの終わり（レコードがなければヘッダの終わり）
+ */
+inline size_t histStoreValidLength(const char* base, size_t length, int numWords) {
+    size_t pos = sizeof(HistStoreHeader);
+    HistRecord record;
+    size_t end;
+    while (parseHistRecord(base, length, pos, numWords, record, end)) {
+        pos = end;
+    }
+    return pos;
+}
+
+/**
+ * ヒストグラムのファイルを書き込み用に開く
+ * appendなら既存のファイルの末尾に追記する（ビン数が一致しなければ失敗）。
+ * 前の書き込みが途中で終わって最後のレコードが切れていると、その後ろに追記したレコードは読めなくなるので、
+ * 最後の完全なレコードの終わりで切り詰めてから追記する。
+ *
+ * @param[in] filename  出力ファイル名
+ * @param[in] numWords  Visual Wordsの数
+ * @param[in] append    trueなら追記、falseなら作り直す
+ *
+ * @return ファイルポインタ、失敗ならNULL
+ */
+inline FILE* createHistStore(const char* filename, int numWords, bool append) {
+    if (append) {
+        FILE* fp = fopen(filename, "r+b");
+        if (fp != NULL) {
+            HistStoreHeader header;
+            if (fread(&header, sizeof header, 1, fp) != 1 ||
+                memcmp(header.magic, HIST_STORE_MAGIC, sizeof header.magic) != 0 || header.numWords != numWords) {
+                std::cerr << "incompatible histogram file: " << filename << std::endl;
+                fclose(fp);
+                return NULL;
+            }
+            struct stat st;
+            if (fstat(fileno(fp), &st) != 0) {
+                std::cerr << "cannot open file: " << filename << std::endl;
+                fclose(fp);
+                return NULL;
+            }
+            size_t length = (size_t)st.st_size;
+            size_t validLength = length;
+            void* addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+            if (addr != MAP_FAILED) {
+                validLength = histStoreValidLength((const char*)addr, length, numWords);
+                munmap(addr, length);
+            }
+            if (addr == MAP_FAILED || (validLength < length && ftruncate(fileno(fp), (off_t)validLength) != 0)) {
+                std::cerr << "cannot repair histogram file: " << filename << std::endl;
+                fclose(fp);
+                return NULL;
+            }
+            if (validLength < length) {
+                std::cerr << "dropped " << length - validLength << " bytes of incomplete records: " << filename
+                          << std::endl;
+            }
+            fseek(fp, 0, SEEK_END);
+            return fp;
+        }
+        // まだなければ新しく作る
+    }
+
+    FILE* fp = fopen(filename, "wb");
+    if (fp == NULL) {
+        std::cerr << "cannot open file: " << filename << std::endl;
+        return NULL;
+    }
+    HistStoreHeader header;
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, HIST_STORE_MAGIC, sizeof header.magic);
+    header.numWords = numWords;
+    if (fwrite(&header, sizeof header, 1, fp) != 1) {
+        std::cerr << "cannot write file: " << filename << std::endl;
+        fclose(fp);
+        return NULL;
+    }
+    return fp;
+}
+
+/**
+ * 1画像分のヒストグラムを0でないビンだけ書き込む
+ *
+ * @param[in] fp         createHistStore()で開いたファイル
+ * @param[in] path       画像のパス
+ * @param[in] histogram  各ビンの得票数
+ * @param[in] numWords   ビン数
+ *
+ * @return 書き込めたらtrue、失敗ならfalse
+ */
+inline bool writeHistRecord(FILE* fp, const char* path, const int* histogram, int numWords) {
+    std::vector<int32_t> words, counts;
+    for (int i = 0; i < numWords; i++) {
+        if (histogram[i] != 0) {
+            words.push_back(i);
+            counts.push_back(histogram[i]);
+        }
+    }
+
+    HistRecordHeader record;
+    record.pathLength = (int32_t)strlen(path);
+    record.numEntries = (int32_t)words.size();
+    static const char zeros[4] = { 0, 0, 0, 0 };
+    size_t padding = (size_t)histPadding(record.pathLength);
+    if (fwrite(&record, sizeof record, 1, fp) != 1 ||
+        fwrite(path, 1, record.pathLength, fp) != (size_t)record.pathLength ||
+        fwrite(zeros, 1, padding, fp) != padding) {
+        return false;
+    }
+    if (!words.empty()) {
+        return fwrite(&words[0], sizeof(int32_t), words.size(), fp) == words.size() &&
+               fwrite(&counts[0], sizeof(int32_t), counts.size(), fp) == counts.size();
+    }
+    return true;
+}
+
+/**
+ * ヒストグラムのファイルをmmapしてレコードの一覧を作る
+ *
+ * @param[in]  filename  ヒストグラムのファイル
+ * @param[out] store     mmapしたファイル（使い終わったらcloseHistStore()で解放）
+ *
+ * @return 成功ならtrue、失敗ならfalse
+ */
+inline bool openHistStore(const char* filename, HistStore& store) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(HistStoreHeader)) {
+        close(fd);
+        return false;
+    }
+    size_t length = (size_t)st.st_size;
+    void* addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        std::cerr << "cannot mmap file: " << filename << std::endl;
+        return false;
+    }
+    const HistStoreHeader* header = (const HistStoreHeader*)addr;
+    if (memcmp(header->magic, HIST_STORE_MAGIC, sizeof header->magic) != 0 || header->numWords < 0) {
+        munmap(addr, length);
+        return false;
+    }
+    madvise(addr, length, MADV_WILLNEED);
+
+    store = HistStore();
+    store.addr = addr;
+    store.length = length;
+    store.numWords = header->numWords;
+
+    // レコードを先頭から順にたどる（同じ画像は後のレコードで置き換える）
+    // 途中で切れているか、範囲外のVisual Wordsの番号を含むレコードがあればそこで打ち切る
+    std::map<std::string, size_t> pathIndex;
+    const char* base = (const char*)addr;
+    size_t pos = sizeof(HistStoreHeader);
+    while (pos < length) {
+        HistRecord record;
+        size_t end;
+        if (!parseHistRecord(base, length, pos, store.numWords, record, end)) {
+            std::cerr << "truncated or invalid histogram file: " << filename << std::endl;
+            break;
+        }
+
+        std::string path(record.path, record.pathLength);
+        std::map<std::string, size_t>::iterator it = pathIndex.find(path);
+        if (it != pathIndex.end()) {
+            store.records[it->second] = record;
+        } else {
+            pathIndex[path] = store.records.size();
+            store.records.push_back(record);
+        }
+        pos = end;
+    }
+    return true;
+}
+
+/**
+ * mmapしたヒストグラムのファイルを解放する
+ *
+ * @param[in,out] store  mmapしたファイル
+ */
+inline void closeHistStore(HistStore& store) {
+    if (store.addr != NULL) {
+        munmap(store.addr, store.length);
+    }
+    store = HistStore();
+}
+
+/**
+ * 正規化したヒストグラムをテキスト形式（「画像のパス\tビン0\tビン1\t...」）で書き出す
+ * 以前のhistograms.txtと同じ形式
+ *
+ * @param[in] store     mmapしたヒストグラムのファイル
+ * @param[in] filename  出力ファイル名
+ *
+ * @return 成功ならtrue、失敗ならfalse
+ */
+inline bool exportHistogramsTSV(const HistStore& store, const char* filename) {
+    std::ofstream fout(filename);
+    if (!fout.is_open()) {
+        std::cerr << "cannot open file: " << filename << std::endl;
+        return false;
+    }
+    std::vector<float> dense(store.numWords);
+    for (size_t r = 0; r < store.records.size(); r++) {
+        const HistRecord& record = store.records[r];
+        std::fill(dense.begin(), dense.end(), 0.0f);
+        for (int i = 0; i < record.numEntries; i++) {
+            dense[record.words[i]] = float(record.counts[i]) / float(record.total);
+        }
+        fout.write(record.path, record.pathLength);
+        fout << "\t";
+        for (int i = 0; i < store.numWords; i++) {
+            fout << dense[i] << "\t";
+        }
+        fout << std::endl;
+    }
+    fout.close();
+    return !fout.fail();
+}
+
+/**
+ * ヒストグラムを転置インデックス用の疎なヒストグラムとしてロードする
+ * バイナリ形式でなければテキスト形式として読む
+ *
+ * @param[in]  filename    ヒストグラムのファイル
+ * @param[out] names       各画像のパス
+ * @param[out] histograms  各画像の正規化した疎なヒストグラム
+ * @param[out] numWords    Visual Wordsの数
+ *
+ * @return 成功ならtrue、失敗ならfalse
+ */
+inline bool loadHistograms(const char* filename, std::vector<std::string>& names,
+                           std::vector<SparseHistogram>& histograms, int& numWords) {
+    HistStore store;
+    if (!openHistStore(filename, store)) {
+        return loadHistogramsText(filename, names, histograms, numWords);
+    }
+    numWords = store.numWords;
+    names.resize(store.records.size());
+    histograms.resize(store.records.size());
+    for (size_t r = 0; r < store.records.size(); r++) {
+        const HistRecord& record = store.records[r];
+        names[r].assign(record.path, record.pathLength);
+        histograms[r].words.assign(record.words, record.words + record.numEntries);
+        histograms[r].values.resize(record.numEntries);
+        for (int i = 0; i < record.numEntries; i++) {
+            histograms[r].values[i] = float(record.counts[i]) / float(record.total);
+        }
+    }
+    closeHistStore(store);
+    return true;
+}
+
+#endif
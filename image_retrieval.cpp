@@ -0,0 +1,85 @@
+#include <cv.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include "hist_store.h"
+#include "options.h"
+
+using namespace std;
+
+const char* HIST_FILE = "histograms.bin";  // visual_wordsで作成（テキスト形式のhistograms.txtも読める）
+const int TOP_K = 10;                      // 表示する検索結果の数
+
+int main(int argc, char** argv) {
+    double tt = (double)cvGetTickCount();
+
+    // Visual Wordsのヒストグラムをロード（-hist でファイル、-k で検索結果の数を指定）
+    const char* histFile = stringOption(argc, argv, "-hist", HIST_FILE);
+    int topK = intOption(argc, argv, "-k", TOP_K);
+    cout << "ヒストグラムをロードします ... " << flush;
+    vector<string> names;
+    vector<SparseHistogram> histograms;
+    int numWords;
+    if (!loadHistograms(histFile, names, histograms, numWords)) {
+        cerr << "cannot load histogram file" << endl;
+        return 1;
+    }
+    cout << "OK" << endl;
+
+    // 転置インデックスを作成
+    cout << "転置インデックスを作成します ... " << flush;
+    InvertedIndex index;
+    buildInvertedIndex(histograms, numWords, index);
+    cout << "OK" << endl;
+
+    // 画像のパスとファイル名（ディレクトリ名を除いたもの）のどちらでもクエリにできるようにする
+    map<string, int> name2id;
+    for (size_t i = 0; i < names.size(); i++) {
+        name2id[names[i]] = (int)i;
+        size_t slash = names[i].rfind('/');
+        if (slash != string::npos) {
+            name2id.insert(make_pair(names[i].substr(slash + 1), (int)i));
+        }
+    }
+
+    cout << "画像数: " << index.numImages << endl;
+    cout << "Visual Wordsの数: " << index.numWords << endl;
+    cout << "ポスティング数: " << index.postingImages.size() << " ("
+         << 100.0 * index.postingImages.size() / ((double)index.numImages * index.numWords) << "%)" << endl;
+    tt = (double)cvGetTickCount() - tt;
+    cout << "Loading Index Time = " << tt / (cvGetTickFrequency() * 1000.0) << "ms" << endl;
+
+    vector<float> scores(index.numImages, 0.0f);  // クエリごとに使い回すスコアの配列
+    vector<RetrievalResult> results;
+    while (1) {
+        // クエリ画像の入力（インデックス中の画像のパスかファイル名）
+        string input;
+        cout << "query? > ";
+        if (!(cin >> input)) {
+            break;
+        }
+
+        map<string, int>::iterator it = name2id.find(input);
+        if (it == name2id.end()) {
+            cerr << "no histogram for image: " << input << endl;
+            continue;
+        }
+        cout << names[it->second] << endl;
+
+        tt = (double)cvGetTickCount();
+
+        // クエリの0でない語のポスティングリストだけで類似度を計算
+        queryInvertedIndex(index, histograms[it->second], topK, scores, results);
+
+        // 検索結果を類似度の降順に表示
+        for (size_t i = 0; i < results.size(); i++) {
+            cout << i + 1 << "\t" << names[results[i].image] << "\t" << results[i].score << endl;
+        }
+
+        tt = (double)cvGetTickCount() - tt;
+        cout << "Retrieval Time = " << tt / (cvGetTickFrequency() * 1000.0) << "ms" << endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,245 @@
+#ifndef INDEX_SNAPSHOT_H
+#define INDEX_SNAPSHOT_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * 近傍探索インデックスのスナップショットのバイナリ形式
+ *
+ *   IndexSnapshotHeader
+ *   SnapshotSection sections[numSections]
+ *   各セクションのデータ（64バイト境界）
+ *
+ * インデックスは配列の集まり（特徴ベクトル、木のノード、ハッシュ表など）なので、
+ * 区画番号と種類で名前をつけた配列をそのまま並べる。読み込みはmmapした領域を直接参照するので
+ * ノードごとの確保も再構築もなく、起動時間はインデックスの大きさによらない。
+ * 数値はすべてネイティブのバイトオーダー。
+ */
+
+const char INDEX_SNAPSHOT_MAGIC[8] = { 'V', 'W', 'I', 'N', 'D', 'E', 'X', '1' };
+const int64_t INDEX_SNAPSHOT_ALIGN = 64;
+
+struct IndexSnapshotHeader {
+    char magic[8];
+    int32_t type;         // インデックスの種類（KDTREE_INDEX_TYPEなど）
+    int32_t dim;          // 特徴ベクトルの次元数
+    int32_t numParts;     // 区画の数
+    int32_t numSections;  // セクションの数
+    int64_t length;       // ファイルの長さ（途中で切れていないかの確認用）
+};
+
+struct SnapshotSection {
+    int32_t part;     // 区画番号
+    int32_t kind;     // 配列の種類（インデックスごとに決める）
+    int64_t offset;   // データの先頭オフセット
+    int64_t size;     // データのバイト数
+};
+
+/**
+ * 書き込む配列（データは書き込みが終わるまで呼び出し側が保持する）
+ */
+struct SnapshotBlob {
+    int part;
+    int kind;
+    const void* data;
+    size_t size;
+};
+
+/**
+ * mmapしたスナップショット
+ */
+struct IndexSnapshot {
+    void* addr;     // mmapした領域
+    size_t length;  // 領域のバイト数
+    int type;
+    int dim;
+    int numParts;
+    const SnapshotSection* sections;
+    int numSections;
+
+    IndexSnapshot() : addr(NULL), length(0), type(0), dim(0), numParts(0), sections(NULL), numSections(0) {}
+};
+
+inline SnapshotBlob snapshotBlob(int part, int kind, const void* data, size_t size) {
+    SnapshotBlob blob = { part, kind, data, size };
+    return blob;
+}
+
+/**
+ * 配列をスナップショットに書き込む（一時ファイルに書いてからrenameする）
+ *
+ * @param[in] filename  出力ファイル名
+ * @param[in] type      インデックスの種類
+ * @param[in] dim       特徴ベクトルの次元数
+ * @param[in] numParts  区画の数
+ * @param[in] blobs     書き込む配列
+ *
+ * @return 成功ならtrue、失敗ならfalse
+ */
+inline bool writeIndexSnapshot(const char* filename, int type, int dim, int numParts,
+                               const std::vector<SnapshotBlob>& blobs) {
+    // 各セクションの位置を決める
+    std::vector<SnapshotSection> sections(blobs.size());
+    int64_t offset = sizeof(IndexSnapshotHeader) + sizeof(SnapshotSection) * (int64_t)blobs.size();
+    for (size_t i = 0; i < blobs.size(); i++) {
+        offset = (offset + INDEX_SNAPSHOT_ALIGN - 1) / INDEX_SNAPSHOT_ALIGN * INDEX_SNAPSHOT_ALIGN;
+        sections[i].part = blobs[i].part;
+        sections[i].kind = blobs[i].kind;
+        sections[i].offset = offset;
+        sections[i].size = (int64_t)blobs[i].size;
+        offset += (int64_t)blobs[i].size;
+    }
+
+    IndexSnapshotHeader header;
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, INDEX_SNAPSHOT_MAGIC, sizeof header.magic);
+    header.type = type;
+    header.dim = dim;
+    header.numParts = numParts;
+    header.numSections = (int32_t)sections.size();
+    header.length = offset;
+
+    std::string tmpFile = std::string(filename) + ".tmp";
+    FILE* fp = fopen(tmpFile.c_str(), "wb");
+    if (fp == NULL) {
+        std::cerr << "cannot open file: " << tmpFile << std::endl;
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof header, 1, fp) == 1 &&
+              (sections.empty() || fwrite(&sections[0], sizeof(SnapshotSection), sections.size(), fp) == sections.size());
+    static const char zeros[INDEX_SNAPSHOT_ALIGN] = { 0 };
+    int64_t pos = sizeof(IndexSnapshotHeader) + sizeof(SnapshotSection) * (int64_t)sections.size();
+    for (size_t i = 0; ok && i < blobs.size(); i++) {
+        size_t padding = (size_t)(sections[i].offset - pos);
+        ok = fwrite(zeros, 1, padding, fp) == padding &&
+             (blobs[i].size == 0 || fwrite(blobs[i].data, 1, blobs[i].size, fp) == blobs[i].size);
+        pos = sections[i].offset + sections[i].size;
+    }
+    // 書き込みに失敗したら一時ファイルを消し、古いスナップショットを残す
+    ok = ok && !ferror(fp);
+    if (fclose(fp) != 0 || !ok || rename(tmpFile.c_str(), filename) != 0) {
+        std::cerr << "cannot write file: " << filename << std::endl;
+        remove(tmpFile.c_str());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * スナップショットをmmapする
+ *
+ * @param[in]  filename  スナップショットのファイル
+ * @param[in]  type      期待するインデックスの種類
+ * @param[out] snapshot  mmapしたスナップショット（使い終わったらcloseIndexSnapshot()で解放）
+ *
+ * @return 成功ならtrue、失敗ならfalse（ファイルがなければメッセージを出さない）
+ */
+inline bool openIndexSnapshot(const char* filename, int type, IndexSnapshot& snapshot) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(IndexSnapshotHeader)) {
+        std::cerr << "invalid index snapshot: " << filename << std::endl;
+        close(fd);
+        return false;
+    }
+    size_t length = (size_t)st.st_size;
+    void* addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        std::cerr << "cannot mmap file: " << filename << std::endl;
+        return false;
+    }
+
+    const IndexSnapshotHeader* header = (const IndexSnapshotHeader*)addr;
+    bool ok = memcmp(header->magic, INDEX_SNAPSHOT_MAGIC, sizeof header->magic) == 0 && header->type == type &&
+              header->numSections >= 0 && header->length == (int64_t)length &&
+              sizeof(IndexSnapshotHeader) + sizeof(SnapshotSection) * (size_t)header->numSections <= length;
+    const SnapshotSection* sections = (const SnapshotSection*)(header + 1);
+    for (int i = 0; ok && i < header->numSections; i++) {
+        ok = sections[i].offset % INDEX_SNAPSHOT_ALIGN == 0 && sections[i].size >= 0 &&
+             sections[i].offset + sections[i].size <= (int64_t)length;
+    }
+    if (!ok) {
+        std::cerr << "invalid index snapshot: " << filename << std::endl;
+        munmap(addr, length);
+        return false;
+    }
+
+    // 探索はランダムアクセスになるので全体を先に読み込ませる
+    madvise(addr, length, MADV_WILLNEED);
+
+    snapshot.addr = addr;
+    snapshot.length = length;
+    snapshot.type = header->type;
+    snapshot.dim = header->dim;
+    snapshot.numParts = header->numParts;
+    snapshot.sections = sections;
+    snapshot.numSections = header->numSections;
+    return true;
+}
+
+/**
+ * スナップショットの配列を探す
+ *
+ * @param[in]  snapshot  mmapしたスナップショット
+ * @param[in]  part      区画番号
+ * @param[in]  kind      配列の種類
+ * @param[out] size      配列のバイト数
+ *
+ * @return 配列の先頭（mmap領域を直接指す）、なければNULL
+ */
+inline const void* snapshotSection(const IndexSnapshot& snapshot, int part, int kind, size_t& size) {
+    for (int i = 0; i < snapshot.numSections; i++) {
+        if (snapshot.sections[i].part == part && snapshot.sections[i].kind == kind) {
+            size = (size_t)snapshot.sections[i].size;
+            return (const char*)snapshot.addr + snapshot.sections[i].offset;
+        }
+    }
+    size = 0;
+    return NULL;
+}
+
+/**
+ * スナップショットから読んだ番号の配列がすべて[0, limit)に収まっているか
+ * （mmapした番号をそのまま添字に使う前に確かめる）
+ *
+ * @param[in] values  番号の配列
+ * @param[in] count   要素数
+ * @param[in] limit   番号の上限（この値は含まない）
+ *
+ * @return すべて収まっていればtrue
+ */
+inline bool snapshotIndicesInRange(const int32_t* values, size_t count, int64_t limit) {
+    for (size_t i = 0; i < count; i++) {
+        if (values[i] < 0 || values[i] >= limit) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * mmapしたスナップショットを解放する（そこを指すインデックスも使えなくなる）
+ *
+ * @param[in,out] snapshot  mmapしたスナップショット
+ */
+inline void closeIndexSnapshot(IndexSnapshot& snapshot) {
+    if (snapshot.addr != NULL) {
+        munmap(snapshot.addr, snapshot.length);
+    }
+    snapshot = IndexSnapshot();
+}
+
+#endif
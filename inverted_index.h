@@ -0,0 +1,222 @@
+#ifndef INVERTED_INDEX_H
+#define INVERTED_INDEX_H
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+/*
+ * Visual Wordsのヒストグラムの転置インデックス（tf-idf重み付き）
+ *
+ * Visual Wordsごとにその語を含む画像のリスト（ポスティングリスト）を持つ。
+ * 重みは tf x idf（tfはヒストグラムの値、idf = log(画像数 / その語を含む画像数)）で、
+ * 画像ごとにL2正規化しておくのでクエリとの内積がコサイン類似度になる。
+ * 検索ではクエリの0でない語のポスティングリストだけをたどってスコアを足し込む。
+ * ポスティングリストはCSR形式（postingStart[w]〜postingStart[w + 1]）で平坦な配列に並べる。
+ */
+
+/**
+ * 疎なヒストグラム（0でないビンだけを保持する）
+ */
+struct SparseHistogram {
+    std::vector<int> words;     // 0でないビンのVisual Wordsの番号（昇順）
+    std::vector<float> values;  // その値
+};
+
+struct InvertedIndex {
+    int numWords;                       // Visual Wordsの数
+    int numImages;                      // 画像数
+    std::vector<float> idf;             // 各語のidf
+    std::vector<int> postingStart;      // 各語のポスティングリストの先頭（numWords + 1個）
+    std::vector<int> postingImages;     // ポスティングリストの画像番号
+    std::vector<float> postingWeights;  // ポスティングリストの重み（正規化したtf-idf）
+
+    InvertedIndex() : numWords(0), numImages(0) {}
+};
+
+/**
+ * 検索結果の1件
+ */
+struct RetrievalResult {
+    int image;    // 画像番号
+    float score;  // コサイン類似度
+};
+
+/**
+ * calcHistograms()が出力したテキスト形式のヒストグラムをロードする
+ * 1行が1画像で「画像のパス\tビン0\tビン1\t...」の形式
+ *
+ * @param[in]  filename    ヒストグラムのファイル
+ * @param[out] names       各画像のパス
+ * @param[out] histograms  各画像の疎なヒストグラム
+ * @param[out] numWords    ビン数（Visual Wordsの数）
+ *
+ * @return 成功ならtrue、失敗ならfalse
+ */
+inline bool loadHistogramsText(const char* filename, std::vector<std::string>& names,
+                               std::vector<SparseHistogram>& histograms, int& numWords) {
+    std::ifstream fin(filename);
+    if (!fin.is_open()) {
+        std::cerr << "cannot open file: " << filename << std::endl;
+        return false;
+    }
+
+    names.clear();
+    histograms.clear();
+    numWords = 0;
+    std::string line;
+    while (getline(fin, line)) {
+        size_t tab = line.find('\t');
+        if (tab == std::string::npos) {
+            continue;
+        }
+        names.push_back(line.substr(0, tab));
+        histograms.push_back(SparseHistogram());
+        SparseHistogram& hist = histograms.back();
+
+        // 値を順に読み、0でないビンだけを残す
+        const char* p = line.c_str() + tab;
+        int bin = 0;
+        while (true) {
+            while (*p == '\t') {
+                p++;
+            }
+            if (*p == '\0') {
+                break;
+            }
+            char* end;
+            float value = strtof(p, &end);
+            if (end == p) {
+                std::cerr << "invalid histogram: " << names.back() << std::endl;
+                return false;
+            }
+            if (value != 0.0f) {
+                hist.words.push_back(bin);
+                hist.values.push_back(value);
+            }
+            bin++;
+            p = end;
+        }
+        numWords = std::max(numWords, bin);
+    }
+    return true;
+}
+
+/**
+ * ヒストグラムから転置インデックスを作成する
+ *
+ * @param[in]  histograms  各画像の疎なヒストグラム
+ * @param[in]  numWords    Visual Wordsの数
+ * @param[out] index       転置インデックス
+ */
+inline void buildInvertedIndex(const std::vector<SparseHistogram>& histograms, int numWords, InvertedIndex& index) {
+    index = InvertedIndex();
+    index.numWords = numWords;
+    index.numImages = (int)histograms.size();
+
+    // 各語を含む画像数（document frequency）を数えてポスティングリストの位置を決める
+    std::vector<int> df(numWords, 0);
+    for (size_t i = 0; i < histograms.size(); i++) {
+        for (size_t j = 0; j < histograms[i].words.size(); j++) {
+            df[histograms[i].words[j]]++;
+        }
+    }
+    index.postingStart.resize(numWords + 1);
+    index.postingStart[0] = 0;
+    for (int w = 0; w < numWords; w++) {
+        index.postingStart[w + 1] = index.postingStart[w] + df[w];
+    }
+    index.idf.resize(numWords);
+    for (int w = 0; w < numWords; w++) {
+        index.idf[w] = df[w] > 0 ? (float)log((double)index.numImages / df[w]) : 0.0f;
+    }
+
+    // 画像番号の順に詰めるので各ポスティングリストは画像番号の昇順になる
+    index.postingImages.resize(index.postingStart[numWords]);
+    index.postingWeights.resize(index.postingStart[numWords]);
+    std::vector<int> fill(index.postingStart.begin(), index.postingStart.end() - 1);
+    for (size_t i = 0; i < histograms.size(); i++) {
+        const SparseHistogram& hist = histograms[i];
+        double norm = 0.0;
+        for (size_t j = 0; j < hist.words.size(); j++) {
+            double weight = hist.values[j] * index.idf[hist.words[j]];
+            norm += weight * weight;
+        }
+        norm = norm > 0.0 ? 1.0 / sqrt(norm) : 0.0;
+        for (size_t j = 0; j < hist.words.size(); j++) {
+            int w = hist.words[j];
+            index.postingImages[fill[w]] = (int)i;
+            index.postingWeights[fill[w]] = (float)(hist.values[j] * index.idf[w] * norm);
+            fill[w]++;
+        }
+    }
+}
+
+/**
+ * 転置インデックスから類似した画像を検索する
+ * スコアの配列はクエリをまたいで使い回せるように呼び出し側が渡す（触った要素だけを0に戻す）
+ *
+ * @param[in]     index    転置インデックス
+ * @param[in]     query    クエリの疎なヒストグラム
+ * @param[in]     k        返す件数
+ * @param[in,out] scores   画像ごとのスコア（numImages個、すべて0で渡す）
+ * @param[out]    results  類似度の降順の上位k件
+ */
+inline void queryInvertedIndex(const InvertedIndex& index, const SparseHistogram& query, int k,
+                               std::vector<float>& scores, std::vector<RetrievalResult>& results) {
+    results.clear();
+
+    // クエリのtf-idfのノルム
+    double norm = 0.0;
+    for (size_t j = 0; j < query.words.size(); j++) {
+        int w = query.words[j];
+        if (w < index.numWords) {
+            double weight = query.values[j] * index.idf[w];
+            norm += weight * weight;
+        }
+    }
+    if (norm == 0.0) {
+        return;
+    }
+    norm = 1.0 / sqrt(norm);
+
+    // クエリの0でない語のポスティングリストだけをたどってスコアを足し込む
+    std::vector<int> touched;
+    for (size_t j = 0; j < query.words.size(); j++) {
+        int w = query.words[j];
+        if (w >= index.numWords) {
+            continue;
+        }
+        float qw = (float)(query.values[j] * index.idf[w] * norm);
+        if (qw == 0.0f) {
+            continue;
+        }
+        for (int p = index.postingStart[w]; p < index.postingStart[w + 1]; p++) {
+            int image = index.postingImages[p];
+            if (scores[image] == 0.0f) {
+                touched.push_back(image);
+            }
+            scores[image] += qw * index.postingWeights[p];
+        }
+    }
+
+    // スコアのついた画像から上位k件を選び、スコアを0に戻す
+    results.reserve(touched.size());
+    for (size_t i = 0; i < touched.size(); i++) {
+        RetrievalResult r = { touched[i], scores[touched[i]] };
+        results.push_back(r);
+        scores[touched[i]] = 0.0f;
+    }
+    size_t top = std::min(results.size(), (size_t)std::max(k, 0));
+    std::partial_sort(results.begin(), results.begin() + top, results.end(),
+                      [](const RetrievalResult& a, const RetrievalResult& b) {
+                          return a.score > b.score || (a.score == b.score && a.image < b.image);
+                      });
+    results.resize(top);
+}
+
+#endif
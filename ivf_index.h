@@ -0,0 +1,293 @@
+#ifndef IVF_INDEX_H
+#define IVF_INDEX_H
+
+#include <cv.h>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cfloat>
+#include <cstring>
+#include <stdint.h>
+#include "simd_nn.h"
+#include "knn.h"
+#include "thread_pool.h"
+#include "kmeans.h"
+#include "index_snapshot.h"
+
+/*
+ * 転置ファイル（IVF）による近似最近傍探索
+ *
+ * 特徴ベクトルをk-meansで学習した粗い量子化器（numCells個のセントロイド）でセルに分け、
+ * セルごとに点の特徴ベクトル、元の行番号、ラベルを連続した配列（ポスティングリスト）に並べる。
+ * 探索はクエリに近いnprobe個のセルだけを全探索する。
+ *
+ * 各点はグループ（ラプラシアンの符号など）を持ち、セルの中はさらにグループごとに連続して並べる。
+ * クエリと同じグループの範囲だけを調べればよいので、セルの中での絞り込みに比較が要らない。
+ */
+
+const int IVF_INDEX_TYPE = 4;
+const int IVF_CELLS = 1024;          // セル数の既定値
+const int IVF_MIN_CELL_SIZE = 32;    // 1セルの平均の点数がこれを下回らないようにセル数を減らす
+const int IVF_NPROBE = 8;            // 調べるセル数の既定値
+const int IVF_TRAIN_SAMPLES = 131072;  // 粗い量子化器の学習に使う最大サンプル数
+
+// スナップショットの配列の種類
+enum {
+    IVF_META = 0,        // int32 { rows, numCells, numGroups }
+    IVF_CENTROIDS = 1,   // float centroids[numCells][dim]
+    IVF_CELL_START = 2,  // int32 cellStart[numCells * numGroups + 1]
+    IVF_VECTORS = 3,     // float vectors[rows][dim]（セル、グループの順）
+    IVF_IDS = 4,         // int32 ids[rows]（元の行番号）
+    IVF_LABELS = 5       // int32 labels[rows]（物体ID、なくてもよい）
+};
+
+struct IVFIndex {
+    int dim;
+    int rows;
+    int numCells;
+    int numGroups;
+    const float* centroids;
+    const int32_t* cellStart;  // セルcのグループgの点は cellStart[c * numGroups + g]〜cellStart[c * numGroups + g + 1]
+    const float* vectors;
+    const int32_t* ids;
+    const int32_t* labels;     // なければNULL
+
+    // 構築したときの実体（スナップショットから読み込んだときは空でmmap領域を指す）
+    std::vector<float> centroidStore;
+    std::vector<int32_t> cellStartStore;
+    std::vector<float> vectorStore;
+    std::vector<int32_t> idStore;
+    std::vector<int32_t> labelStore;
+
+    IVFIndex() : dim(0), rows(0), numCells(0), numGroups(0), centroids(NULL), cellStart(NULL), vectors(NULL),
+                 ids(NULL), labels(NULL) {}
+
+private:
+    // ポインタが自分の実体を指すのでコピーしない
+    IVFIndex(const IVFIndex&);
+    IVFIndex& operator=(const IVFIndex&);
+};
+
+/**
+ * 探索の作業領域（スレッドごとに持ち、クエリをまたいで使い回す）
+ */
+struct IVFSearchContext {
+    std::vector<std::pair<float, int> > cells;  // 各セルのセントロイドまでの距離
+    KNearest result;                            // 1-NN探索の結果
+};
+
+/**
+ * 特徴ベクトルから転置ファイルを作る（特徴ベクトルはコピーするのでmatはすぐに解放してよい）
+ *
+ * @param[in]  mat        特徴ベクトルの行列（CV_32FC1、各行が1点、行の間に隙間がないこと）
+ * @param[in]  groups     各行のグループ番号（0〜numGroups-1、NULLならすべて0）
+ * @param[in]  numGroups  グループの数
+ * @param[in]  labels     各行の物体ID（NULLなら持たない）
+ * @param[in]  numCells   セル数（点が少なければ減らす）
+ * @param[in]  pool       スレッドプール（k-meansと割り当てに使う）
+ * @param[out] index      転置ファイル
+ *
+ * @return 成功ならtrue、失敗ならfalse
+ */
+inline bool buildIVF(const CvMat* mat, const int* groups, int numGroups, const int* labels, int numCells,
+                     ThreadPool& pool, IVFIndex& index) {
+    int rows = mat != NULL ? mat->rows : 0;
+    int dim = mat != NULL ? mat->cols : 0;
+    numGroups = std::max(numGroups, 1);
+    numCells = std::max(std::min(numCells, rows / IVF_MIN_CELL_SIZE), 1);
+
+    // 粗い量子化器を学習し、各点を一番近いセルに割り当てる
+    std::vector<int> cell(rows, 0);
+    index.centroidStore.assign((size_t)numCells * dim, 0.0f);
+    if (rows > 0) {
+        KMeansParams params;
+        params.k = numCells;
+        params.maxIter = 10;
+        params.maxSamples = IVF_TRAIN_SAMPLES;
+        params.verbose = false;
+        CvMat* centroids = cvCreateMat(numCells, dim, CV_32FC1);
+        if (!trainKMeans(mat, params, pool, centroids)) {
+            cvReleaseMat(&centroids);
+            return false;
+        }
+        for (int c = 0; c < numCells; c++) {
+            memcpy(&index.centroidStore[(size_t)c * dim], centroids->data.ptr + (size_t)c * centroids->step,
+                   dim * sizeof(float));
+        }
+        cvReleaseMat(&centroids);
+
+        std::vector<float> dists(rows);
+        assignNearest(mat->data.fl, rows, &index.centroidStore[0], numCells, dim, &cell[0], &dists[0], pool);
+    }
+
+    // (セル, グループ)ごとに数えてから詰める
+    int numLists = numCells * numGroups;
+    index.cellStartStore.assign(numLists + 1, 0);
+    for (int i = 0; i < rows; i++) {
+        index.cellStartStore[cell[i] * numGroups + (groups != NULL ? groups[i] : 0) + 1]++;
+    }
+    for (int l = 0; l < numLists; l++) {
+        index.cellStartStore[l + 1] += index.cellStartStore[l];
+    }
+    std::vector<int32_t> fill(index.cellStartStore.begin(), index.cellStartStore.end() - 1);
+    index.vectorStore.resize((size_t)rows * dim);
+    index.idStore.resize(rows);
+    index.labelStore.resize(labels != NULL ? rows : 0);
+    for (int i = 0; i < rows; i++) {
+        int pos = fill[cell[i] * numGroups + (groups != NULL ? groups[i] : 0)]++;
+        memcpy(&index.vectorStore[(size_t)pos * dim], mat->data.ptr + (size_t)i * mat->step, dim * sizeof(float));
+        index.idStore[pos] = i;
+        if (labels != NULL) {
+            index.labelStore[pos] = labels[i];
+        }
+    }
+
+    index.dim = dim;
+    index.rows = rows;
+    index.numCells = numCells;
+    index.numGroups = numGroups;
+    index.centroids = &index.centroidStore[0];
+    index.cellStart = &index.cellStartStore[0];
+    index.vectors = rows > 0 ? &index.vectorStore[0] : NULL;
+    index.ids = rows > 0 ? &index.idStore[0] : NULL;
+    index.labels = labels != NULL && rows > 0 ? &index.labelStore[0] : NULL;
+    return true;
+}
+
+/**
+ * クエリに近いnprobe個のセルで同じグループの点からk-NNを探す
+ *
+ * @param[in]     index    転置ファイル
+ * @param[in]     query    クエリの特徴ベクトル
+ * @param[in]     group    クエリのグループ番号
+ * @param[in]     nprobe   調べるセル数
+ * @param[in,out] context  作業領域（呼び出し側で使い回す）
+ * @param[in,out] result   k-NN（reset()でkを決めておく、点の番号はids[]やlabels[]の添字）
+ */
+inline void searchIVF(const IVFIndex& index, const float* query, int group, int nprobe, IVFSearchContext& context,
+                      KNearest& result) {
+    if (index.rows == 0 || group < 0 || group >= index.numGroups) {
+        return;
+    }
+    L2BoundedFunc l2 = l2Bounded();
+
+    // クエリに近い順にnprobe個のセルを選ぶ
+    std::vector<std::pair<float, int> >& cells = context.cells;
+    cells.resize(index.numCells);
+    for (int c = 0; c < index.numCells; c++) {
+        cells[c] = std::make_pair(l2(query, index.centroids + (size_t)c * index.dim, index.dim, FLT_MAX), c);
+    }
+    nprobe = std::max(std::min(nprobe, index.numCells), 1);
+    std::partial_sort(cells.begin(), cells.begin() + nprobe, cells.end());
+
+    // 選んだセルの同じグループの範囲だけを全探索
+    for (int j = 0; j < nprobe; j++) {
+        int list = cells[j].second * index.numGroups + group;
+        for (int i = index.cellStart[list]; i < index.cellStart[list + 1]; i++) {
+            float worst = result.bound();
+            float d = l2(query, index.vectors + (size_t)i * index.dim, index.dim, worst);
+            if (d < worst) {
+                result.push(d, i);
+            }
+        }
+    }
+}
+
+/**
+ * クエリに近いnprobe個のセルで同じグループの点から1-NNを探す
+ *
+ * @param[in]     index    転置ファイル
+ * @param[in]     query    クエリの特徴ベクトル
+ * @param[in]     group    クエリのグループ番号
+ * @param[in]     nprobe   調べるセル数
+ * @param[in,out] context  作業領域（呼び出し側で使い回す）
+ * @param[out]    nnDist   1-NNまでの二乗距離
+ *
+ * @return 1-NNの点の番号（ids[]やlabels[]の添字）、見つからなければ-1
+ */
+inline int searchIVF(const IVFIndex& index, const float* query, int group, int nprobe, IVFSearchContext& context,
+                     float& nnDist) {
+    context.result.reset(1);
+    searchIVF(index, query, group, nprobe, context, context.result);
+    return context.result.nearest(nnDist);
+}
+
+/**
+ * 転置ファイルの大きさ（バイト数）
+ */
+inline size_t ivfIndexSize(const IVFIndex& index) {
+    return ((size_t)index.rows + index.numCells) * index.dim * sizeof(float) +
+           (size_t)index.rows * sizeof(int32_t) * (index.labels ? 2 : 1) +
+           ((size_t)index.numCells * index.numGroups + 1) * sizeof(int32_t);
+}
+
+/**
+ * 転置ファイルをスナップショットに書く配列に加える
+ *
+ * @param[in]     index  転置ファイル
+ * @param[in]     part   区画番号
+ * @param[in,out] meta   IVF_METAの中身（書き込みが終わるまで保持する）
+ * @param[in,out] blobs  書き込む配列
+ */
+inline void appendIVFBlobs(const IVFIndex& index, int part, int32_t meta[3], std::vector<SnapshotBlob>& blobs) {
+    meta[0] = index.rows;
+    meta[1] = index.numCells;
+    meta[2] = index.numGroups;
+    blobs.push_back(snapshotBlob(part, IVF_META, meta, 3 * sizeof(int32_t)));
+    blobs.push_back(snapshotBlob(part, IVF_CENTROIDS, index.centroids, (size_t)index.numCells * index.dim * sizeof(float)));
+    blobs.push_back(snapshotBlob(part, IVF_CELL_START, index.cellStart,
+                                 ((size_t)index.numCells * index.numGroups + 1) * sizeof(int32_t)));
+    blobs.push_back(snapshotBlob(part, IVF_VECTORS, index.vectors, (size_t)index.rows * index.dim * sizeof(float)));
+    blobs.push_back(snapshotBlob(part, IVF_IDS, index.ids, (size_t)index.rows * sizeof(int32_t)));
+    if (index.labels != NULL) {
+        blobs.push_back(snapshotBlob(part, IVF_LABELS, index.labels, (size_t)index.rows * sizeof(int32_t)));
+    }
+}
+
+/**
+ * mmapしたスナップショットから転置ファイルを読み込む（配列はmmap領域を直接指す）
+ *
+ * @param[in]  snapshot  mmapしたスナップショット（使い終わるまで解放しない）
+ * @param[in]  part      区画番号
+ * @param[out] index     転置ファイル
+ *
+ * @return 成功ならtrue、失敗ならfalse
+ */
+inline bool loadIVF(const IndexSnapshot& snapshot, int part, IVFIndex& index) {
+    size_t metaSize, centroidSize, cellStartSize, vectorSize, idSize, labelSize;
+    const int32_t* meta = (const int32_t*)snapshotSection(snapshot, part, IVF_META, metaSize);
+    if (meta == NULL || metaSize != 3 * sizeof(int32_t) || meta[1] < 1 || meta[2] < 1) {
+        return false;
+    }
+    index.dim = snapshot.dim;
+    index.rows = meta[0];
+    index.numCells = meta[1];
+    index.numGroups = meta[2];
+    index.centroids = (const float*)snapshotSection(snapshot, part, IVF_CENTROIDS, centroidSize);
+    index.cellStart = (const int32_t*)snapshotSection(snapshot, part, IVF_CELL_START, cellStartSize);
+    index.vectors = (const float*)snapshotSection(snapshot, part, IVF_VECTORS, vectorSize);
+    index.ids = (const int32_t*)snapshotSection(snapshot, part, IVF_IDS, idSize);
+    index.labels = (const int32_t*)snapshotSection(snapshot, part, IVF_LABELS, labelSize);
+    if (labelSize != (size_t)index.rows * sizeof(int32_t)) {
+        index.labels = NULL;
+    }
+    size_t numLists = (size_t)index.numCells * index.numGroups;
+    if (index.rows < 0 || centroidSize != (size_t)index.numCells * index.dim * sizeof(float) ||
+        cellStartSize != (numLists + 1) * sizeof(int32_t) ||
+        vectorSize != (size_t)index.rows * index.dim * sizeof(float) || idSize != (size_t)index.rows * sizeof(int32_t)) {
+        return false;
+    }
+
+    // 探索はセルの範囲の特徴ベクトルをそのまま読むので、範囲が0から始まり単調でrowsで終わることを確かめる
+    if (index.cellStart[0] != 0 || index.cellStart[numLists] != index.rows) {
+        return false;
+    }
+    for (size_t i = 0; i < numLists; i++) {
+        if (index.cellStart[i] > index.cellStart[i + 1]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif
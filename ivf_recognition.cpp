@@ -0,0 +1,9 @@
+#include "recognizer.h"
+
+/**
+ * 転置ファイルで最近傍探索する物体認識
+ * 使い方はrunRecognizer()を参照
+ */
+int main(int argc, char** argv) {
+    return runRecognizer(argc, argv, "ivf");
+}
@@ -0,0 +1,392 @@
+#ifndef KDTREE_INDEX_H
+#define KDTREE_INDEX_H
+
+#include <cv.h>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cfloat>
+#include <cstring>
+#include <stdint.h>
+#include "simd_nn.h"
+#include "knn.h"
+#include "index_snapshot.h"
+
+/*
+ * 平坦な配列で表したランダムkd-tree（Silpa-Anan & Hartley、FLANNのrandomized kd-forest）
+ *
+ * 同じ点から複数の木を作る。各ノードは分散が大きい上位KDTREE_RAND_DIMS個の次元から
+ * ランダムに選んだ次元の中央値で分割するので、木ごとに空間の分け方が異なる。
+ * ノードはすべての木の分を1つの配列に深さ優先で並べ、子は配列の番号で指す。
+ * 葉は点の番号の配列（木ごとに葉の順に並べたもの）の連続した範囲を持つ。特徴ベクトルは1つだけ持つ。
+ * すべてが配列なのでスナップショットにそのまま書けて、mmapした領域を直接指すだけで読み込める。
+ *
+ * 探索はBest-Bin-First（Beis & Lowe）で、すべての木の遠い側の枝を1つの優先度付きキューに
+ * 下界つきで積み、距離を計算した点がmaxChecksに達するまで下界の小さい枝から調べる。
+ * 同じ点は別の木で見つけても1回しか数えない。木を増やすとmaxChecksが同じでも正確になりやすく、
+ * maxChecksを大きくするほど正確になり遅くなる（cvFindFeatures()のemaxに相当）。
+ */
+
+const int KDTREE_INDEX_TYPE = 1;
+const int KDTREE_TREES = 4;      // 木の数の既定値
+const int KDTREE_LEAF_SIZE = 8;  // 葉の点の最大数の既定値
+const int KDTREE_RAND_DIMS = 5;  // 分割する次元を選ぶ候補の数
+const int KDTREE_CHECKS = 250;   // 探索で距離を計算する点の数の上限の既定値
+
+// スナップショットの配列の種類
+enum {
+    KDTREE_META = 0,     // int32 { rows, numNodes, numTrees }
+    KDTREE_VECTORS = 1,  // float vectors[rows][dim]
+    KDTREE_IDS = 2,      // int32 ids[rows]（元の行番号）
+    KDTREE_LABELS = 3,   // int32 labels[rows]（物体ID、なくてもよい）
+    KDTREE_NODES = 4,    // KDTreeNode nodes[numNodes]
+    KDTREE_ROOTS = 5,    // int32 roots[numTrees]
+    KDTREE_LEAVES = 6    // int32 leaves[numTrees * rows]（木ごとに葉の順に並べた点の番号）
+};
+
+struct KDTreeNode {
+    int32_t splitDim;  // 分割する次元（葉なら-1）
+    float splitValue;  // 分割する値（左は以下、右は以上）
+    int32_t left;      // 左の子（葉ならleaves[]の範囲の先頭）
+    int32_t right;     // 右の子（葉ならleaves[]の範囲の末尾の次）
+};
+
+/**
+ * 探索中の枝
+ */
+struct KDBranch {
+    float bound;   // この枝の点までの距離の2乗の下界
+    int32_t node;
+
+    bool operator<(const KDBranch& other) const {
+        return bound > other.bound;  // std::priority_queueと同じ向きでヒープにするため逆にする
+    }
+};
+
+/**
+ * 探索の作業領域（スレッドごとに持ち、クエリをまたいで使い回す）
+ */
+struct KDSearchContext {
+    std::vector<KDBranch> heap;     // すべての木で共有する優先度付きキュー
+    std::vector<uint32_t> visited;  // 点ごとに最後に距離を計算した探索の番号
+    uint32_t stamp;                 // 今の探索の番号
+    KNearest result;                // 1-NN探索の結果
+
+    KDSearchContext() : stamp(0) {}
+};
+
+struct KDTreeIndex {
+    int dim;
+    int rows;
+    int numNodes;
+    int numTrees;
+    const float* vectors;     // 特徴ベクトル
+    const int32_t* ids;       // 各点の元の行番号
+    const int32_t* labels;    // 各点の物体ID（なければNULL）
+    const KDTreeNode* nodes;  // すべての木のノード
+    const int32_t* roots;     // 各木の根のノード番号
+    const int32_t* leaves;    // 葉の点の番号（葉はこの配列の連続した範囲を持つ）
+
+    // 構築したときの実体（スナップショットから読み込んだときは空でmmap領域を指す）
+    std::vector<float> vectorStore;
+    std::vector<int32_t> idStore;
+    std::vector<int32_t> labelStore;
+    std::vector<KDTreeNode> nodeStore;
+    std::vector<int32_t> rootStore;
+    std::vector<int32_t> leafStore;
+
+    KDTreeIndex() : dim(0), rows(0), numNodes(0), numTrees(0), vectors(NULL), ids(NULL), labels(NULL), nodes(NULL),
+                    roots(NULL), leaves(NULL) {}
+
+private:
+    // ポインタが自分の実体を指すのでコピーしない
+    KDTreeIndex(const KDTreeIndex&);
+    KDTreeIndex& operator=(const KDTreeIndex&);
+};
+
+/**
+ * leaves[begin, end)の点でkd-treeのノードを作る（再帰）
+ */
+inline int buildKDTreeNode(const float* vectors, int dim, int32_t* leaves, int begin, int end, int leafSize,
+                           std::mt19937& rng, std::vector<KDTreeNode>& nodes) {
+    int node = (int)nodes.size();
+    KDTreeNode leaf = { -1, 0.0f, begin, end };
+    nodes.push_back(leaf);
+    if (end - begin <= leafSize) {
+        return node;
+    }
+
+    // 分散の大きい上位KDTREE_RAND_DIMS個の次元からランダムに選ぶ（点が多ければ一部だけで分散を見積もる）
+    const int MAX_SAMPLES = 128;
+    int n = end - begin;
+    int step = std::max(n / MAX_SAMPLES, 1);
+    std::vector<double> mean(dim, 0.0), var(dim, 0.0);
+    int samples = 0;
+    for (int i = begin; i < end; i += step, samples++) {
+        const float* v = vectors + (size_t)leaves[i] * dim;
+        for (int d = 0; d < dim; d++) {
+            mean[d] += v[d];
+            var[d] += (double)v[d] * v[d];
+        }
+    }
+    std::vector<int> order(dim);
+    for (int d = 0; d < dim; d++) {
+        double m = mean[d] / samples;
+        var[d] = var[d] / samples - m * m;
+        order[d] = d;
+    }
+    int numCandidates = std::min(KDTREE_RAND_DIMS, dim);
+    std::partial_sort(order.begin(), order.begin() + numCandidates, order.end(),
+                      [&](int a, int b) { return var[a] > var[b]; });
+    int splitDim = order[rng() % numCandidates];
+
+    // 中央値で左右に分ける
+    int mid = begin + n / 2;
+    std::nth_element(leaves + begin, leaves + mid, leaves + end, [&](int a, int b) {
+        return vectors[(size_t)a * dim + splitDim] < vectors[(size_t)b * dim + splitDim];
+    });
+    float splitValue = vectors[(size_t)leaves[mid] * dim + splitDim];
+
+    int left = buildKDTreeNode(vectors, dim, leaves, begin, mid, leafSize, rng, nodes);
+    int right = buildKDTreeNode(vectors, dim, leaves, mid, end, leafSize, rng, nodes);
+    nodes[node].splitDim = splitDim;
+    nodes[node].splitValue = splitValue;
+    nodes[node].left = left;
+    nodes[node].right = right;
+    return node;
+}
+
+/**
+ * 特徴ベクトルからランダムkd-treeを作る（特徴ベクトルはコピーするのでmatはすぐに解放してよい）
+ *
+ * @param[in]  mat       特徴ベクトルの行列（CV_32FC1、各行が1点）
+ * @param[in]  ids       各行の元の行番号（NULLなら行番号そのもの）
+ * @param[in]  labels    各行の物体ID（NULLなら持たない）
+ * @param[in]  numTrees  木の数
+ * @param[in]  leafSize  葉の点の最大数
+ * @param[out] index     kd-tree
+ */
+inline void buildKDTree(const CvMat* mat, const int* ids, const int* labels, int numTrees, int leafSize,
+                        KDTreeIndex& index) {
+    int rows = mat != NULL ? mat->rows : 0;
+    int dim = mat != NULL ? mat->cols : 0;
+    numTrees = std::max(numTrees, 1);
+
+    index.vectorStore.resize((size_t)rows * dim);
+    index.idStore.resize(rows);
+    index.labelStore.resize(labels != NULL ? rows : 0);
+    for (int i = 0; i < rows; i++) {
+        memcpy(&index.vectorStore[(size_t)i * dim], mat->data.ptr + (size_t)i * mat->step, dim * sizeof(float));
+        index.idStore[i] = ids != NULL ? ids[i] : i;
+        if (labels != NULL) {
+            index.labelStore[i] = labels[i];
+        }
+    }
+
+    // 木ごとにleaves[]の自分の範囲を並べ替えながらノードを作る（乱数の種は固定して毎回同じ木にする）
+    std::mt19937 rng(0);
+    index.nodeStore.clear();
+    index.rootStore.assign(numTrees, 0);
+    index.leafStore.resize((size_t)numTrees * rows);
+    for (int t = 0; t < numTrees && rows > 0; t++) {
+        for (int i = 0; i < rows; i++) {
+            index.leafStore[(size_t)t * rows + i] = i;
+        }
+        index.rootStore[t] = buildKDTreeNode(&index.vectorStore[0], dim, &index.leafStore[0], t * rows, (t + 1) * rows,
+                                             std::max(leafSize, 1), rng, index.nodeStore);
+    }
+
+    index.dim = dim;
+    index.rows = rows;
+    index.numNodes = (int)index.nodeStore.size();
+    index.numTrees = numTrees;
+    index.vectors = rows > 0 ? &index.vectorStore[0] : NULL;
+    index.ids = rows > 0 ? &index.idStore[0] : NULL;
+    index.labels = labels != NULL && rows > 0 ? &index.labelStore[0] : NULL;
+    index.nodes = rows > 0 ? &index.nodeStore[0] : NULL;
+    index.roots = &index.rootStore[0];
+    index.leaves = rows > 0 ? &index.leafStore[0] : NULL;
+}
+
+/**
+ * nodeから近い側の子をたどって葉まで降り、遠い側の子をキューに積み、葉の点と距離を計算する
+ */
+inline void descendKDTree(const KDTreeIndex& index, const float* query, int node, float bound, L2BoundedFunc l2,
+                          KDSearchContext& context, int& checks, KNearest& result) {
+    while (index.nodes[node].splitDim >= 0) {
+        const KDTreeNode& n = index.nodes[node];
+        float diff = query[n.splitDim] - n.splitValue;
+        KDBranch far = { std::max(bound, diff * diff), diff < 0 ? n.right : n.left };
+        if (far.bound < result.bound()) {
+            context.heap.push_back(far);
+            std::push_heap(context.heap.begin(), context.heap.end());
+        }
+        node = diff < 0 ? n.left : n.right;
+    }
+
+    // k番目より遠くなったら打ち切る、別の木で調べた点は飛ばす
+    const KDTreeNode& leaf = index.nodes[node];
+    for (int j = leaf.left; j < leaf.right; j++) {
+        int i = index.leaves[j];
+        if (context.visited[i] == context.stamp) {
+            continue;
+        }
+        context.visited[i] = context.stamp;
+        float worst = result.bound();
+        float d = l2(query, index.vectors + (size_t)i * index.dim, index.dim, worst);
+        if (d < worst) {
+            result.push(d, i);
+        }
+        checks++;
+    }
+}
+
+/**
+ * Best-Bin-Firstでk-NNを探す
+ *
+ * @param[in]     index      kd-tree
+ * @param[in]     query      クエリの特徴ベクトル
+ * @param[in]     maxChecks  距離を計算する点の数の上限
+ * @param[in,out] context    作業領域（呼び出し側で使い回す）
+ * @param[in,out] result     k-NN（reset()でkを決めておく、点の番号はids[]やlabels[]の添字）
+ */
+inline void searchKDTree(const KDTreeIndex& index, const float* query, int maxChecks, KDSearchContext& context,
+                         KNearest& result) {
+    if (index.rows == 0) {
+        return;
+    }
+    L2BoundedFunc l2 = l2Bounded();
+    context.heap.clear();
+
+    // 調べた点の印は探索の番号で区別し、探索のたびに消さずに済ませる
+    if (context.visited.size() < (size_t)index.rows) {
+        context.visited.assign(index.rows, 0);
+        context.stamp = 0;
+    }
+    if (++context.stamp == 0) {
+        std::fill(context.visited.begin(), context.visited.end(), 0);
+        context.stamp = 1;
+    }
+
+    // まず各木の根から葉まで降りる
+    int checks = 0;
+    for (int t = 0; t < index.numTrees; t++) {
+        descendKDTree(index, query, index.roots[t], 0.0f, l2, context, checks, result);
+    }
+
+    // 下界がk番目より近い枝のうち一番近いものから続ける
+    while (!context.heap.empty() && checks < maxChecks) {
+        std::pop_heap(context.heap.begin(), context.heap.end());
+        KDBranch branch = context.heap.back();
+        context.heap.pop_back();
+        if (branch.bound >= result.bound()) {
+            break;  // 残りの枝はすべてこれより遠い
+        }
+        descendKDTree(index, query, branch.node, branch.bound, l2, context, checks, result);
+    }
+}
+
+/**
+ * Best-Bin-Firstで1-NNを探す
+ *
+ * @param[in]     index      kd-tree
+ * @param[in]     query      クエリの特徴ベクトル
+ * @param[in]     maxChecks  距離を計算する点の数の上限
+ * @param[in,out] context    作業領域（呼び出し側で使い回す）
+ * @param[out]    nnDist     1-NNまでの距離の2乗
+ *
+ * @return 1-NNの点の番号（ids[]やlabels[]の添字）、見つからなければ-1
+ */
+inline int searchKDTree(const KDTreeIndex& index, const float* query, int maxChecks, KDSearchContext& context,
+                        float& nnDist) {
+    context.result.reset(1);
+    searchKDTree(index, query, maxChecks, context, context.result);
+    return context.result.nearest(nnDist);
+}
+
+/**
+ * kd-treeをスナップショットに書く配列に加える
+ *
+ * @param[in]     index  kd-tree
+ * @param[in]     part   区画番号
+ * @param[in,out] meta   KDTREE_METAの中身（書き込みが終わるまで保持する）
+ * @param[in,out] blobs  書き込む配列
+ */
+inline void appendKDTreeBlobs(const KDTreeIndex& index, int part, int32_t meta[3], std::vector<SnapshotBlob>& blobs) {
+    meta[0] = index.rows;
+    meta[1] = index.numNodes;
+    meta[2] = index.numTrees;
+    blobs.push_back(snapshotBlob(part, KDTREE_META, meta, 3 * sizeof(int32_t)));
+    blobs.push_back(snapshotBlob(part, KDTREE_VECTORS, index.vectors, (size_t)index.rows * index.dim * sizeof(float)));
+    blobs.push_back(snapshotBlob(part, KDTREE_IDS, index.ids, (size_t)index.rows * sizeof(int32_t)));
+    if (index.labels != NULL) {
+        blobs.push_back(snapshotBlob(part, KDTREE_LABELS, index.labels, (size_t)index.rows * sizeof(int32_t)));
+    }
+    blobs.push_back(snapshotBlob(part, KDTREE_NODES, index.nodes, (size_t)index.numNodes * sizeof(KDTreeNode)));
+    blobs.push_back(snapshotBlob(part, KDTREE_ROOTS, index.roots, (size_t)index.numTrees * sizeof(int32_t)));
+    blobs.push_back(snapshotBlob(part, KDTREE_LEAVES, index.leaves,
+                                 (size_t)index.numTrees * index.rows * sizeof(int32_t)));
+}
+
+/**
+ * mmapしたスナップショットからkd-treeを読み込む（配列はmmap領域を直接指す）
+ *
+ * @param[in]  snapshot  mmapしたスナップショット（kd-treeを使い終わるまで解放しない）
+ * @param[in]  part      区画番号
+ * @param[out] index     kd-tree
+ *
+ * @return 成功ならtrue、失敗ならfalse
+ */
+inline bool loadKDTree(const IndexSnapshot& snapshot, int part, KDTreeIndex& index) {
+    size_t metaSize, vectorSize, idSize, labelSize, nodeSize, rootSize, leafSize;
+    const int32_t* meta = (const int32_t*)snapshotSection(snapshot, part, KDTREE_META, metaSize);
+    if (meta == NULL || metaSize != 3 * sizeof(int32_t) || meta[2] < 1) {
+        return false;
+    }
+    index.dim = snapshot.dim;
+    index.rows = meta[0];
+    index.numNodes = meta[1];
+    index.numTrees = meta[2];
+    index.vectors = (const float*)snapshotSection(snapshot, part, KDTREE_VECTORS, vectorSize);
+    index.ids = (const int32_t*)snapshotSection(snapshot, part, KDTREE_IDS, idSize);
+    index.labels = (const int32_t*)snapshotSection(snapshot, part, KDTREE_LABELS, labelSize);
+    index.nodes = (const KDTreeNode*)snapshotSection(snapshot, part, KDTREE_NODES, nodeSize);
+    index.roots = (const int32_t*)snapshotSection(snapshot, part, KDTREE_ROOTS, rootSize);
+    index.leaves = (const int32_t*)snapshotSection(snapshot, part, KDTREE_LEAVES, leafSize);
+    if (labelSize != (size_t)index.rows * sizeof(int32_t)) {
+        index.labels = NULL;
+    }
+    size_t numLeaves = (size_t)index.numTrees * index.rows;
+    if (index.rows < 0 || index.numNodes < 0 || (index.rows > 0 && index.numNodes == 0) ||
+        vectorSize != (size_t)index.rows * index.dim * sizeof(float) || idSize != (size_t)index.rows * sizeof(int32_t) ||
+        nodeSize != (size_t)index.numNodes * sizeof(KDTreeNode) || rootSize != (size_t)index.numTrees * sizeof(int32_t) ||
+        leafSize != numLeaves * sizeof(int32_t)) {
+        return false;
+    }
+
+    // 探索はノードと葉をそのまま辿るので、子の番号、分割する次元、葉の範囲と点の番号を確かめる
+    // 子は深さ優先で親より後ろに並ぶので、後ろだけを指していれば循環しない
+    for (int i = 0; i < index.numNodes; i++) {
+        const KDTreeNode& n = index.nodes[i];
+        if (n.splitDim >= 0) {
+            if (n.splitDim >= index.dim || n.left <= i || n.left >= index.numNodes || n.right <= i ||
+                n.right >= index.numNodes) {
+                return false;
+            }
+        } else if (n.splitDim != -1 || n.left < 0 || n.left > n.right || (size_t)n.right > numLeaves) {
+            return false;
+        }
+    }
+    return index.rows == 0 || (snapshotIndicesInRange(index.roots, index.numTrees, index.numNodes) &&
+                               snapshotIndicesInRange(index.leaves, numLeaves, index.rows));
+}
+
+/**
+ * kd-treeの大きさ（バイト数）
+ */
+inline size_t kdTreeIndexSize(const KDTreeIndex& index) {
+    return (size_t)index.rows * index.dim * sizeof(float) + (size_t)index.rows * sizeof(int32_t) * (index.labels ? 2 : 1) +
+           (size_t)index.numNodes * sizeof(KDTreeNode) + (size_t)index.numTrees * (index.rows + 1) * sizeof(int32_t);
+}
+
+#endif
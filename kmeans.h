@@ -0,0 +1,418 @@
+#ifndef KMEANS_H
+#define KMEANS_H
+
+#include <cv.h>
+#include <iostream>
+#include <vector>
+#include <random>
+#include <cfloat>
+#include <cstring>
+#include <algorithm>
+#include "simd_nn.h"
+#include "thread_pool.h"
+
+/*
+ * Visual Words（コードブック）学習用のk-means
+ *
+ * 初期値はランダム / k-means++ / k-means||、更新はLloyd（全サンプル）かミニバッチを選べる。
+ * 各サンプルを一番近いセントロイドに割り当てる処理（計算量の大部分）はスレッドプールで並列化し、
+ * セントロイドの更新は決まった順序で足し合わせるのでスレッド数によらず同じ結果になる。
+ */
+
+enum KMeansSeeding {
+    KMEANS_SEED_RANDOM,     // ランダムに選んだサンプル
+    KMEANS_SEED_PP,         // k-means++
+    KMEANS_SEED_PARALLEL    // k-means||
+};
+
+struct KMeansParams {
+    int k;                  // クラスタ数
+    int maxIter;            // 最大反復回数
+    int batchSize;          // ミニバッチの大きさ（0ならLloyd）
+    int maxSamples;         // 学習に使う最大サンプル数（0なら全部、超えたらランダムに間引く）
+    KMeansSeeding seeding;  // 初期値の選び方
+    int parallelRounds;     // k-means||のラウンド数
+    double tolerance;       // Lloydで誤差の相対変化がこれ以下になったら終了
+    unsigned seed;          // 乱数の種
+    bool verbose;           // 反復ごとの誤差と時間を表示する
+
+    KMeansParams() : k(500), maxIter(10), batchSize(0), maxSamples(0), seeding(KMEANS_SEED_PP),
+                     parallelRounds(5), tolerance(1e-4), seed(0), verbose(true) {}
+};
+
+const int KMEANS_ASSIGN_CHUNK = 64;                         // 1スレッドが一度に割り当てるサンプル数
+const int KMEANS_SAMPLE_BLOCK = KMEANS_ASSIGN_CHUNK * 16;  // k-means++で重みの合計をまとめるサンプル数
+
+/**
+ * 各サンプルに一番近いセントロイドを求める（並列）
+ *
+ * @param[in]  data     サンプル（n x dim）
+ * @param[in]  n        サンプル数
+ * @param[in]  centers  セントロイド（k x dim）
+ * @param[in]  k        セントロイド数
+ * @param[in]  dim      次元数
+ * @param[out] labels   各サンプルのセントロイド番号
+ * @param[out] dists    各サンプルからセントロイドまでの二乗距離
+ * @param[in]  pool     スレッドプール
+ */
+inline void assignNearest(const float* data, int n, const float* centers, int k, int dim,
+                          int* labels, float* dists, ThreadPool& pool) {
+    pool.parallelFor(n, KMEANS_ASSIGN_CHUNK, [&](int begin, int end, int worker) {
+        searchNNBlock(data + (size_t)begin * dim, NULL, end - begin, centers, NULL, k, dim,
+                      labels + begin, dists + begin);
+    });
+}
+
+/**
+ * 重み付きの確率でインデックスを1つ選ぶ
+ * 重みをKMEANS_SAMPLE_BLOCK個ずつのブロックに分け、ブロックの合計の累積和を二分探索してから
+ * そのブロックだけを走査する（全インデックスは走査しない）
+ *
+ * @param[in] probs   各インデックスの重み（負でないこと）
+ * @param[in] prefix  ブロックごとの重みの合計の累積和（prefix[b]はブロック0〜bの合計）
+ * @param[in] rng     乱数生成器
+ *
+ * @return 選んだインデックス（重みの合計が0なら一様に選ぶ）
+ */
+inline int sampleIndex(const std::vector<double>& probs, const std::vector<double>& prefix, std::mt19937& rng) {
+    int n = (int)probs.size();
+    double total = prefix.empty() ? 0.0 : prefix.back();
+    if (total <= 0.0) {
+        return std::uniform_int_distribution<int>(0, n - 1)(rng);
+    }
+    double r = std::uniform_real_distribution<double>(0.0, total)(rng);
+    int b = (int)(std::upper_bound(prefix.begin(), prefix.end(), r) - prefix.begin());
+    b = std::min(b, (int)prefix.size() - 1);
+    r -= b > 0 ? prefix[b - 1] : 0.0;
+    int begin = b * KMEANS_SAMPLE_BLOCK;
+    int end = std::min(begin + KMEANS_SAMPLE_BLOCK, n);
+    int last = end - 1;
+    for (int i = begin; i < end; i++) {
+        if (probs[i] > 0.0) {
+            last = i;
+            r -= probs[i];
+            if (r < 0.0) {
+                return i;
+            }
+        }
+    }
+    return last;  // 丸め誤差で残ったときはブロック中の重みが正の最後のインデックス
+}
+
+/**
+ * minDistを新しいセントロイドまでの距離で更新する（並列）
+ */
+inline void updateMinDist(const float* data, int n, int dim, const float* center,
+                          std::vector<float>& minDist, ThreadPool& pool) {
+    L2BoundedFunc l2 = l2Bounded();
+    pool.parallelFor(n, KMEANS_ASSIGN_CHUNK * 16, [&](int begin, int end, int worker) {
+        for (int i = begin; i < end; i++) {
+            float d = l2(data + (size_t)i * dim, center, dim, minDist[i]);
+            if (d < minDist[i]) {
+                minDist[i] = d;
+            }
+        }
+    });
+}
+
+/**
+ * k-means++で初期セントロイドを選ぶ
+ * 1個選ぶごとの計算は全サンプルの距離の更新（並列）とブロックの合計の累積和だけで、抽出は1ブロックを走査する
+ *
+ * @param[in]  data     サンプル（n x dim）
+ * @param[in]  weights  各サンプルの重み（NULLならすべて1）
+ * @param[in]  n        サンプル数
+ * @param[in]  dim      次元数
+ * @param[in]  k        セントロイド数
+ * @param[in]  rng      乱数生成器
+ * @param[in]  pool     スレッドプール
+ * @param[out] centers  初期セントロイド（k x dim）
+ */
+inline void seedKMeansPP(const float* data, const double* weights, int n, int dim, int k,
+                         std::mt19937& rng, ThreadPool& pool, float* centers) {
+    int numBlocks = (n + KMEANS_SAMPLE_BLOCK - 1) / KMEANS_SAMPLE_BLOCK;
+    std::vector<float> minDist(n, FLT_MAX);
+    std::vector<double> probs(n);
+    std::vector<double> blockSums(numBlocks, 0.0);  // ブロックごとの重みの合計
+    std::vector<double> prefix(numBlocks);          // blockSumsの累積和
+    for (int i = 0; i < n; i++) {
+        probs[i] = weights != NULL ? weights[i] : 1.0;
+        blockSums[i / KMEANS_SAMPLE_BLOCK] += probs[i];
+    }
+
+    L2BoundedFunc l2 = l2Bounded();
+    for (int c = 0; c < k; c++) {
+        // 1個目は重みに比例、2個目以降は既存のセントロイドまでの二乗距離x重みに比例した確率で選ぶ
+        double total = 0.0;
+        for (int b = 0; b < numBlocks; b++) {
+            total += blockSums[b];
+            prefix[b] = total;
+        }
+        int idx = sampleIndex(probs, prefix, rng);
+        memcpy(centers + (size_t)c * dim, data + (size_t)idx * dim, dim * sizeof(float));
+        if (c + 1 == k) {
+            break;
+        }
+
+        // 新しいセントロイドまでの距離でminDistと重みを更新し、重みが変わったブロックだけ合計を計算し直す
+        // （チャンクはブロックと同じ境界なので、ブロックの合計はスレッド数によらず同じ順序で足される）
+        const float* center = centers + (size_t)c * dim;
+        pool.parallelFor(n, KMEANS_SAMPLE_BLOCK, [&](int begin, int end, int worker) {
+            bool changed = false;
+            for (int i = begin; i < end; i++) {
+                float d = l2(data + (size_t)i * dim, center, dim, minDist[i]);
+                if (d < minDist[i]) {
+                    minDist[i] = d;
+                    probs[i] = (weights != NULL ? weights[i] : 1.0) * d;
+                    changed = true;
+                }
+            }
+            if (changed) {
+                double sum = 0.0;
+                for (int i = begin; i < end; i++) {
+                    sum += probs[i];
+                }
+                blockSums[begin / KMEANS_SAMPLE_BLOCK] = sum;
+            }
+        });
+    }
+}
+
+/**
+ * k-means||で初期セントロイドを選ぶ
+ * 各ラウンドで 2k 個程度の候補を距離に比例した確率でまとめて選び、
+ * 最後に候補を近いサンプル数で重み付けしてk-means++でk個に絞る
+ */
+inline void seedKMeansParallel(const float* data, int n, int dim, int k, int rounds,
+                               std::mt19937& rng, ThreadPool& pool, float* centers) {
+    std::vector<int> candidates;
+    std::vector<float> minDist(n, FLT_MAX);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+    candidates.push_back(std::uniform_int_distribution<int>(0, n - 1)(rng));
+    updateMinDist(data, n, dim, data + (size_t)candidates[0] * dim, minDist, pool);
+
+    double oversampling = 2.0 * k;
+    for (int r = 0; r < rounds; r++) {
+        double phi = 0.0;
+        for (int i = 0; i < n; i++) {
+            phi += minDist[i];
+        }
+        if (phi <= 0.0) {
+            break;
+        }
+        // 乱数は決まった順序で引くのでスレッド数によらず同じ候補になる
+        std::vector<float> added;
+        for (int i = 0; i < n; i++) {
+            if (uniform(rng) < oversampling * minDist[i] / phi) {
+                candidates.push_back(i);
+                added.insert(added.end(), data + (size_t)i * dim, data + (size_t)(i + 1) * dim);
+            }
+        }
+        int numAdded = (int)added.size() / dim;
+        if (numAdded == 0) {
+            continue;
+        }
+        pool.parallelFor(n, KMEANS_ASSIGN_CHUNK, [&](int begin, int end, int worker) {
+            int nnIndex[KMEANS_ASSIGN_CHUNK];
+            float nnDist[KMEANS_ASSIGN_CHUNK];
+            searchNNBlock(data + (size_t)begin * dim, NULL, end - begin, &added[0], NULL, numAdded, dim,
+                          nnIndex, nnDist);
+            for (int i = begin; i < end; i++) {
+                minDist[i] = std::min(minDist[i], nnDist[i - begin]);
+            }
+        });
+    }
+
+    // 候補が足りなければランダムなサンプルで補う
+    while ((int)candidates.size() < k) {
+        candidates.push_back(std::uniform_int_distribution<int>(0, n - 1)(rng));
+    }
+
+    // 候補を行列にまとめ、各候補に一番近いサンプルの数を重みにする
+    int numCandidates = (int)candidates.size();
+    std::vector<float> candData((size_t)numCandidates * dim);
+    for (int c = 0; c < numCandidates; c++) {
+        memcpy(&candData[(size_t)c * dim], data + (size_t)candidates[c] * dim, dim * sizeof(float));
+    }
+    std::vector<int> labels(n);
+    std::vector<float> dists(n);
+    assignNearest(data, n, &candData[0], numCandidates, dim, &labels[0], &dists[0], pool);
+    std::vector<double> weights(numCandidates, 0.0);
+    for (int i = 0; i < n; i++) {
+        weights[labels[i]] += 1.0;
+    }
+
+    seedKMeansPP(&candData[0], &weights[0], numCandidates, dim, k, rng, pool, centers);
+}
+
+/**
+ * サンプルからmaxSamples個をランダムに選んでコピーする（リザーバサンプリング）
+ */
+inline void subsampleRows(const float* data, int n, int dim, int maxSamples, std::mt19937& rng,
+                          std::vector<float>& out) {
+    std::vector<int> picked(maxSamples);
+    for (int i = 0; i < n; i++) {
+        if (i < maxSamples) {
+            picked[i] = i;
+        } else {
+            int j = std::uniform_int_distribution<int>(0, i)(rng);
+            if (j < maxSamples) {
+                picked[j] = i;
+            }
+        }
+    }
+    // 元の順序で読むようにソートしてからコピー
+    std::sort(picked.begin(), picked.end());
+    out.resize((size_t)maxSamples * dim);
+    for (int i = 0; i < maxSamples; i++) {
+        memcpy(&out[(size_t)i * dim], data + (size_t)picked[i] * dim, dim * sizeof(float));
+    }
+}
+
+/**
+ * k-meansでセントロイドを学習する
+ *
+ * @param[in]  samples    サンプルの行列（各行が1つの特徴ベクトル、CV_32FC1）
+ * @param[in]  params     学習のパラメータ
+ * @param[in]  pool       スレッドプール
+ * @param[out] centroids  セントロイドの行列（params.k x samples->cols、CV_32FC1で確保済み）
+ *
+ * @return 成功ならtrue、失敗ならfalse
+ */
+inline bool trainKMeans(const CvMat* samples, const KMeansParams& params, ThreadPool& pool, CvMat* centroids) {
+    int dim = samples->cols;
+    int k = params.k;
+    if (samples->rows < k || centroids->rows != k || centroids->cols != dim) {
+        std::cerr << "invalid k-means input: " << samples->rows << " samples, k = " << k << std::endl;
+        return false;
+    }
+    std::mt19937 rng(params.seed);
+    double freq = cvGetTickFrequency() * 1000.0;
+
+    // サンプルが多すぎる場合は間引いてコピーしたものを使う
+    const float* data = samples->data.fl;
+    int n = samples->rows;
+    std::vector<float> copied;
+    if (params.maxSamples > 0 && n > params.maxSamples) {
+        subsampleRows(samples->data.fl, n, dim, params.maxSamples, rng, copied);
+        data = &copied[0];
+        n = params.maxSamples;
+    }
+    if (params.verbose) {
+        std::cout << "k-means: " << n << " samples, k = " << k << ", "
+                  << (params.batchSize > 0 ? "mini-batch" : "lloyd") << ", " << pool.size() << " threads" << std::endl;
+    }
+
+    // 初期値
+    double tt = (double)cvGetTickCount();
+    std::vector<float> centers((size_t)k * dim);
+    if (params.seeding == KMEANS_SEED_PP) {
+        seedKMeansPP(data, NULL, n, dim, k, rng, pool, &centers[0]);
+    } else if (params.seeding == KMEANS_SEED_PARALLEL) {
+        seedKMeansParallel(data, n, dim, k, params.parallelRounds, rng, pool, &centers[0]);
+    } else {
+        for (int c = 0; c < k; c++) {
+            int idx = std::uniform_int_distribution<int>(0, n - 1)(rng);
+            memcpy(&centers[(size_t)c * dim], data + (size_t)idx * dim, dim * sizeof(float));
+        }
+    }
+    if (params.verbose) {
+        tt = (double)cvGetTickCount() - tt;
+        std::cout << "  seeding: " << tt / freq << "ms" << std::endl;
+    }
+
+    bool miniBatch = params.batchSize > 0 && params.batchSize < n;
+    int batchSize = miniBatch ? params.batchSize : n;
+    std::vector<float> batch(miniBatch ? (size_t)batchSize * dim : 0);
+    std::vector<int> labels(batchSize);
+    std::vector<float> dists(batchSize);
+    std::vector<double> sums((size_t)k * dim);
+    std::vector<int> batchCounts(k);
+    std::vector<double> totalCounts(k, 0.0);   // ミニバッチの学習率に使う累積の割り当て数
+    double prevInertia = -1.0;
+
+    for (int iter = 0; iter < params.maxIter; iter++) {
+        tt = (double)cvGetTickCount();
+
+        // ミニバッチならランダムにサンプルを選ぶ
+        const float* x = data;
+        if (miniBatch) {
+            for (int i = 0; i < batchSize; i++) {
+                int idx = std::uniform_int_distribution<int>(0, n - 1)(rng);
+                memcpy(&batch[(size_t)i * dim], data + (size_t)idx * dim, dim * sizeof(float));
+            }
+            x = &batch[0];
+        }
+
+        // 一番近いセントロイドに割り当て（並列）
+        assignNearest(x, batchSize, &centers[0], k, dim, &labels[0], &dists[0], pool);
+
+        // 割り当てたサンプルの和を決まった順序で集計
+        double inertia = 0.0;
+        std::fill(sums.begin(), sums.end(), 0.0);
+        std::fill(batchCounts.begin(), batchCounts.end(), 0);
+        for (int i = 0; i < batchSize; i++) {
+            inertia += dists[i];
+            double* sum = &sums[(size_t)labels[i] * dim];
+            const float* v = x + (size_t)i * dim;
+            for (int j = 0; j < dim; j++) {
+                sum[j] += v[j];
+            }
+            batchCounts[labels[i]]++;
+        }
+
+        // セントロイドを更新（サンプルが1つも割り当てられなかったものはそのまま）
+        for (int c = 0; c < k; c++) {
+            if (batchCounts[c] == 0) {
+                continue;
+            }
+            float* center = &centers[(size_t)c * dim];
+            const double* sum = &sums[(size_t)c * dim];
+            if (miniBatch) {
+                // 割り当て回数の逆数を学習率にして平均に近づける
+                totalCounts[c] += batchCounts[c];
+                double eta = 1.0 / totalCounts[c];
+                for (int j = 0; j < dim; j++) {
+                    center[j] += (float)(eta * (sum[j] - batchCounts[c] * (double)center[j]));
+                }
+            } else {
+                for (int j = 0; j < dim; j++) {
+                    center[j] = (float)(sum[j] / batchCounts[c]);
+                }
+            }
+        }
+
+        if (params.verbose) {
+            tt = (double)cvGetTickCount() - tt;
+            std::cout << "  iter " << iter + 1 << ": inertia = " << inertia / batchSize
+                      << ", time = " << tt / freq << "ms" << std::endl;
+        }
+        if (!miniBatch && prevInertia >= 0.0 && prevInertia - inertia <= params.tolerance * inertia) {
+            break;
+        }
+        prevInertia = inertia;
+    }
+
+    // ミニバッチのときは学習に使ったサンプル全体での誤差も表示
+    if (params.verbose && miniBatch) {
+        tt = (double)cvGetTickCount();
+        std::vector<int> allLabels(n);
+        std::vector<float> allDists(n);
+        assignNearest(data, n, &centers[0], k, dim, &allLabels[0], &allDists[0], pool);
+        double inertia = 0.0;
+        for (int i = 0; i < n; i++) {
+            inertia += allDists[i];
+        }
+        tt = (double)cvGetTickCount() - tt;
+        std::cout << "  final inertia = " << inertia / n << ", time = " << tt / freq << "ms" << std::endl;
+    }
+
+    for (int c = 0; c < k; c++) {
+        memcpy(centroids->data.ptr + (size_t)c * centroids->step, &centers[(size_t)c * dim], dim * sizeof(float));
+    }
+
+    return true;
+}
+
+#endif
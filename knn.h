@@ -0,0 +1,95 @@
+#ifndef KNN_H
+#define KNN_H
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cfloat>
+
+/*
+ * k-NN探索の途中結果（これまでに見つけた近い順k個）
+ *
+ * 距離が最大のものを先頭にしたヒープで持ち、k個たまったら先頭の距離を枝刈りや
+ * 距離計算の打ち切りの上限（bound()）に使う。k=1なら従来の1-NN探索と同じ動きになる。
+ */
+class KNearest {
+public:
+    KNearest() : k(1) {}
+
+    void reset(int k) {
+        this->k = std::max(k, 1);
+        items.clear();
+    }
+
+    /**
+     * これより遠い点は結果に入らない距離
+     */
+    float bound() const {
+        return (int)items.size() < k ? FLT_MAX : items.front().first;
+    }
+
+    /**
+     * 点を加える（bound()より遠ければ何もしない）
+     */
+    void push(float dist, int index) {
+        if ((int)items.size() < k) {
+            items.push_back(std::make_pair(dist, index));
+            std::push_heap(items.begin(), items.end());
+        } else if (dist < items.front().first) {
+            std::pop_heap(items.begin(), items.end());
+            items.back() = std::make_pair(dist, index);
+            std::push_heap(items.begin(), items.end());
+        }
+    }
+
+    int size() const {
+        return (int)items.size();
+    }
+
+    int capacity() const {
+        return k;
+    }
+
+    /**
+     * j番目に持っている点の番号（順不同）
+     */
+    int at(int j) const {
+        return items[j].second;
+    }
+
+    /**
+     * 近い順に並べて取り出す（足りない分はindex=-1、dist=FLT_MAXで埋める）
+     *
+     * @param[out] indices  k個の点の番号
+     * @param[out] dists    k個の距離
+     */
+    void sorted(int* indices, float* dists) {
+        std::sort_heap(items.begin(), items.end());
+        for (int j = 0; j < k; j++) {
+            indices[j] = j < (int)items.size() ? items[j].second : -1;
+            dists[j] = j < (int)items.size() ? items[j].first : FLT_MAX;
+        }
+        std::make_heap(items.begin(), items.end());
+    }
+
+    /**
+     * 一番近い点の番号（なければ-1）
+     */
+    int nearest(float& dist) const {
+        int best = -1;
+        dist = FLT_MAX;
+        for (size_t j = 0; j < items.size(); j++) {
+            if (items[j].first < dist) {
+                dist = items[j].first;
+                best = items[j].second;
+            }
+        }
+        return best;
+    }
+
+private:
+    int k;
+    std::vector<std::pair<float, int> > items;
+};
+
+#endif
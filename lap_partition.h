@@ -0,0 +1,119 @@
+#ifndef LAP_PARTITION_H
+#define LAP_PARTITION_H
+
+#include <cv.h>
+#include <vector>
+#include <cstring>
+#include "descdb.h"
+
+/*
+ * ラプラシアンの符号による物体モデルデータベースの分割
+ *
+ * ラプラシアンの符号が異なるキーポイント同士は照合しないので、データベースを符号ごとに
+ * 連続した2つの区画に分けておき、クエリは同じ符号の区画だけを探索する。
+ * 区画ごとに別々のインデックス（全探索、kd-tree、LSHなど）を作る。
+ */
+
+/**
+ * 1つの区画（同じラプラシアンの符号を持つキーポイントの集まり）
+ */
+struct LapPartition {
+    CvMat* mat;                // 各行が特徴ベクトル（行が0ならNULL）
+    std::vector<int> labels;   // matの各行の物体ID
+    std::vector<int> rowIds;   // matの各行の元のobjMatでの行番号
+
+    LapPartition() : mat(NULL) {}
+};
+
+/**
+ * 物体モデルデータベースを区画に分割する
+ * objMatの行がすでに区画順に並んでいれば（convert_descriptionで作ったデータベース）
+ * 各区画はobjMatの一部を参照するだけでコピーしない。そうでなければ区画ごとにコピーする。
+ *
+ * @param[in]  labels      objMatの各行の物体ID
+ * @param[in]  laplacians  objMatの各行のラプラシアン
+ * @param[in]  objMat      特徴量を格納した行列（区画がこれを参照するので先に解放しないこと）
+ * @param[out] parts       NUM_LAP_PARTITIONS個の区画
+ */
+inline void partitionByLaplacian(const std::vector<int>& labels, const std::vector<int>& laplacians,
+                                 CvMat* objMat, LapPartition parts[NUM_LAP_PARTITIONS]) {
+    int dim = objMat->cols;
+    for (int p = 0; p < NUM_LAP_PARTITIONS; p++) {
+        parts[p].labels.clear();
+        parts[p].rowIds.clear();
+    }
+    bool grouped = true;
+    int last = 0;
+    for (int i = 0; i < objMat->rows; i++) {
+        int p = lapPartition(laplacians[i]);
+        if (p < last) {
+            grouped = false;
+        }
+        last = p;
+        parts[p].labels.push_back(labels[i]);
+        parts[p].rowIds.push_back(i);
+    }
+
+    for (int p = 0; p < NUM_LAP_PARTITIONS; p++) {
+        int rows = (int)parts[p].rowIds.size();
+        if (rows == 0) {
+            parts[p].mat = NULL;
+        } else if (grouped) {
+            // 連続しているのでobjMatの一部をそのまま参照
+            parts[p].mat = cvCreateMatHeader(rows, dim, CV_32FC1);
+            cvSetData(parts[p].mat, objMat->data.ptr + (size_t)parts[p].rowIds[0] * objMat->step, objMat->step);
+        } else {
+            parts[p].mat = cvCreateMat(rows, dim, CV_32FC1);
+            for (int i = 0; i < rows; i++) {
+                memcpy(parts[p].mat->data.ptr + (size_t)i * parts[p].mat->step,
+                       objMat->data.ptr + (size_t)parts[p].rowIds[i] * objMat->step, dim * sizeof(float));
+            }
+        }
+    }
+}
+
+/**
+ * 区画の行列を解放する（objMatが参照先の場合はヘッダだけが解放される）
+ *
+ * @param[in,out] parts  NUM_LAP_PARTITIONS個の区画
+ */
+inline void releaseLapPartitions(LapPartition parts[NUM_LAP_PARTITIONS]) {
+    for (int p = 0; p < NUM_LAP_PARTITIONS; p++) {
+        if (parts[p].mat != NULL) {
+            cvReleaseMat(&parts[p].mat);
+        }
+        parts[p].labels.clear();
+        parts[p].rowIds.clear();
+    }
+}
+
+/**
+ * クエリのキーポイントの特徴ベクトルを区画ごとのCvMatに展開する
+ *
+ * @param[in]  keypoints    クエリのキーポイント
+ * @param[in]  descriptors  クエリの各キーポイントのSURF特徴量
+ * @param[in]  dim          特徴ベクトルの次元数
+ * @param[out] queryMats    区画ごとのクエリの特徴ベクトル（キーポイントがなければNULL、使い終わったら解放）
+ * @param[out] queryIds     queryMatsの各行の元のキーポイント番号
+ */
+inline void splitQueryByLaplacian(CvSeq* keypoints, CvSeq* descriptors, int dim,
+                                  CvMat* queryMats[NUM_LAP_PARTITIONS],
+                                  std::vector<int> queryIds[NUM_LAP_PARTITIONS]) {
+    for (int p = 0; p < NUM_LAP_PARTITIONS; p++) {
+        queryIds[p].clear();
+    }
+    for (int i = 0; i < descriptors->total; i++) {
+        CvSURFPoint* kp = (CvSURFPoint*)cvGetSeqElem(keypoints, i);
+        queryIds[lapPartition(kp->laplacian)].push_back(i);
+    }
+    for (int p = 0; p < NUM_LAP_PARTITIONS; p++) {
+        int rows = (int)queryIds[p].size();
+        queryMats[p] = rows > 0 ? cvCreateMat(rows, dim, CV_32FC1) : NULL;
+        for (int i = 0; i < rows; i++) {
+            float* desc = (float*)cvGetSeqElem(descriptors, queryIds[p][i]);
+            memcpy(queryMats[p]->data.ptr + (size_t)i * queryMats[p]->step, desc, dim * sizeof(float));
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,349 @@
+#ifndef LSH_INDEX_H
+#define LSH_INDEX_H
+
+#include <cv.h>
+#include <vector>
+#include <random>
+#include <cmath>
+#include <cfloat>
+#include <cstring>
+#include <stdint.h>
+#include "simd_nn.h"
+#include "knn.h"
+#include "index_snapshot.h"
+
+/*
+ * 平坦な配列で表したp-stable LSH（Datar et al., E2LSH）
+ *
+ * 各ハッシュ表はnumHashes個のハッシュ関数 h(v) = floor((a・v + b) / w) の組を1つのキーにまとめ、
+ * 2^tableBits個のバケツに振り分ける。バケツはCSR形式（bucketStart[b]〜bucketStart[b + 1]）で
+ * 点の番号を平坦な配列に並べる。射影ベクトル、特徴ベクトル、ハッシュ表がすべて配列なので
+ * スナップショットにそのまま書けて、mmapした領域を直接指すだけで読み込める。
+ *
+ * 探索はクエリと同じバケツの点だけを、距離を計算する点がmaxCandidatesに達するまで調べる。
+ */
+
+const int LSH_INDEX_TYPE = 2;
+const int LSH_CANDIDATES = 100;  // 探索で距離を計算する点の数の上限の既定値
+
+// スナップショットの配列の種類
+enum {
+    LSH_META = 0,          // LSHParams と int32 rows
+    LSH_VECTORS = 1,       // float vectors[rows][dim]
+    LSH_IDS = 2,           // int32 ids[rows]
+    LSH_LABELS = 3,        // int32 labels[rows]（なくてもよい）
+    LSH_PROJECTIONS = 4,   // float projections[numTables * numHashes][dim]
+    LSH_OFFSETS = 5,       // float offsets[numTables * numHashes]
+    LSH_MULTIPLIERS = 6,   // uint32 multipliers[numTables * numHashes]（ハッシュ値をキーにまとめる係数）
+    LSH_BUCKET_START = 7,  // int32 bucketStart[numTables][2^tableBits + 1]
+    LSH_BUCKET_ITEMS = 8   // int32 bucketItems[numTables][rows]
+};
+
+struct LSHParams {
+    int32_t numTables;   // ハッシュ表の数
+    int32_t numHashes;   // 1つのキーにまとめるハッシュ関数の数
+    float bucketWidth;   // 射影を量子化する幅w
+    int32_t tableBits;   // 1つの表のバケツ数の対数
+    uint32_t seed;       // 射影ベクトルの乱数の種
+
+    LSHParams() : numTables(5), numHashes(12), bucketWidth(0.35f), tableBits(16), seed(0) {}
+};
+
+struct LSHMeta {
+    LSHParams params;
+    int32_t rows;
+};
+
+struct LSHIndex {
+    LSHParams params;
+    int dim;
+    int rows;
+    const float* vectors;
+    const int32_t* ids;
+    const int32_t* labels;          // なければNULL
+    const float* projections;
+    const float* offsets;
+    const uint32_t* multipliers;
+    const int32_t* bucketStart;
+    const int32_t* bucketItems;
+
+    // 構築したときの実体（スナップショットから読み込んだときは空でmmap領域を指す）
+    std::vector<float> vectorStore;
+    std::vector<int32_t> idStore;
+    std::vector<int32_t> labelStore;
+    std::vector<float> projectionStore;
+    std::vector<float> offsetStore;
+    std::vector<uint32_t> multiplierStore;
+    std::vector<int32_t> bucketStartStore;
+    std::vector<int32_t> bucketItemStore;
+
+    LSHIndex() : dim(0), rows(0), vectors(NULL), ids(NULL), labels(NULL), projections(NULL), offsets(NULL),
+                 multipliers(NULL), bucketStart(NULL), bucketItems(NULL) {}
+
+private:
+    // ポインタが自分の実体を指すのでコピーしない
+    LSHIndex(const LSHIndex&);
+    LSHIndex& operator=(const LSHIndex&);
+};
+
+/**
+ * 探索の作業領域（スレッドごとに持ち、クエリをまたいで使い回す）
+ */
+struct LSHSearchContext {
+    std::vector<uint32_t> visited;  // 点ごとに最後に距離を計算した探索の番号（別の表で同じ点を見つけたとき用）
+    uint32_t stamp;                 // 今の探索の番号
+    KNearest result;                // 1-NN探索の結果
+
+    LSHSearchContext() : stamp(0) {}
+};
+
+/**
+ * 特徴ベクトルのハッシュ表tでのバケツ番号
+ */
+inline int lshBucket(const LSHIndex& index, int table, const float* vec) {
+    int k = index.params.numHashes;
+    uint32_t key = 0;
+    for (int h = table * k; h < (table + 1) * k; h++) {
+        const float* a = index.projections + (size_t)h * index.dim;
+        float dot = 0.0f;
+        for (int d = 0; d < index.dim; d++) {
+            dot += a[d] * vec[d];
+        }
+        int32_t value = (int32_t)floorf((dot + index.offsets[h]) / index.params.bucketWidth);
+        key += index.multipliers[h] * (uint32_t)value;
+    }
+    return (int)(key >> (32 - index.params.tableBits));
+}
+
+/**
+ * 特徴ベクトルからLSHのインデックスを作る（特徴ベクトルはコピーするのでmatはすぐに解放してよい）
+ *
+ * @param[in]  mat     特徴ベクトルの行列（CV_32FC1、各行が1点）
+ * @param[in]  ids     各行の元の行番号（NULLなら行番号そのもの）
+ * @param[in]  labels  各行の物体ID（NULLなら持たない）
+ * @param[in]  params  パラメータ
+ * @param[out] index   インデックス
+ */
+inline void buildLSH(const CvMat* mat, const int* ids, const int* labels, const LSHParams& params, LSHIndex& index) {
+    int rows = mat != NULL ? mat->rows : 0;
+    int dim = mat != NULL ? mat->cols : 0;
+    index.params = params;
+    index.params.tableBits = std::min(std::max(params.tableBits, 1), 30);
+    index.dim = dim;
+    index.rows = rows;
+
+    // 射影ベクトルは正規分布、オフセットは[0, w)の一様分布（p-stable LSH）
+    int numFuncs = params.numTables * params.numHashes;
+    std::mt19937 rng(params.seed);
+    std::normal_distribution<float> gauss(0.0f, 1.0f);
+    std::uniform_real_distribution<float> uniform(0.0f, params.bucketWidth);
+    index.projectionStore.resize((size_t)numFuncs * dim);
+    index.offsetStore.resize(numFuncs);
+    index.multiplierStore.resize(numFuncs);
+    for (size_t i = 0; i < index.projectionStore.size(); i++) {
+        index.projectionStore[i] = gauss(rng);
+    }
+    for (int h = 0; h < numFuncs; h++) {
+        index.offsetStore[h] = uniform(rng);
+        index.multiplierStore[h] = (uint32_t)rng() | 1u;
+    }
+    index.projections = numFuncs > 0 ? &index.projectionStore[0] : NULL;
+    index.offsets = numFuncs > 0 ? &index.offsetStore[0] : NULL;
+    index.multipliers = numFuncs > 0 ? &index.multiplierStore[0] : NULL;
+
+    index.vectorStore.resize((size_t)rows * dim);
+    index.idStore.resize(rows);
+    index.labelStore.resize(labels != NULL ? rows : 0);
+    for (int i = 0; i < rows; i++) {
+        memcpy(&index.vectorStore[(size_t)i * dim], mat->data.ptr + (size_t)i * mat->step, dim * sizeof(float));
+        index.idStore[i] = ids != NULL ? ids[i] : i;
+        if (labels != NULL) {
+            index.labelStore[i] = labels[i];
+        }
+    }
+    index.vectors = rows > 0 ? &index.vectorStore[0] : NULL;
+    index.ids = rows > 0 ? &index.idStore[0] : NULL;
+    index.labels = labels != NULL && rows > 0 ? &index.labelStore[0] : NULL;
+
+    // 各表で各点のバケツを求め、バケツごとに数えてから詰める
+    int numBuckets = 1 << index.params.tableBits;
+    index.bucketStartStore.assign((size_t)params.numTables * (numBuckets + 1), 0);
+    index.bucketItemStore.resize((size_t)params.numTables * rows);
+    std::vector<int> buckets(rows);
+    for (int t = 0; t < params.numTables; t++) {
+        int32_t* start = &index.bucketStartStore[(size_t)t * (numBuckets + 1)];
+        for (int i = 0; i < rows; i++) {
+            buckets[i] = lshBucket(index, t, index.vectors + (size_t)i * dim);
+            start[buckets[i] + 1]++;
+        }
+        for (int b = 0; b < numBuckets; b++) {
+            start[b + 1] += start[b];
+        }
+        std::vector<int32_t> fill(start, start + numBuckets);
+        int32_t* items = rows > 0 ? &index.bucketItemStore[(size_t)t * rows] : NULL;
+        for (int i = 0; i < rows; i++) {
+            items[fill[buckets[i]]++] = i;
+        }
+    }
+    index.bucketStart = index.bucketStartStore.empty() ? NULL : &index.bucketStartStore[0];
+    index.bucketItems = index.bucketItemStore.empty() ? NULL : &index.bucketItemStore[0];
+}
+
+/**
+ * クエリと同じバケツの点からk-NNを探す
+ *
+ * @param[in]     index          インデックス
+ * @param[in]     query          クエリの特徴ベクトル
+ * @param[in]     maxCandidates  距離を計算する点の数の上限
+ * @param[in,out] context        作業領域（呼び出し側で使い回す）
+ * @param[in,out] result         k-NN（reset()でkを決めておく、点の番号はids[]やlabels[]の添字）
+ */
+inline void searchLSH(const LSHIndex& index, const float* query, int maxCandidates, LSHSearchContext& context,
+                      KNearest& result) {
+    if (index.rows == 0) {
+        return;
+    }
+    if (context.visited.size() < (size_t)index.rows) {
+        context.visited.assign(index.rows, 0);
+        context.stamp = 0;
+    }
+    if (++context.stamp == 0) {
+        std::fill(context.visited.begin(), context.visited.end(), 0);
+        context.stamp = 1;
+    }
+
+    L2BoundedFunc l2 = l2Bounded();
+    int numBuckets = 1 << index.params.tableBits;
+    int checks = 0;
+    for (int t = 0; t < index.params.numTables && checks < maxCandidates; t++) {
+        const int32_t* start = index.bucketStart + (size_t)t * (numBuckets + 1);
+        const int32_t* items = index.bucketItems + (size_t)t * index.rows;
+        int b = lshBucket(index, t, query);
+        for (int j = start[b]; j < start[b + 1] && checks < maxCandidates; j++) {
+            int i = items[j];
+            if (context.visited[i] == context.stamp) {
+                continue;  // 別の表で見つけた点
+            }
+            context.visited[i] = context.stamp;
+            float worst = result.bound();
+            float d = l2(query, index.vectors + (size_t)i * index.dim, index.dim, worst);
+            if (d < worst) {
+                result.push(d, i);
+            }
+            checks++;
+        }
+    }
+}
+
+/**
+ * クエリと同じバケツの点から1-NNを探す
+ *
+ * @param[in]     index          インデックス
+ * @param[in]     query          クエリの特徴ベクトル
+ * @param[in]     maxCandidates  距離を計算する点の数の上限
+ * @param[in,out] context        作業領域（呼び出し側で使い回す）
+ * @param[out]    nnDist         1-NNまでの距離の2乗
+ *
+ * @return 1-NNの点の番号（ids[]やlabels[]の添字）、見つからなければ-1
+ */
+inline int searchLSH(const LSHIndex& index, const float* query, int maxCandidates, LSHSearchContext& context,
+                     float& nnDist) {
+    context.result.reset(1);
+    searchLSH(index, query, maxCandidates, context, context.result);
+    return context.result.nearest(nnDist);
+}
+
+/**
+ * インデックスの大きさ（バイト数）
+ */
+inline size_t lshIndexSize(const LSHIndex& index) {
+    size_t numFuncs = (size_t)index.params.numTables * index.params.numHashes;
+    return (size_t)index.rows * index.dim * sizeof(float) + (size_t)index.rows * sizeof(int32_t) * (index.labels ? 2 : 1) +
+           numFuncs * (index.dim + 2) * sizeof(float) +
+           (size_t)index.params.numTables * (((size_t)1 << index.params.tableBits) + 1 + index.rows) * sizeof(int32_t);
+}
+
+/**
+ * LSHのインデックスをスナップショットに書く配列に加える
+ *
+ * @param[in]     index  インデックス
+ * @param[in]     part   区画番号
+ * @param[in,out] meta   LSH_METAの中身（書き込みが終わるまで保持する）
+ * @param[in,out] blobs  書き込む配列
+ */
+inline void appendLSHBlobs(const LSHIndex& index, int part, LSHMeta& meta, std::vector<SnapshotBlob>& blobs) {
+    size_t numFuncs = (size_t)index.params.numTables * index.params.numHashes;
+    size_t numBuckets = (size_t)1 << index.params.tableBits;
+    meta.params = index.params;
+    meta.rows = index.rows;
+    blobs.push_back(snapshotBlob(part, LSH_META, &meta, sizeof meta));
+    blobs.push_back(snapshotBlob(part, LSH_VECTORS, index.vectors, (size_t)index.rows * index.dim * sizeof(float)));
+    blobs.push_back(snapshotBlob(part, LSH_IDS, index.ids, (size_t)index.rows * sizeof(int32_t)));
+    if (index.labels != NULL) {
+        blobs.push_back(snapshotBlob(part, LSH_LABELS, index.labels, (size_t)index.rows * sizeof(int32_t)));
+    }
+    blobs.push_back(snapshotBlob(part, LSH_PROJECTIONS, index.projections, numFuncs * index.dim * sizeof(float)));
+    blobs.push_back(snapshotBlob(part, LSH_OFFSETS, index.offsets, numFuncs * sizeof(float)));
+    blobs.push_back(snapshotBlob(part, LSH_MULTIPLIERS, index.multipliers, numFuncs * sizeof(uint32_t)));
+    blobs.push_back(snapshotBlob(part, LSH_BUCKET_START, index.bucketStart,
+                                 index.params.numTables * (numBuckets + 1) * sizeof(int32_t)));
+    blobs.push_back(snapshotBlob(part, LSH_BUCKET_ITEMS, index.bucketItems,
+                                 (size_t)index.params.numTables * index.rows * sizeof(int32_t)));
+}
+
+/**
+ * mmapしたスナップショットからLSHのインデックスを読み込む（配列はmmap領域を直接指す）
+ *
+ * @param[in]  snapshot  mmapしたスナップショット（インデックスを使い終わるまで解放しない）
+ * @param[in]  part      区画番号
+ * @param[out] index     インデックス
+ *
+ * @return 成功ならtrue、失敗ならfalse
+ */
+inline bool loadLSH(const IndexSnapshot& snapshot, int part, LSHIndex& index) {
+    size_t size[9];
+    const LSHMeta* meta = (const LSHMeta*)snapshotSection(snapshot, part, LSH_META, size[0]);
+    if (meta == NULL || size[0] != sizeof(LSHMeta) || meta->params.tableBits < 1 || meta->params.tableBits > 30 ||
+        meta->params.numTables < 0 || meta->params.numHashes < 0 || meta->rows < 0) {
+        return false;
+    }
+    index.params = meta->params;
+    index.dim = snapshot.dim;
+    index.rows = meta->rows;
+    index.vectors = (const float*)snapshotSection(snapshot, part, LSH_VECTORS, size[1]);
+    index.ids = (const int32_t*)snapshotSection(snapshot, part, LSH_IDS, size[2]);
+    index.labels = (const int32_t*)snapshotSection(snapshot, part, LSH_LABELS, size[3]);
+    index.projections = (const float*)snapshotSection(snapshot, part, LSH_PROJECTIONS, size[4]);
+    index.offsets = (const float*)snapshotSection(snapshot, part, LSH_OFFSETS, size[5]);
+    index.multipliers = (const uint32_t*)snapshotSection(snapshot, part, LSH_MULTIPLIERS, size[6]);
+    index.bucketStart = (const int32_t*)snapshotSection(snapshot, part, LSH_BUCKET_START, size[7]);
+    index.bucketItems = (const int32_t*)snapshotSection(snapshot, part, LSH_BUCKET_ITEMS, size[8]);
+    if (size[3] != (size_t)index.rows * sizeof(int32_t)) {
+        index.labels = NULL;
+    }
+    size_t numFuncs = (size_t)index.params.numTables * index.params.numHashes;
+    size_t numBuckets = (size_t)1 << index.params.tableBits;
+    if (size[1] != (size_t)index.rows * index.dim * sizeof(float) || size[2] != (size_t)index.rows * sizeof(int32_t) ||
+        size[4] != numFuncs * index.dim * sizeof(float) || size[5] != numFuncs * sizeof(float) ||
+        size[6] != numFuncs * sizeof(uint32_t) ||
+        size[7] != index.params.numTables * (numBuckets + 1) * sizeof(int32_t) ||
+        size[8] != (size_t)index.params.numTables * index.rows * sizeof(int32_t)) {
+        return false;
+    }
+
+    // 探索はバケツの範囲と点の番号をそのまま添字に使うので、範囲が単調でrowsを超えないことを確かめる
+    for (int t = 0; t < index.params.numTables; t++) {
+        const int32_t* start = index.bucketStart + (size_t)t * (numBuckets + 1);
+        if (start[0] < 0 || start[numBuckets] > index.rows) {
+            return false;
+        }
+        for (size_t b = 0; b < numBuckets; b++) {
+            if (start[b] > start[b + 1]) {
+                return false;
+            }
+        }
+    }
+    return snapshotIndicesInRange(index.bucketItems, (size_t)index.params.numTables * index.rows, index.rows);
+}
+
+#endif
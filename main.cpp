@@ -1,8 +1,16 @@
 #include "cv.h"
 #include "highgui.h"
 #include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <fstream>
+#include <vector>
+#include <string>
+#include <atomic>
+#include "options.h"
+#include "thread_pool.h"
+#include "color_histogram.h"
+#include "color_hist_store.h"
 
 using namespace std;
 
@@ -25,32 +33,15 @@ uchar decleaseColor(int value) {
     return 0;  // B
 }
 
-/**
- * IWi摜RGBqXgÕrԍvZ
- * @param[in]  red    Ԃ̋Pxi0-255j
- * @param[in]  green  ΂̋Pxi0-255j
- * @param[in]  blue   ̋Pxi0-255j
- * @return qXgÕrԍi64FJ[CfbNXj
- */
-int rgb2bin(int red, int green, int blue) {
-    int redNo = red / 64;
-    int greenNo = green / 64;
-    int blueNo = blue / 64;
-    return 16 * redNo + 4 * greenNo + blueNo;
-}
-
 /**
  * qXgOvZ
  * @param[in]  filename   摜t@C
+ * @param[in]  q          rԍ̕\ie`l̕j
+ * @param[in]  pool       s̑тɐXbhv[
  * @param[out] histogram  qXgO
  * @return I0AُI-1
  */
-int calcHistogram(char *filename, int histogram[64]) {
-    // qXgO
-    for (int i = 0; i < 64; i++) {
-        histogram[i] = 0;
-    }
-
+int calcHistogram(char *filename, const ColorQuantizer& q, ThreadPool& pool, vector<int>& histogram) {
     // 摜̃[h
     IplImage *img = cvLoadImage(filename, CV_LOAD_IMAGE_COLOR);
     if (img == NULL) {
@@ -58,22 +49,13 @@ int calcHistogram(char *filename, int histogram[64]) {
         return -1;
     }
 
-    // 64FɌFăqXgOvZ
-    for (int y = 0; y < img->height; y++) {
-        // ysڂ̃f[^̐擪|C^擾
-        uchar *pin = (uchar *)(img->imageData + y * img->widthStep);
-        for (int x = 0; x < img->width; x++) {
-            int blue = pin[3*x+0];
-            int green = pin[3*x+1];
-            int red = pin[3*x+2];
-
-            // J[li0-63jJEg
-            int bin = rgb2bin(red, green, blue);
-            histogram[bin] += 1;
-        }
-    }
-
+    // FăqXgOvZirԍ͕\SIMDŋ߁As̑тƂɕɐj
+    bool ok = calcColorHistogram(img, q, pool, histogram);
     cvReleaseImage(&img);
+    if (!ok) {
+        cerr << "unsupported image format: " << filename << endl;
+        return -1;
+    }
 
     return 0;
 }
@@ -84,14 +66,14 @@ int calcHistogram(char *filename, int histogram[64]) {
  * @param[in]  histogram qXgO
  * @return I0AُI-1
  */
-int writeHistogram(char *filename, int histogram[64]) {
+int writeHistogram(char *filename, const vector<int>& histogram) {
     ofstream outFile(filename);
     if (outFile.fail()) {
         cerr << "cannot open file: " << filename << endl;
         return -1;
     }
 
-    for (int i = 0; i < 64; i++) {
+    for (size_t i = 0; i < histogram.size(); i++) {
         outFile << histogram[i] << endl;
     }
 
@@ -101,7 +83,71 @@ int writeHistogram(char *filename, int histogram[64]) {
 }
 
 /**
- * C֐ hist.exe [͉摜t@C] [o̓qXgOt@C]
+ * fBNg}jtFXg̉摜̐FqXgO܂Ƃ߂ČvZA1̃oCit@Cɏ
+ * e[J[̉摜fR[hĂ̂܂ܐ̂ŁA摜̃fR[hƕʂ̉摜̏WvdȂB
+ * 1vZXőS摜AeLXg̃t@C摜ƂɍȂB
+ * @param[in]  input    摜̃fBNg}jtFXg̃t@C
+ * @param[in]  outFile  o̓t@C
+ * @param[in]  q        rԍ̕\
+ * @param[in]  pool     摜ɏXbhv[
+ * @return I0AُI-1
+ */
+int calcHistogramBatch(const char *input, const char *outFile, const ColorQuantizer& q, ThreadPool& pool) {
+    vector<string> paths;
+    if (!listColorHistInputs(input, paths)) {
+        return -1;
+    }
+    int numImages = (int)paths.size();
+    int stride = colorHistStride(q.numBins);
+    vector<int32_t> records((size_t)numImages * stride, 0);
+    vector<char> loaded(numImages, 0);
+
+    atomic<int> next(0);
+    pool.run([&](int worker) {
+        vector<uint32_t> sub(COLOR_HIST_SUBHISTS * q.numBins);
+        int i;
+        while ((i = next++) < numImages) {
+            IplImage *img = cvLoadImage(paths[i].c_str(), CV_LOAD_IMAGE_COLOR);
+            if (img == NULL) {
+                cerr << "cannot open image: " << paths[i] << endl;
+                continue;
+            }
+            fill(sub.begin(), sub.end(), 0);
+            accumulateColorHistogram((const uint8_t *)img->imageData, img->width, 0, img->height, img->widthStep,
+                                     q, &sub[0]);
+            mergeColorHistogram(&sub[0], COLOR_HIST_SUBHISTS, q.numBins, &records[(size_t)i * stride]);
+            loaded[i] = 1;
+            cvReleaseImage(&img);
+        }
+    });
+
+    // [hłȂ摜l߂
+    int numLoaded = 0;
+    for (int i = 0; i < numImages; i++) {
+        if (loaded[i]) {
+            if (numLoaded != i) {
+                paths[numLoaded].swap(paths[i]);
+                copy(&records[(size_t)i * stride], &records[(size_t)(i + 1) * stride],
+                     &records[(size_t)numLoaded * stride]);
+            }
+            numLoaded++;
+        }
+    }
+    paths.resize(numLoaded);
+    records.resize((size_t)numLoaded * stride);
+
+    if (!writeColorHistStore(outFile, q, paths, records)) {
+        return -1;
+    }
+    cout << " (" << numLoaded << " / " << numImages << " images)";
+    return 0;
+}
+
+/**
+ * C֐ hist.exe [͉摜t@C] [o̓qXgOt@C] [-bins ] [-t Xbh]
+ * hist.exe -batch [摜̃fBNg}jtFXg] [o̓t@C] [-bins ] [-t Xbh]
+ * -batch ȂS摜̃qXgOŒ蒷̃R[hɂ1̃oCit@Cɏށicolor_hist_store.hj
+ * -bins Ŋe`l̕wi44x4x4=64FA"8,8,4"̂悤R,G,Bʂɂwłj
  * @param[in]  argc
  * @param[out] argv
  * @return I0AُI-1
@@ -109,19 +155,55 @@ int writeHistogram(char *filename, int histogram[64]) {
 int main(int argc, char **argv) {
     int ret;
 
-    if (argc < 2) {
-        cerr << "usage: hist.exe [image file] [hist file]" << endl;
+    bool batch = argc > 1 && strcmp(argv[1], "-batch") == 0;
+    if (batch) {
+        argc--;
+        argv++;
+    }
+    if (argc < 3) {
+        cerr << "usage: hist.exe [image file] [hist file] [-bins N|R,G,B] [-t N]" << endl;
+        cerr << "       hist.exe -batch [image dir|manifest] [output file] [-bins N|R,G,B] [-t N]" << endl;
         return -1;
     }
 
+    int levels[3] = { COLOR_HIST_LEVELS, COLOR_HIST_LEVELS, COLOR_HIST_LEVELS };
+    const char *bins = stringOption(argc, argv, "-bins", NULL);
+    if (bins != NULL) {
+        int n = sscanf(bins, "%d,%d,%d", &levels[0], &levels[1], &levels[2]);
+        if (n == 1) {
+            levels[1] = levels[2] = levels[0];
+        } else if (n != 3) {
+            levels[0] = 0;
+        }
+    }
+    ColorQuantizer q;
+    if (!initColorQuantizer(levels[0], levels[1], levels[2], q)) {
+        cerr << "invalid number of bins: " << bins << endl;
+        return -1;
+    }
+    ThreadPool pool(parseThreadOption(argc, argv));
+
     char *imageFile = argv[1];
     char *histFile = argv[2];
 
     cout << imageFile << " -> " << histFile;
 
+    if (batch) {
+        double tt = (double)cvGetTickCount();
+        ret = calcHistogramBatch(imageFile, histFile, q, pool);
+        if (ret < 0) {
+            cerr << "cannot calc histograms" << endl;
+            return -1;
+        }
+        tt = (double)cvGetTickCount() - tt;
+        cout << " ... OK" << endl;
+        cout << "Total Time = " << tt / (cvGetTickFrequency() * 1000.0) << "ms" << endl;
+        return 0;
+    }
+
     // qXgOvZ
-    int histogram[64];
-    ret = calcHistogram(imageFile, histogram);
+    vector<int> histogram;
+    ret = calcHistogram(imageFile, q, pool, histogram);
     if (ret < 0) {
         cerr << "cannot calc histogram" << endl;
         return -1;
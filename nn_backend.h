@@ -0,0 +1,730 @@
+#ifndef NN_BACKEND_H
+#define NN_BACKEND_H
+
+#include <cv.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cfloat>
+#include <cstring>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "options.h"
+#include "descdb.h"
+#include "lap_partition.h"
+#include "thread_pool.h"
+#include "simd_nn.h"
+#include "knn.h"
+#include "index_snapshot.h"
+#include "kdtree_index.h"
+#include "lsh_index.h"
+#include "pq_index.h"
+#include "ivf_index.h"
+
+/*
+ * 認識プログラムの最近傍探索のバックエンド
+ *
+ * 全探索、kd-tree、LSH、直積量子化、転置ファイルを同じインタフェースで扱い、実行時に選ぶ。
+ * 認識プログラムの読み込み、照合、投票、バッチとサーバの処理（recognizer.h）は共通なので、
+ * バックエンドを差し替えるだけで同じパイプラインのままインデックスを比べられる。
+ *
+ * バックエンドはラプラシアンの符号の区画ごとに探索し、クエリと同じ符号の点だけを返す。
+ * 探索は異なるチャンクから並列に呼ばれるので、作業領域はスレッドごとに持つ。
+ */
+
+/**
+ * 最近傍探索のバックエンド
+ */
+class NNBackend {
+public:
+    virtual ~NNBackend() {}
+
+    /**
+     * バックエンドの名前（-backendで指定する名前）
+     */
+    virtual const char* name() const = 0;
+
+    /**
+     * スナップショットの種類（スナップショットを持たなければ0）
+     */
+    virtual int snapshotType() const = 0;
+
+    /**
+     * 探索に物体モデルデータベース（元の特徴ベクトル）を使うか
+     * trueならload()の前にデータベースをロードし、バックエンドを使い終わるまで解放しない
+     */
+    virtual bool needsModel() const {
+        return false;
+    }
+
+    /**
+     * 探索で物体モデルデータベースを先頭から読むか（一部の行しか読まないならfalseにして先読みさせない）
+     */
+    virtual bool prefetchModel() const {
+        return true;
+    }
+
+    /**
+     * 物体モデルデータベースからインデックスを作る
+     *
+     * @param[in] model  物体モデルデータベース（needsModel()なら使い終わるまで解放しないこと）
+     * @param[in] pool   学習に使うスレッドプール
+     *
+     * @return 成功ならtrue、失敗ならfalse
+     */
+    virtual bool build(const ModelDB& model, ThreadPool& pool) = 0;
+
+    /**
+     * インデックスをスナップショットに保存する
+     *
+     * @return 成功ならtrue、失敗ならfalse
+     */
+    virtual bool save(const char* filename) const = 0;
+
+    /**
+     * mmapしたスナップショットからインデックスを読み込む（スナップショットは成否によらずバックエンドが閉じる）
+     *
+     * @param[in,out] snapshot  openIndexSnapshot()で開いたスナップショット
+     * @param[in]     dim       特徴ベクトルの次元数
+     * @param[in]     model     物体モデルデータベース（needsModel()でなければNULL）
+     *
+     * @return 成功ならtrue、失敗ならfalse
+     */
+    virtual bool load(IndexSnapshot& snapshot, int dim, const ModelDB* model) = 0;
+
+    /**
+     * 区画pの点からqueriesのbegin〜end行目のk-NNを探す
+     * クエリbegin+jのn番目に近い点を[j * k + n]に書く（足りなければid=-1、label=-1、dist=FLT_MAX）
+     *
+     * @param[in]  part     区画番号（クエリのラプラシアンの符号）
+     * @param[in]  queries  クエリの特徴ベクトル
+     * @param[in]  begin    最初の行
+     * @param[in]  end      最後の行の次
+     * @param[in]  k        近傍の数
+     * @param[out] ids      点の元の行番号（NULLなら書かない）
+     * @param[out] labels   点の物体ID（NULLなら書かない）
+     * @param[out] dists    距離の2乗（NULLなら書かない）
+     */
+    virtual void search(int part, const CvMat* queries, int begin, int end, int k, int* ids, int* labels,
+                        float* dists) const = 0;
+
+    /**
+     * 区画pの点の数
+     */
+    virtual int rows(int part) const = 0;
+
+    /**
+     * インデックスの大きさ（バイト数、参照する物体モデルデータベースを含む）
+     */
+    virtual size_t memoryUsage() const = 0;
+
+    /**
+     * 精度と速度の兼ね合いを決めるパラメータの説明
+     */
+    virtual std::string describe() const = 0;
+
+    /**
+     * 1スレッドが一度に照合するクエリのキーポイント数
+     */
+    virtual int queryChunk() const {
+        return 32;
+    }
+};
+
+/**
+ * k-NNの結果を近い順に出力先へ書く
+ *
+ * @param[in,out] result       探索結果
+ * @param[in]     k            近傍の数
+ * @param[in]     pointIds     インデックスの点の元の行番号
+ * @param[in]     pointLabels  インデックスの点の物体ID（NULLなら-1）
+ * @param[out]    ids          点の元の行番号k個（NULLなら書かない）
+ * @param[out]    labels       点の物体IDk個（NULLなら書かない）
+ * @param[out]    dists        距離の2乗k個（NULLなら書かない）
+ */
+inline void writeKNearest(KNearest& result, int k, const int32_t* pointIds, const int32_t* pointLabels, int* ids,
+                          int* labels, float* dists) {
+    static thread_local std::vector<int> indices;
+    static thread_local std::vector<float> nnDists;
+    indices.resize(k);
+    nnDists.resize(k);
+    result.sorted(&indices[0], &nnDists[0]);
+    for (int n = 0; n < k; n++) {
+        int i = indices[n];
+        if (ids != NULL) {
+            ids[n] = i >= 0 ? pointIds[i] : -1;
+        }
+        if (labels != NULL) {
+            labels[n] = i >= 0 && pointLabels != NULL ? pointLabels[i] : -1;
+        }
+        if (dists != NULL) {
+            dists[n] = nnDists[n];
+        }
+    }
+}
+
+/**
+ * 行列のi行目
+ */
+inline const float* matRow(const CvMat* mat, int i) {
+    return (const float*)(mat->data.ptr + (size_t)i * mat->step);
+}
+
+/**
+ * 全探索
+ * データベースの特徴ベクトルをそのまま探索するのでインデックスを作らない。
+ * バイナリ形式のデータベースはそれ自体がmmapできるので、スナップショットも持たない。
+ */
+class LinearBackend : public NNBackend {
+public:
+    LinearBackend(int argc, char** argv) {}
+
+    ~LinearBackend() {
+        releaseLapPartitions(parts);
+    }
+
+    const char* name() const {
+        return "linear";
+    }
+
+    int snapshotType() const {
+        return 0;
+    }
+
+    bool needsModel() const {
+        return true;
+    }
+
+    bool build(const ModelDB& model, ThreadPool& pool) {
+        // ラプラシアンの符号でデータベースを分割（区画はobjMatを参照する）
+        partitionByLaplacian(model.labels, model.laplacians, model.objMat, parts);
+        return true;
+    }
+
+    bool save(const char* filename) const {
+        std::cerr << "linear backend has no snapshot (use the description database)" << std::endl;
+        return false;
+    }
+
+    bool load(IndexSnapshot& snapshot, int dim, const ModelDB* model) {
+        closeIndexSnapshot(snapshot);
+        return false;
+    }
+
+    void search(int part, const CvMat* queries, int begin, int end, int k, int* ids, int* labels,
+                float* dists) const {
+        const LapPartition& p = parts[part];
+        int n = end - begin;
+        if (p.mat == NULL) {
+            static thread_local KNearest empty;
+            empty.reset(k);
+            for (int j = 0; j < n; j++) {
+                writeKNearest(empty, k, NULL, NULL, ids != NULL ? ids + j * k : NULL,
+                              labels != NULL ? labels + j * k : NULL, dists != NULL ? dists + j * k : NULL);
+            }
+            return;
+        }
+        int dim = p.mat->cols;
+        const int32_t* rowIds = &p.rowIds[0];
+        const int32_t* rowLabels = &p.labels[0];
+        if (k == 1) {
+            // 1-NNはクエリのブロックとデータベースのブロックを組にした全探索でキャッシュを使い回す
+            static thread_local std::vector<int> nnIndex;
+            static thread_local std::vector<float> nnDist;
+            nnIndex.resize(n);
+            nnDist.resize(n);
+            searchNNBlock(matRow(queries, begin), NULL, n, p.mat->data.fl, NULL, p.mat->rows, dim, &nnIndex[0],
+                          &nnDist[0]);
+            for (int j = 0; j < n; j++) {
+                int i = nnIndex[j];
+                if (ids != NULL) {
+                    ids[j] = i >= 0 ? rowIds[i] : -1;
+                }
+                if (labels != NULL) {
+                    labels[j] = i >= 0 ? rowLabels[i] : -1;
+                }
+                if (dists != NULL) {
+                    dists[j] = i >= 0 ? nnDist[j] : FLT_MAX;
+                }
+            }
+            return;
+        }
+        static thread_local KNearest result;
+        L2BoundedFunc l2 = l2Bounded();
+        for (int j = 0; j < n; j++) {
+            const float* query = matRow(queries, begin + j);
+            result.reset(k);
+            for (int i = 0; i < p.mat->rows; i++) {
+                float worst = result.bound();
+                float d = l2(query, matRow(p.mat, i), dim, worst);
+                if (d < worst) {
+                    result.push(d, i);
+                }
+            }
+            writeKNearest(result, k, rowIds, rowLabels, ids != NULL ? ids + j * k : NULL,
+                          labels != NULL ? labels + j * k : NULL, dists != NULL ? dists + j * k : NULL);
+        }
+    }
+
+    int rows(int part) const {
+        return (int)parts[part].rowIds.size();
+    }
+
+    size_t memoryUsage() const {
+        size_t size = 0;
+        for (int p = 0; p < NUM_LAP_PARTITIONS; p++) {
+            if (parts[p].mat != NULL) {
+                size += (size_t)parts[p].mat->rows * parts[p].mat->cols * sizeof(float);
+            }
+            size += parts[p].labels.size() * sizeof(int) + parts[p].rowIds.size() * sizeof(int);
+        }
+        return size;
+    }
+
+    std::string describe() const {
+        const char* simdName;
+        selectL2Bounded(&simdName);
+        return std::string("距離計算の命令セット: ") + simdName;
+    }
+
+    int queryChunk() const {
+        return 16;
+    }
+
+private:
+    LapPartition parts[NUM_LAP_PARTITIONS];
+};
+
+/**
+ * ランダム化kd-tree（-trees 木の数、-checks 探索で距離を計算する点の数の上限）
+ * 特徴ベクトルとラベルをコピーして持つので、作ったらデータベースはいらない
+ */
+class KDTreeBackend : public NNBackend {
+public:
+    KDTreeBackend(int argc, char** argv) {
+        numTrees = intOption(argc, argv, "-trees", KDTREE_TREES);
+        maxChecks = intOption(argc, argv, "-checks", KDTREE_CHECKS);
+    }
+
+    ~KDTreeBackend() {
+        closeIndexSnapshot(snapshot);
+    }
+
+    const char* name() const {
+        return "kdtree";
+    }
+
+    int snapshotType() const {
+        return KDTREE_INDEX_TYPE;
+    }
+
+    bool build(const ModelDB& model, ThreadPool& pool) {
+        LapPartition parts[NUM_LAP_PARTITIONS];
+        partitionByLaplacian(model.labels, model.laplacians, model.objMat, parts);
+        for (int p = 0; p < NUM_LAP_PARTITIONS; p++) {
+            buildKDTree(parts[p].mat, parts[p].rowIds.empty() ? NULL : &parts[p].rowIds[0],
+                        parts[p].labels.empty() ? NULL : &parts[p].labels[0], numTrees, KDTREE_LEAF_SIZE, trees[p]);
+        }
+        releaseLapPartitions(parts);
+        return true;
+    }
+
+    bool save(const char* filename) const {
+        int32_t meta[NUM_LAP_PARTITIONS][3];
+        std::vector<SnapshotBlob> blobs;
+        for (int p = 0; p < NUM_LAP_PARTITIONS; p++) {
+            appendKDTreeBlobs(trees[p], p, meta[p], blobs);
+        }
+        return writeIndexSnapshot(filename, KDTREE_INDEX_TYPE, trees[0].dim, NUM_LAP_PARTITIONS, blobs);
+    }
+
+    bool load(IndexSnapshot& snapshot, int dim, const ModelDB* model) {
+        this->snapshot = snapshot;
+        bool loaded = snapshot.dim == dim && snapshot.numParts == NUM_LAP_PARTITIONS;
+        for (int p = 0; loaded && p < NUM_LAP_PARTITIONS; p++) {
+            loaded = loadKDTree(snapshot, p, trees[p]) && (trees[p].labels != NULL || trees[p].rows == 0);
+        }
+
+        // 区画はすべての行を分け合うので、元の行番号は区画の行数の合計より小さい
+        int64_t totalRows = 0;
+        for (int p = 0; loaded && p < NUM_LAP_PARTITIONS; p++) {
+            totalRows += trees[p].rows;
+        }
+        for (int p = 0; loaded && p < NUM_LAP_PARTITIONS; p++) {
+            loaded = snapshotIndicesInRange(trees[p].ids, trees[p].rows, totalRows);
+        }
+        if (!loaded) {
+            closeIndexSnapshot(this->snapshot);
+        }
+        return loaded;
+    }
+
+    void search(int part, const CvMat* queries, int begin, int end, int k, int* ids, int* labels,
+                float* dists) const {
+        static thread_local KDSearchContext context;  // スレッドごとに使い回す
+        const KDTreeIndex& index = trees[part];
+        for (int j = 0; j < end - begin; j++) {
+            context.result.reset(k);
+            searchKDTree(index, matRow(queries, begin + j), maxChecks, context, context.result);
+            writeKNearest(context.result, k, index.ids, index.labels, ids != NULL ? ids + j * k : NULL,
+                          labels != NULL ? labels + j * k : NULL, dists != NULL ? dists + j * k : NULL);
+        }
+    }
+
+    int rows(int part) const {
+        return trees[part].rows;
+    }
+
+    size_t memoryUsage() const {
+        return kdTreeIndexSize(trees[0]) + kdTreeIndexSize(trees[1]);
+    }
+
+    std::string describe() const {
+        std::ostringstream ss;
+        ss << "kd-treeの木の数: " << trees[0].numTrees << ", 探索する点の数: " << maxChecks;
+        return ss.str();
+    }
+
+private:
+    int numTrees;
+    int maxChecks;
+    KDTreeIndex trees[NUM_LAP_PARTITIONS];
+    IndexSnapshot snapshot;
+};
+
+/**
+ * LSH（-candidates 探索で距離を計算する点の数の上限）
+ * 特徴ベクトルとラベルをコピーして持つので、作ったらデータベースはいらない
+ */
+class LSHBackend : public NNBackend {
+public:
+    LSHBackend(int argc, char** argv) {
+        maxCandidates = intOption(argc, argv, "-candidates", LSH_CANDIDATES);
+    }
+
+    ~LSHBackend() {
+        closeIndexSnapshot(snapshot);
+    }
+
+    const char* name() const {
+        return "lsh";
+    }
+
+    int snapshotType() const {
+        return LSH_INDEX_TYPE;
+    }
+
+    bool build(const ModelDB& model, ThreadPool& pool) {
+        LapPartition parts[NUM_LAP_PARTITIONS];
+        partitionByLaplacian(model.labels, model.laplacians, model.objMat, parts);
+        for (int p = 0; p < NUM_LAP_PARTITIONS; p++) {
+            buildLSH(parts[p].mat, parts[p].rowIds.empty() ? NULL : &parts[p].rowIds[0],
+                     parts[p].labels.empty() ? NULL : &parts[p].labels[0], LSHParams(), lsh[p]);
+        }
+        releaseLapPartitions(parts);
+        return true;
+    }
+
+    bool save(const char* filename) const {
+        LSHMeta meta[NUM_LAP_PARTITIONS];
+        std::vector<SnapshotBlob> blobs;
+        for (int p = 0; p < NUM_LAP_PARTITIONS; p++) {
+            appendLSHBlobs(lsh[p], p, meta[p], blobs);
+        }
+        return writeIndexSnapshot(filename, LSH_INDEX_TYPE, lsh[0].dim, NUM_LAP_PARTITIONS, blobs);
+    }
+
+    bool load(IndexSnapshot& snapshot, int dim, const ModelDB* model) {
+        this->snapshot = snapshot;
+        bool loaded = snapshot.dim == dim && snapshot.numParts == NUM_LAP_PARTITIONS;
+        for (int p = 0; loaded && p < NUM_LAP_PARTITIONS; p++) {
+            loaded = loadLSH(snapshot, p, lsh[p]) && (lsh[p].labels != NULL || lsh[p].rows == 0);
+        }
+
+        // 区画はすべての行を分け合うので、元の行番号は区画の行数の合計より小さい
+        int64_t totalRows = 0;
+        for (int p = 0; loaded && p < NUM_LAP_PARTITIONS; p++) {
+            totalRows += lsh[p].rows;
+        }
+        for (int p = 0; loaded && p < NUM_LAP_PARTITIONS; p++) {
+            loaded = snapshotIndicesInRange(lsh[p].ids, lsh[p].rows, totalRows);
+        }
+        if (!loaded) {
+            closeIndexSnapshot(this->snapshot);
+        }
+        return loaded;
+    }
+
+    void search(int part, const CvMat* queries, int begin, int end, int k, int* ids, int* labels,
+                float* dists) const {
+        static thread_local LSHSearchContext context;  // スレッドごとに使い回す
+        const LSHIndex& index = lsh[part];
+        for (int j = 0; j < end - begin; j++) {
+            context.result.reset(k);
+            searchLSH(index, matRow(queries, begin + j), maxCandidates, context, context.result);
+            writeKNearest(context.result, k, index.ids, index.labels, ids != NULL ? ids + j * k : NULL,
+                          labels != NULL ? labels + j * k : NULL, dists != NULL ? dists + j * k : NULL);
+        }
+    }
+
+    int rows(int part) const {
+        return lsh[part].rows;
+    }
+
+    size_t memoryUsage() const {
+        return lshIndexSize(lsh[0]) + lshIndexSize(lsh[1]);
+    }
+
+    std::string describe() const {
+        std::ostringstream ss;
+        ss << "LSHの表の数: " << lsh[0].params.numTables << ", 探索する点の数: " << maxCandidates;
+        return ss.str();
+    }
+
+private:
+    int maxCandidates;
+    LSHIndex lsh[NUM_LAP_PARTITIONS];
+    IndexSnapshot snapshot;
+};
+
+/**
+ * 直積量子化で圧縮したデータベースの非対称距離による全探索
+ * （-m 部分空間の数、-rerank 元の特徴ベクトルと並べ直す候補の数）
+ * 元の特徴ベクトルは並べ直す候補を引くときだけ参照するので、mmapしたデータベースはほとんど読まれない
+ */
+class PQBackend : public NNBackend {
+public:
+    PQBackend(int argc, char** argv) : fullMat(NULL), modelSize(0) {
+        numSubspaces = intOption(argc, argv, "-m", PQ_SUBSPACES);
+        rerank = intOption(argc, argv, "-rerank", PQ_RERANK);
+    }
+
+    ~PQBackend() {
+        closeIndexSnapshot(snapshot);
+    }
+
+    const char* name() const {
+        return "pq";
+    }
+
+    int snapshotType() const {
+        return PQ_INDEX_TYPE;
+    }
+
+    bool needsModel() const {
+        return rerank > 1;
+    }
+
+    bool prefetchModel() const {
+        return false;
+    }
+
+    bool build(const ModelDB& model, ThreadPool& pool) {
+        LapPartition parts[NUM_LAP_PARTITIONS];
+        partitionByLaplacian(model.labels, model.laplacians, model.objMat, parts);
+        bool ok = true;
+        for (int p = 0; ok && p < NUM_LAP_PARTITIONS; p++) {
+            ok = buildPQ(parts[p].mat, parts[p].rowIds.empty() ? NULL : &parts[p].rowIds[0],
+                         parts[p].labels.empty() ? NULL : &parts[p].labels[0], numSubspaces, pool, pq[p]);
+        }
+        releaseLapPartitions(parts);
+        attachModel(&model);
+        return ok;
+    }
+
+    bool save(const char* filename) const {
+        int32_t meta[NUM_LAP_PARTITIONS][3];
+        std::vector<SnapshotBlob> blobs;
+        for (int p = 0; p < NUM_LAP_PARTITIONS; p++) {
+            appendPQBlobs(pq[p], p, meta[p], blobs);
+        }
+        return writeIndexSnapshot(filename, PQ_INDEX_TYPE, pq[0].dim, NUM_LAP_PARTITIONS, blobs);
+    }
+
+    bool load(IndexSnapshot& snapshot, int dim, const ModelDB* model) {
+        this->snapshot = snapshot;
+        bool loaded = snapshot.dim == dim && snapshot.numParts == NUM_LAP_PARTITIONS;
+        for (int p = 0; loaded && p < NUM_LAP_PARTITIONS; p++) {
+            loaded = loadPQ(snapshot, p, pq[p]) && (pq[p].labels != NULL || pq[p].rows == 0);
+        }
+        // 並べ直すときはidsで元の特徴ベクトルを引くので同じデータベースから作ったものでなければならない
+        if (loaded && model != NULL) {
+            loaded = pq[0].rows + pq[1].rows == model->objMat->rows;
+        }
+        int64_t totalRows = (int64_t)pq[0].rows + pq[1].rows;
+        for (int p = 0; loaded && p < NUM_LAP_PARTITIONS; p++) {
+            loaded = snapshotIndicesInRange(pq[p].ids, pq[p].rows, totalRows);
+        }
+        if (!loaded) {
+            closeIndexSnapshot(this->snapshot);
+            return false;
+        }
+        attachModel(model);
+        return true;
+    }
+
+    void search(int part, const CvMat* queries, int begin, int end, int k, int* ids, int* labels,
+                float* dists) const {
+        static thread_local PQSearchContext context;  // スレッドごとに使い回す
+        const PQIndex& index = pq[part];
+        for (int j = 0; j < end - begin; j++) {
+            context.result.reset(k);
+            searchPQ(index, matRow(queries, begin + j), fullMat, rerank, context, context.result);
+            writeKNearest(context.result, k, index.ids, index.labels, ids != NULL ? ids + j * k : NULL,
+                          labels != NULL ? labels + j * k : NULL, dists != NULL ? dists + j * k : NULL);
+        }
+    }
+
+    int rows(int part) const {
+        return pq[part].rows;
+    }
+
+    size_t memoryUsage() const {
+        return pqIndexSize(pq[0]) + pqIndexSize(pq[1]) + modelSize;
+    }
+
+    std::string describe() const {
+        std::ostringstream ss;
+        ss << "直積量子化: " << pq[0].numSubspaces << "バイト/キーポイント, " << pqIndexSize(pq[0]) + pqIndexSize(pq[1])
+           << "バイト, 並べ直す候補: " << (fullMat != NULL ? rerank : 0);
+        return ss.str();
+    }
+
+private:
+    /**
+     * 並べ直しに使う元の特徴ベクトルを覚え、データベースはランダムに読まれることを伝える
+     */
+    void attachModel(const ModelDB* model) {
+        if (model == NULL || rerank <= 1) {
+            return;
+        }
+        fullMat = model->objMat;
+        modelSize = (size_t)fullMat->rows * fullMat->cols * sizeof(float);
+        if (model->db.addr != NULL) {
+            madvise(model->db.addr, model->db.length, MADV_RANDOM);
+        }
+    }
+
+    int numSubspaces;
+    int rerank;
+    const CvMat* fullMat;  // 元の特徴ベクトル（並べ直さなければNULL）
+    size_t modelSize;
+    PQIndex pq[NUM_LAP_PARTITIONS];
+    IndexSnapshot snapshot;
+};
+
+/**
+ * 転置ファイル（-cells セル数、-nprobe 調べるセル数）
+ * 区画に分けず、セルの中をラプラシアンの符号ごとに並べた1つのインデックスにする
+ * 特徴ベクトルとラベルをコピーして持つので、作ったらデータベースはいらない
+ */
+class IVFBackend : public NNBackend {
+public:
+    IVFBackend(int argc, char** argv) {
+        numCells = intOption(argc, argv, "-cells", IVF_CELLS);
+        nprobe = intOption(argc, argv, "-nprobe", IVF_NPROBE);
+    }
+
+    ~IVFBackend() {
+        closeIndexSnapshot(snapshot);
+    }
+
+    const char* name() const {
+        return "ivf";
+    }
+
+    int snapshotType() const {
+        return IVF_INDEX_TYPE;
+    }
+
+    bool build(const ModelDB& model, ThreadPool& pool) {
+        std::vector<int> groups(model.laplacians.size());
+        for (size_t i = 0; i < model.laplacians.size(); i++) {
+            groups[i] = lapPartition(model.laplacians[i]);
+        }
+        return buildIVF(model.objMat, groups.empty() ? NULL : &groups[0], NUM_LAP_PARTITIONS,
+                        model.labels.empty() ? NULL : &model.labels[0], numCells, pool, ivf);
+    }
+
+    bool save(const char* filename) const {
+        int32_t meta[3];
+        std::vector<SnapshotBlob> blobs;
+        appendIVFBlobs(ivf, 0, meta, blobs);
+        return writeIndexSnapshot(filename, IVF_INDEX_TYPE, ivf.dim, 1, blobs);
+    }
+
+    bool load(IndexSnapshot& snapshot, int dim, const ModelDB* model) {
+        this->snapshot = snapshot;
+        bool loaded = snapshot.dim == dim && loadIVF(snapshot, 0, ivf) && ivf.numGroups == NUM_LAP_PARTITIONS &&
+                      (ivf.labels != NULL || ivf.rows == 0);
+        if (!loaded) {
+            closeIndexSnapshot(this->snapshot);
+        }
+        return loaded;
+    }
+
+    void search(int part, const CvMat* queries, int begin, int end, int k, int* ids, int* labels,
+                float* dists) const {
+        static thread_local IVFSearchContext context;  // スレッドごとに使い回す
+        for (int j = 0; j < end - begin; j++) {
+            context.result.reset(k);
+            searchIVF(ivf, matRow(queries, begin + j), part, nprobe, context, context.result);
+            writeKNearest(context.result, k, ivf.ids, ivf.labels, ids != NULL ? ids + j * k : NULL,
+                          labels != NULL ? labels + j * k : NULL, dists != NULL ? dists + j * k : NULL);
+        }
+    }
+
+    int rows(int part) const {
+        int n = 0;
+        for (int c = 0; c < ivf.numCells; c++) {
+            int list = c * ivf.numGroups + part;
+            n += ivf.cellStart[list + 1] - ivf.cellStart[list];
+        }
+        return n;
+    }
+
+    size_t memoryUsage() const {
+        return ivfIndexSize(ivf);
+    }
+
+    std::string describe() const {
+        std::ostringstream ss;
+        ss << "転置ファイルのセル数: " << ivf.numCells << ", 調べるセル数: " << nprobe;
+        return ss.str();
+    }
+
+private:
+    int numCells;
+    int nprobe;
+    IVFIndex ivf;
+    IndexSnapshot snapshot;
+};
+
+const char* const NN_BACKEND_NAMES = "linear|kdtree|lsh|pq|ivf";
+
+/**
+ * 名前でバックエンドを作る（パラメータはコマンドライン引数から読む）
+ *
+ * @param[in] name  バックエンドの名前（NN_BACKEND_NAMESのどれか）
+ * @param[in] argc
+ * @param[in] argv
+ *
+ * @return バックエンド（使い終わったらdeleteする）、名前が違えばNULL
+ */
+inline NNBackend* createNNBackend(const std::string& name, int argc, char** argv) {
+    if (name == "linear") {
+        return new LinearBackend(argc, argv);
+    } else if (name == "kdtree") {
+        return new KDTreeBackend(argc, argv);
+    } else if (name == "lsh") {
+        return new LSHBackend(argc, argv);
+    } else if (name == "pq") {
+        return new PQBackend(argc, argv);
+    } else if (name == "ivf") {
+        return new IVFBackend(argc, argv);
+    }
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <cstdlib>
+#include <cstring>
+
+/*
+ * コマンドライン引数の簡易パーサ（"-k 1000" のような名前と値の組）
+ */
+
+/**
+ * コマンドライン引数から name の次の文字列を返す
+ *
+ * @param[in] argc
+ * @param[in] argv
+ * @param[in] name          オプション名（"-k"など）
+ * @param[in] defaultValue  指定がないときの値
+ *
+ * @return 指定された値
+ */
+inline const char* stringOption(int argc, char** argv, const char* name, const char* defaultValue) {
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], name) == 0) {
+            return argv[i + 1];
+        }
+    }
+    return defaultValue;
+}
+
+inline int intOption(int argc, char** argv, const char* name, int defaultValue) {
+    const char* value = stringOption(argc, argv, name, NULL);
+    return value != NULL ? atoi(value) : defaultValue;
+}
+
+inline double doubleOption(int argc, char** argv, const char* name, double defaultValue) {
+    const char* value = stringOption(argc, argv, name, NULL);
+    return value != NULL ? atof(value) : defaultValue;
+}
+
+/**
+ * 値を取らないオプション（"-v"など）が指定されているか
+ */
+inline bool hasOption(int argc, char** argv, const char* name) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif
@@ -0,0 +1,344 @@
+#ifndef PQ_INDEX_H
+#define PQ_INDEX_H
+
+#include <cv.h>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cfloat>
+#include <cstring>
+#include <stdint.h>
+#include "simd_nn.h"
+#include "thread_pool.h"
+#include "kmeans.h"
+#include "index_snapshot.h"
+#include "knn.h"
+
+/*
+ * 直積量子化（Product Quantization、Jégou et al.）で圧縮した物体モデルデータベース
+ *
+ * 特徴ベクトルをnumSubspaces個の部分ベクトルに分け、部分空間ごとにk-meansで学習した
+ * 最大256個のセントロイドの番号（1バイト）で表す。128次元のfloat（512バイト）が
+ * numSubspacesバイト（8か16）になる。
+ *
+ * 探索は非対称距離（ADC）で、クエリごとに「部分空間s、セントロイドc」までの距離の表を作り、
+ * 各点の距離を符号で表を引いた和で求めて全探索する。量子化誤差があるので、
+ * 上位rerank個の候補だけを元の特徴ベクトル（mmapしたデータベース）との距離で並べ直す。
+ */
+
+const int PQ_INDEX_TYPE = 3;
+const int PQ_SUBSPACES = 16;     // 部分空間の数の既定値（= 1点の符号のバイト数）
+const int PQ_CENTROIDS = 256;    // 部分空間ごとのセントロイドの最大数（符号が1バイトに収まる）
+const int PQ_TRAIN_SAMPLES = 65536;  // コードブックの学習に使う最大サンプル数
+const int PQ_RERANK = 32;       // 元の特徴ベクトルと並べ直す候補の数の既定値
+
+// スナップショットの配列の種類
+enum {
+    PQ_META = 0,       // int32 { rows, numSubspaces, numCentroids }
+    PQ_CODEBOOKS = 1,  // float codebooks[numSubspaces][numCentroids][dim / numSubspaces]
+    PQ_CODES = 2,      // uint8 codes[rows][numSubspaces]
+    PQ_IDS = 3,        // int32 ids[rows]（元の行番号、並べ直しで元の特徴ベクトルを引く）
+    PQ_LABELS = 4      // int32 labels[rows]（物体ID、なくてもよい）
+};
+
+struct PQIndex {
+    int dim;
+    int rows;
+    int numSubspaces;
+    int subDim;              // 部分ベクトルの次元数
+    int numCentroids;
+    const float* codebooks;
+    const uint8_t* codes;
+    const int32_t* ids;
+    const int32_t* labels;   // なければNULL
+
+    // 構築したときの実体（スナップショットから読み込んだときは空でmmap領域を指す）
+    std::vector<float> codebookStore;
+    std::vector<uint8_t> codeStore;
+    std::vector<int32_t> idStore;
+    std::vector<int32_t> labelStore;
+
+    PQIndex() : dim(0), rows(0), numSubspaces(0), subDim(0), numCentroids(0), codebooks(NULL), codes(NULL),
+                ids(NULL), labels(NULL) {}
+
+private:
+    // ポインタが自分の実体を指すのでコピーしない
+    PQIndex(const PQIndex&);
+    PQIndex& operator=(const PQIndex&);
+};
+
+/**
+ * 探索の作業領域（スレッドごとに持ち、クエリをまたいで使い回す）
+ */
+struct PQSearchContext {
+    std::vector<float> table;                       // 距離の表 [numSubspaces][numCentroids]
+    KNearest candidates;                            // 並べ直す候補
+    KNearest result;                                // 1-NN探索の結果
+};
+
+/**
+ * 特徴ベクトルを直積量子化する（コードブックを学習して全点を符号化する）
+ *
+ * @param[in]  mat           特徴ベクトルの行列（CV_32FC1、各行が1点）
+ * @param[in]  ids           各行の元の行番号（NULLなら行番号そのもの）
+ * @param[in]  labels        各行の物体ID（NULLなら持たない）
+ * @param[in]  numSubspaces  部分空間の数（次元数を割り切ること）
+ * @param[in]  pool          スレッドプール（k-meansと符号化に使う）
+ * @param[out] index         直積量子化したデータベース
+ *
+ * @return 成功ならtrue、失敗ならfalse
+ */
+inline bool buildPQ(const CvMat* mat, const int* ids, const int* labels, int numSubspaces, ThreadPool& pool,
+                    PQIndex& index) {
+    int rows = mat != NULL ? mat->rows : 0;
+    int dim = mat != NULL ? mat->cols : 0;
+    if (numSubspaces <= 0 || (dim > 0 && dim % numSubspaces != 0)) {
+        std::cerr << "invalid number of subspaces: " << numSubspaces << std::endl;
+        return false;
+    }
+    int subDim = dim / numSubspaces;
+    int numCentroids = std::min(PQ_CENTROIDS, rows);
+
+    index.codebookStore.assign((size_t)numSubspaces * numCentroids * subDim, 0.0f);
+    index.codeStore.resize((size_t)rows * numSubspaces);
+    index.idStore.resize(rows);
+    index.labelStore.resize(labels != NULL ? rows : 0);
+    for (int i = 0; i < rows; i++) {
+        index.idStore[i] = ids != NULL ? ids[i] : i;
+        if (labels != NULL) {
+            index.labelStore[i] = labels[i];
+        }
+    }
+
+    // 部分空間ごとに部分ベクトルを取り出し、k-meansでコードブックを作って各点を一番近いセントロイドで表す
+    KMeansParams params;
+    params.k = numCentroids;
+    params.maxIter = 15;
+    params.maxSamples = PQ_TRAIN_SAMPLES;
+    params.verbose = false;
+    CvMat* sub = rows > 0 ? cvCreateMat(rows, subDim, CV_32FC1) : NULL;
+    CvMat* centroids = rows > 0 ? cvCreateMat(numCentroids, subDim, CV_32FC1) : NULL;
+    std::vector<int> assign(rows);
+    std::vector<float> dists(rows);
+    bool ok = true;
+    for (int s = 0; s < numSubspaces && rows > 0; s++) {
+        for (int i = 0; i < rows; i++) {
+            memcpy(sub->data.ptr + (size_t)i * sub->step,
+                   mat->data.ptr + (size_t)i * mat->step + (size_t)s * subDim * sizeof(float), subDim * sizeof(float));
+        }
+        params.seed = s;
+        if (!trainKMeans(sub, params, pool, centroids)) {
+            ok = false;
+            break;
+        }
+        float* codebook = &index.codebookStore[(size_t)s * numCentroids * subDim];
+        for (int c = 0; c < numCentroids; c++) {
+            memcpy(codebook + (size_t)c * subDim, centroids->data.ptr + (size_t)c * centroids->step,
+                   subDim * sizeof(float));
+        }
+        assignNearest(sub->data.fl, rows, codebook, numCentroids, subDim, &assign[0], &dists[0], pool);
+        for (int i = 0; i < rows; i++) {
+            index.codeStore[(size_t)i * numSubspaces + s] = (uint8_t)assign[i];
+        }
+    }
+    if (sub != NULL) {
+        cvReleaseMat(&sub);
+        cvReleaseMat(&centroids);
+    }
+
+    index.dim = dim;
+    index.rows = rows;
+    index.numSubspaces = numSubspaces;
+    index.subDim = subDim;
+    index.numCentroids = numCentroids;
+    index.codebooks = index.codebookStore.empty() ? NULL : &index.codebookStore[0];
+    index.codes = rows > 0 ? &index.codeStore[0] : NULL;
+    index.ids = rows > 0 ? &index.idStore[0] : NULL;
+    index.labels = labels != NULL && rows > 0 ? &index.labelStore[0] : NULL;
+    return ok;
+}
+
+/**
+ * クエリから各部分空間の各セントロイドまでの二乗距離の表を作る
+ *
+ * @param[in]  index  直積量子化したデータベース
+ * @param[in]  query  クエリの特徴ベクトル
+ * @param[out] table  距離の表 [numSubspaces][numCentroids]
+ */
+inline void computePQTable(const PQIndex& index, const float* query, float* table) {
+    for (int s = 0; s < index.numSubspaces; s++) {
+        const float* q = query + (size_t)s * index.subDim;
+        const float* codebook = index.codebooks + (size_t)s * index.numCentroids * index.subDim;
+        for (int c = 0; c < index.numCentroids; c++) {
+            const float* centroid = codebook + (size_t)c * index.subDim;
+            float d = 0.0f;
+            for (int j = 0; j < index.subDim; j++) {
+                float diff = q[j] - centroid[j];
+                d += diff * diff;
+            }
+            table[s * index.numCentroids + c] = d;
+        }
+    }
+}
+
+/**
+ * 1点の符号から表を引いて非対称距離を求める
+ */
+inline float pqDistance(const float* table, const uint8_t* code, int numSubspaces, int numCentroids) {
+    float d0 = 0.0f, d1 = 0.0f;
+    int s = 0;
+    for (; s + 2 <= numSubspaces; s += 2) {
+        d0 += table[s * numCentroids + code[s]];
+        d1 += table[(s + 1) * numCentroids + code[s + 1]];
+    }
+    if (s < numSubspaces) {
+        d0 += table[s * numCentroids + code[s]];
+    }
+    return d0 + d1;
+}
+
+/**
+ * 非対称距離の全探索でk-NNを探す（上位rerank個を元の特徴ベクトルで並べ直す）
+ *
+ * @param[in]     index    直積量子化したデータベース
+ * @param[in]     query    クエリの特徴ベクトル
+ * @param[in]     fullMat  元の特徴ベクトル（ids[]の行番号で引く、NULLなら並べ直さない）
+ * @param[in]     rerank   並べ直す候補の数（1以下なら並べ直さない、kより少なければkにする）
+ * @param[in,out] context  作業領域（呼び出し側で使い回す）
+ * @param[in,out] result   k-NN（reset()でkを決めておく、点の番号はids[]やlabels[]の添字、
+ *                         距離は並べ直さなければ非対称距離）
+ */
+inline void searchPQ(const PQIndex& index, const float* query, const CvMat* fullMat, int rerank,
+                     PQSearchContext& context, KNearest& result) {
+    if (index.rows == 0) {
+        return;
+    }
+    context.table.resize((size_t)index.numSubspaces * index.numCentroids);
+    float* table = &context.table[0];
+    computePQTable(index, query, table);
+
+    int m = index.numSubspaces;
+    int k = index.numCentroids;
+    const uint8_t* code = index.codes;
+    bool rerankFull = fullMat != NULL && rerank > 1;
+    KNearest& candidates = rerankFull ? context.candidates : result;
+    if (rerankFull) {
+        candidates.reset(std::max(rerank, result.capacity()));
+    }
+
+    // 非対称距離で上位の候補を残す
+    for (int i = 0; i < index.rows; i++, code += m) {
+        float d = pqDistance(table, code, m, k);
+        if (d < candidates.bound()) {
+            candidates.push(d, i);
+        }
+    }
+    if (!rerankFull) {
+        return;
+    }
+
+    // 候補を元の特徴ベクトルとの距離で並べ直す
+    L2BoundedFunc l2 = l2Bounded();
+    for (int c = 0; c < candidates.size(); c++) {
+        int i = candidates.at(c);
+        const float* vec = (const float*)(fullMat->data.ptr + (size_t)index.ids[i] * fullMat->step);
+        float worst = result.bound();
+        float d = l2(query, vec, index.dim, worst);
+        if (d < worst) {
+            result.push(d, i);
+        }
+    }
+}
+
+/**
+ * 非対称距離の全探索で1-NNを探す（上位rerank個を元の特徴ベクトルで並べ直す）
+ *
+ * @param[in]     index    直積量子化したデータベース
+ * @param[in]     query    クエリの特徴ベクトル
+ * @param[in]     fullMat  元の特徴ベクトル（ids[]の行番号で引く、NULLなら並べ直さない）
+ * @param[in]     rerank   並べ直す候補の数（1以下なら並べ直さない）
+ * @param[in,out] context  作業領域（呼び出し側で使い回す）
+ * @param[out]    nnDist   1-NNまでの二乗距離（並べ直さなければ非対称距離）
+ *
+ * @return 1-NNの点の番号（ids[]やlabels[]の添字）、見つからなければ-1
+ */
+inline int searchPQ(const PQIndex& index, const float* query, const CvMat* fullMat, int rerank,
+                    PQSearchContext& context, float& nnDist) {
+    context.result.reset(1);
+    searchPQ(index, query, fullMat, rerank, context, context.result);
+    return context.result.nearest(nnDist);
+}
+
+/**
+ * 直積量子化したデータベースの大きさ（バイト数）
+ */
+inline size_t pqIndexSize(const PQIndex& index) {
+    return (size_t)index.rows * index.numSubspaces + (size_t)index.rows * sizeof(int32_t) * (index.labels ? 2 : 1) +
+           (size_t)index.numSubspaces * index.numCentroids * index.subDim * sizeof(float);
+}
+
+/**
+ * 直積量子化したデータベースをスナップショットに書く配列に加える
+ *
+ * @param[in]     index  直積量子化したデータベース
+ * @param[in]     part   区画番号
+ * @param[in,out] meta   PQ_METAの中身（書き込みが終わるまで保持する）
+ * @param[in,out] blobs  書き込む配列
+ */
+inline void appendPQBlobs(const PQIndex& index, int part, int32_t meta[3], std::vector<SnapshotBlob>& blobs) {
+    meta[0] = index.rows;
+    meta[1] = index.numSubspaces;
+    meta[2] = index.numCentroids;
+    blobs.push_back(snapshotBlob(part, PQ_META, meta, 3 * sizeof(int32_t)));
+    blobs.push_back(snapshotBlob(part, PQ_CODEBOOKS, index.codebooks,
+                                 (size_t)index.numSubspaces * index.numCentroids * index.subDim * sizeof(float)));
+    blobs.push_back(snapshotBlob(part, PQ_CODES, index.codes, (size_t)index.rows * index.numSubspaces));
+    blobs.push_back(snapshotBlob(part, PQ_IDS, index.ids, (size_t)index.rows * sizeof(int32_t)));
+    if (index.labels != NULL) {
+        blobs.push_back(snapshotBlob(part, PQ_LABELS, index.labels, (size_t)index.rows * sizeof(int32_t)));
+    }
+}
+
+/**
+ * mmapしたスナップショットから直積量子化したデータベースを読み込む（配列はmmap領域を直接指す）
+ *
+ * @param[in]  snapshot  mmapしたスナップショット（使い終わるまで解放しない）
+ * @param[in]  part      区画番号
+ * @param[out] index     直積量子化したデータベース
+ *
+ * @return 成功ならtrue、失敗ならfalse
+ */
+inline bool loadPQ(const IndexSnapshot& snapshot, int part, PQIndex& index) {
+    size_t metaSize, codebookSize, codeSize, idSize, labelSize;
+    const int32_t* meta = (const int32_t*)snapshotSection(snapshot, part, PQ_META, metaSize);
+    if (meta == NULL || metaSize != 3 * sizeof(int32_t) || meta[1] <= 0 || snapshot.dim % meta[1] != 0 ||
+        meta[2] < 0 || meta[2] > PQ_CENTROIDS) {
+        return false;
+    }
+    index.dim = snapshot.dim;
+    index.rows = meta[0];
+    index.numSubspaces = meta[1];
+    index.subDim = snapshot.dim / meta[1];
+    index.numCentroids = meta[2];
+    index.codebooks = (const float*)snapshotSection(snapshot, part, PQ_CODEBOOKS, codebookSize);
+    index.codes = (const uint8_t*)snapshotSection(snapshot, part, PQ_CODES, codeSize);
+    index.ids = (const int32_t*)snapshotSection(snapshot, part, PQ_IDS, idSize);
+    index.labels = (const int32_t*)snapshotSection(snapshot, part, PQ_LABELS, labelSize);
+    if (labelSize != (size_t)index.rows * sizeof(int32_t)) {
+        index.labels = NULL;
+    }
+    if (index.rows < 0 || codebookSize != (size_t)index.numSubspaces * index.numCentroids * index.subDim * sizeof(float) ||
+        codeSize != (size_t)index.rows * index.numSubspaces || idSize != (size_t)index.rows * sizeof(int32_t)) {
+        return false;
+    }
+
+    // 符号は距離の表の添字に使うのでセントロイドの数より小さくなければならない
+    for (size_t i = 0; i < codeSize; i++) {
+        if (index.codes[i] >= index.numCentroids) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,390 @@
+#ifndef RECOGNITION_SERVER_H
+#define RECOGNITION_SERVER_H
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <csignal>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "batch_query.h"
+
+/*
+ * 認識サーバ
+ *
+ * 物体モデルデータベースとインデックスを一度だけロードし、Unixドメインソケットか
+ * ローカルのTCPポート（127.0.0.1）で認識リクエストを受け付ける。
+ * プロトコルは1行1リクエストのテキストで、クライアントはクエリ画像名（IMAGE_DIRからの相対パス、
+ * または/で始まる絶対パス）を送り、サーバは1行のTSVを返す。
+ *
+ *   クエリ名  状態(ok/error)  識別結果  得票数  キーポイント数  decode_ms  extract_ms  match_ms  wait_ms  total_ms
+ *
+ * wait_msは受け付けてからワーカーが処理を始めるまで、total_msは受け付けてから応答を書くまでの時間。
+ * 同じ接続のリクエストも別々のワーカーが並行して処理するので、応答の順番は送った順とは限らない。
+ * "stats" を送ると、これまでのリクエスト数とレイテンシの分布を1行で返す。
+ * SERVER_MAX_LINEバイトを超えても改行のこない行を送ったクライアントは切断する。
+ * 同時に読む接続はSERVER_MAX_CONNECTIONSまでで、超えた分はどれかが閉じられるまでacceptしない。
+ */
+
+const size_t SERVER_MAX_LINE = 4096;     // 1リクエストの行の最大長（改行を含まない）
+const int SERVER_MAX_CONNECTIONS = 256;  // 同時に読む接続数の上限
+const int SERVER_ACCEPT_RETRY_MS = 100;  // ファイル記述子が足りずacceptできないときに待つ時間
+
+/**
+ * クライアントとの接続（最後の応答を書き終えて参照がなくなったら閉じる）
+ */
+class ServerConnection {
+public:
+    explicit ServerConnection(int fd) : fd(fd) {}
+
+    ~ServerConnection() {
+        close(fd);
+    }
+
+    int socket() const {
+        return fd;
+    }
+
+    /**
+     * 1行書き込む（複数のワーカーから呼ばれるので行単位で排他する）
+     */
+    bool sendLine(const std::string& line) {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        std::string data = line + "\n";
+        size_t sent = 0;
+        while (sent < data.size()) {
+            ssize_t n = write(fd, data.data() + sent, data.size() - sent);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            sent += n;
+        }
+        return true;
+    }
+
+private:
+    int fd;
+    std::mutex writeMutex;
+};
+
+/**
+ * ワーカーに渡すリクエスト
+ */
+struct ServerRequest {
+    std::shared_ptr<ServerConnection> connection;
+    std::string name;    // クエリ画像名
+    double received;     // 受け付けた時刻（cvGetTickCount()）
+};
+
+/**
+ * リクエストのレイテンシの記録（直近のものだけを残す）
+ */
+class LatencyStats {
+public:
+    LatencyStats() : count(0), errors(0), next(0) {}
+
+    void add(double ms, bool ok) {
+        std::lock_guard<std::mutex> lock(mutex);
+        count++;
+        if (!ok) {
+            errors++;
+        }
+        if (samples.size() < MAX_SAMPLES) {
+            samples.push_back(ms);
+        } else {
+            samples[next] = ms;
+            next = (next + 1) % MAX_SAMPLES;
+        }
+    }
+
+    /**
+     * 「requests=... errors=... mean_ms=... p50_ms=... p90_ms=... p99_ms=... max_ms=...」の形式で返す
+     */
+    std::string summary() {
+        std::vector<double> sorted;
+        long long n, e;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            sorted = samples;
+            n = count;
+            e = errors;
+        }
+        std::sort(sorted.begin(), sorted.end());
+        double sum = 0.0;
+        for (size_t i = 0; i < sorted.size(); i++) {
+            sum += sorted[i];
+        }
+        std::ostringstream ss;
+        ss << "requests=" << n << "\terrors=" << e << "\tmean_ms=" << (sorted.empty() ? 0.0 : sum / sorted.size())
+           << "\tp50_ms=" << percentile(sorted, 0.50) << "\tp90_ms=" << percentile(sorted, 0.90)
+           << "\tp99_ms=" << percentile(sorted, 0.99) << "\tmax_ms=" << (sorted.empty() ? 0.0 : sorted.back());
+        return ss.str();
+    }
+
+private:
+    static double percentile(const std::vector<double>& sorted, double q) {
+        if (sorted.empty()) {
+            return 0.0;
+        }
+        return sorted[std::min(sorted.size() - 1, (size_t)(q * sorted.size()))];
+    }
+
+    static const size_t MAX_SAMPLES = 100000;
+    std::mutex mutex;
+    long long count;
+    long long errors;
+    std::vector<double> samples;
+    size_t next;
+};
+
+/**
+ * 接続を読むスレッドとワーカーで共有する状態
+ * 接続を読むスレッドはdetachするので、acceptのループを抜けた後も残るようにshared_ptrで持たせる
+ */
+struct ServerState {
+    BoundedQueue<ServerRequest> requests;
+    LatencyStats stats;
+    std::mutex mutex;
+    std::condition_variable released;  // 接続が閉じられたときに通知する
+    int connections;                   // 読んでいる接続の数
+
+    explicit ServerState(size_t capacity) : requests(capacity), connections(0) {}
+};
+
+/**
+ * 待ち受け用のソケットを作る
+ *
+ * @param[in] socketPath  Unixドメインソケットのパス（NULLならTCP）
+ * @param[in] port        TCPのポート番号（127.0.0.1で待ち受ける）
+ *
+ * @return ソケット、失敗なら-1
+ */
+inline int listenServerSocket(const char* socketPath, int port) {
+    int fd;
+    if (socketPath != NULL) {
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof addr);
+        addr.sun_family = AF_UNIX;
+        if (strlen(socketPath) >= sizeof addr.sun_path) {
+            std::cerr << "socket path too long: " << socketPath << std::endl;
+            return -1;
+        }
+        strcpy(addr.sun_path, socketPath);
+        fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(socketPath);  // 前回のソケットファイルが残っていれば消す
+        if (fd < 0 || bind(fd, (sockaddr*)&addr, sizeof addr) != 0) {
+            std::cerr << "cannot bind socket: " << socketPath << std::endl;
+            if (fd >= 0) {
+                close(fd);
+            }
+            return -1;
+        }
+    } else {
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof addr);
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        int on = 1;
+        if (fd >= 0) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+        }
+        if (fd < 0 || bind(fd, (sockaddr*)&addr, sizeof addr) != 0) {
+            std::cerr << "cannot bind port: " << port << std::endl;
+            if (fd >= 0) {
+                close(fd);
+            }
+            return -1;
+        }
+    }
+    if (listen(fd, SOMAXCONN) != 0) {
+        std::cerr << "cannot listen on socket" << std::endl;
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * 認識サーバを起動する（戻らない、起動に失敗したら1を返す）
+ *
+ * @param[in] socketPath  Unixドメインソケットのパス（NULLならTCP）
+ * @param[in] port        TCPのポート番号
+ * @param[in] imageDir    クエリ画像のディレクトリ
+ * @param[in] surf        SURFの抽出のパラメータ
+ * @param[in] dim         特徴ベクトルの次元数
+ * @param[in] numWorkers  リクエストを処理するワーカー数
+ * @param[in] id2name     物体ID->物体名
+ * @param[in] chunk       一度に照合するキーポイント数
+ * @param[in] params      照合と投票のパラメータ
+ * @param[in] nnSearch    k-NNの物体IDと距離を求める関数（ワーカーから並行して呼ばれる）
+ *
+ * @return 失敗なら1
+ */
+template <class NNSearchFunc>
+inline int runRecognitionServer(const char* socketPath, int port, const char* imageDir, const SurfOptions& surf,
+                                int dim, int numWorkers, std::map<int, std::string>& id2name, int chunk,
+                                const VoteParams& params, NNSearchFunc nnSearch) {
+    int listenFd = listenServerSocket(socketPath, port);
+    if (listenFd < 0) {
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);  // 切断されたクライアントへの書き込みで終了しないように
+
+    numWorkers = std::max(numWorkers, 1);
+    int numObjects = (int)id2name.size();
+    std::vector<std::string> names(numObjects);  // ワーカーから読むだけなのでmapを引かずに済むように配列にする
+    for (int i = 0; i < numObjects; i++) {
+        names[i] = id2name[i];
+    }
+    std::shared_ptr<ServerState> state(new ServerState(numWorkers * 4));
+
+    // ワーカー：リクエストごとにデコード、SURFの抽出、照合を行う
+    // 並行性はリクエスト単位で得るので、照合は各ワーカーの中ではスレッドを使わない
+    std::vector<std::thread> workers;
+    for (int w = 0; w < numWorkers; w++) {
+        workers.push_back(std::thread([&] {
+            ThreadPool local(1);
+            QueryWorkspace work;  // リクエストごとの行列や配列を使い回す
+            QueryImage& query = work.query;
+            std::vector<QueryImage*> single(1, &query);
+            ServerRequest request;
+            while (state->requests.pop(request)) {
+                double wait = ((double)cvGetTickCount() - request.received) / (cvGetTickFrequency() * 1000.0);
+
+                query.name = request.name;
+                std::string queryFile = request.name[0] == '/' ? request.name
+                                                                : std::string(imageDir) + "/" + request.name;
+                extractQueryImage(queryFile.c_str(), surf, dim, work.surf, query);
+
+                std::ostringstream line;
+                line << query.name;
+                if (query.ok) {
+                    double tt = (double)cvGetTickCount();
+                    mergeQueryImages(single, dim, work);
+                    voteByNN(local, chunk, work, 1, numObjects, params, nnSearch);
+                    const std::vector<float>& votes = work.votes;
+                    int maxId = maxVotedObject(numObjects > 0 ? &votes[0] : NULL, numObjects, params);
+                    double matchTime = ((double)cvGetTickCount() - tt) / (cvGetTickFrequency() * 1000.0);
+                    line << "\tok\t" << (maxId >= 0 ? names[maxId] : "-") << "\t" << (maxId >= 0 ? votes[maxId] : 0)
+                         << "\t" << query.numKeypoints << "\t" << query.decodeTime << "\t" << query.extractTime
+                         << "\t" << matchTime;
+                } else {
+                    line << "\terror\t-\t0\t0\t" << query.decodeTime << "\t0\t0";
+                }
+                double total = ((double)cvGetTickCount() - request.received) / (cvGetTickFrequency() * 1000.0);
+                line << "\t" << wait << "\t" << total;
+                state->stats.add(total, query.ok);
+                request.connection->sendLine(line.str());
+                request.connection.reset();  // 次のリクエストまで接続を持ち続けないように手放す
+            }
+        }));
+    }
+
+    if (socketPath != NULL) {
+        std::cout << "Listening on " << socketPath << " (" << numWorkers << " workers)" << std::endl;
+    } else {
+        std::cout << "Listening on 127.0.0.1:" << port << " (" << numWorkers << " workers)" << std::endl;
+    }
+
+    // 接続ごとにスレッドを立ててリクエストを1行ずつ読み、ワーカーのキューに入れる
+    while (true) {
+        // 接続数が上限に達していたら、どれかが閉じられるまで次の接続を受け付けない
+        {
+            std::unique_lock<std::mutex> lock(state->mutex);
+            state->released.wait(lock, [&] { return state->connections < SERVER_MAX_CONNECTIONS; });
+        }
+        int fd = accept(listenFd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                // 一時的に資源が足りないだけなので、ほかの接続が閉じられるのを待ってやり直す
+                std::cerr << "cannot accept connection: " << strerror(errno) << ", retrying" << std::endl;
+                std::this_thread::sleep_for(std::chrono::milliseconds(SERVER_ACCEPT_RETRY_MS));
+                continue;
+            }
+            std::cerr << "cannot accept connection" << std::endl;
+            break;
+        }
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->connections++;
+        }
+        std::shared_ptr<ServerConnection> connection(new ServerConnection(fd));
+        std::thread([connection, state] {
+            std::string pending;
+            char buf[4096];
+            ssize_t n;
+            bool tooLong = false;
+            bool stopped = false;  // キューが閉じられた（サーバが止まる）
+            while (!tooLong && !stopped &&
+                   ((n = read(connection->socket(), buf, sizeof buf)) > 0 || (n < 0 && errno == EINTR))) {
+                pending.append(buf, n > 0 ? n : 0);
+                size_t pos;
+                while ((pos = pending.find('\n')) != std::string::npos && pos <= SERVER_MAX_LINE) {
+                    std::string name = pending.substr(0, pos);
+                    pending.erase(0, pos + 1);
+                    if (!name.empty() && name[name.size() - 1] == '\r') {
+                        name.erase(name.size() - 1);
+                    }
+                    if (name.empty()) {
+                        continue;
+                    }
+                    if (name == "stats") {
+                        connection->sendLine(state->stats.summary());
+                        continue;
+                    }
+                    ServerRequest request;
+                    request.connection = connection;
+                    request.name = name;
+                    request.received = (double)cvGetTickCount();
+                    if (!state->requests.push(request)) {
+                        stopped = true;
+                        break;
+                    }
+                }
+
+                // 残りは上限以下の書きかけの行だけのはずで、超えていればバッファに溜め続けずに接続を切る
+                tooLong = pending.size() > SERVER_MAX_LINE;
+            }
+            if (tooLong) {
+                std::cerr << "request line too long, closing connection" << std::endl;
+                shutdown(connection->socket(), SHUT_RDWR);
+            }
+            {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                state->connections--;
+            }
+            state->released.notify_one();
+        }).detach();
+    }
+
+    state->requests.close();
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+    close(listenFd);
+    return 1;
+}
+
+#endif
@@ -0,0 +1,293 @@
+#ifndef RECOGNIZER_H
+#define RECOGNIZER_H
+
+#include <cv.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdio>
+#include <cstdlib>
+#include "options.h"
+#include "descdb.h"
+#include "thread_pool.h"
+#include "batch_query.h"
+#include "recognition_server.h"
+#include "nn_backend.h"
+
+/*
+ * 認識プログラムの共通部分
+ *
+ * 物体モデルデータベースとインデックスの読み込み、クエリの照合と投票、対話・バッチ・サーバの
+ * 各モードはどの認識プログラムでも同じなので、ここに1つだけ持つ。各認識プログラムは既定の
+ * バックエンドを決めてrunRecognizer()を呼ぶだけで、-backend で別のバックエンドに切り替えられる。
+ *
+ * インデックスはスナップショット（-index、既定は ../dataset/<バックエンド名>_caltech101_10.idx、
+ * build_indexで作成）があればmmapするだけで読み込み、なければ起動のたびにデータベースから作る。
+ */
+
+/**
+ * 認識プログラムのデータセットとパラメータ
+ */
+struct RecognizerConfig {
+    int dim;                 // 特徴ベクトルの次元数
+    SurfOptions surf;        // SURFの抽出のパラメータ
+    int batchSize;           // バッチモードで1回の照合にまとめる画像数
+    const char* imageDir;    // クエリ画像のディレクトリ
+    const char* objIdFile;   // 物体ID->物体名
+    const char* descFile;    // テキスト形式の物体モデルデータベース
+    const char* descDBFile;  // バイナリ形式の物体モデルデータベース（convert_descriptionで作成）
+    const char* indexFile;   // スナップショットの既定のファイル名（%sがバックエンド名になる）
+
+    RecognizerConfig()
+        : dim(128), batchSize(64), imageDir("../dataset/caltech101_10"),
+          objIdFile("../dataset/object_caltech101_10.txt"), descFile("../dataset/description_caltech101_10.txt"),
+          descDBFile("../dataset/description_caltech101_10.db"), indexFile("../dataset/%s_caltech101_10.idx") {}
+};
+
+/**
+ * バックエンドのスナップショットの既定のファイル名
+ */
+inline std::string defaultIndexFile(const RecognizerConfig& config, const NNBackend& backend) {
+    char file[1024];
+    snprintf(file, sizeof file, config.indexFile, backend.name());
+    return file;
+}
+
+/**
+ * 物体ID->物体名のmapを作成して返す
+ *
+ * @param[in]  filename  物体ID->物体名の対応を格納したファイル
+ * @param[out] id2name   物体ID->物体名のmap
+ *
+ * @return 成功ならtrue、失敗ならfalse
+ */
+inline bool loadObjectId(const char* filename, std::map<int, std::string>& id2name) {
+    // 物体IDと物体名を格納したファイルを開く
+    std::ifstream objFile(filename);
+    if (objFile.fail()) {
+        std::cerr << "cannot open file: " << filename << std::endl;
+        return false;
+    }
+
+    // 1行ずつ読み込み、物体ID->物体名のmapを作成
+    std::string line;
+    while (getline(objFile, line, '\n')) {
+        // タブで分割した文字列をldataへ格納
+        std::vector<std::string> ldata;
+        std::istringstream ss(line);
+        std::string s;
+        while (getline(ss, s, '\t')) {
+            ldata.push_back(s);
+        }
+
+        // 物体IDと物体名を抽出してmapへ格納
+        int objId = atol(ldata[0].c_str());
+        std::string objName = ldata[1];
+        id2name.insert(std::map<int, std::string>::value_type(objId, objName));
+    }
+
+    return true;
+}
+
+/**
+ * バックエンドのインデックスを用意する（スナップショットがあれば読み込み、なければデータベースから作る）
+ *
+ * @param[in]     config     データセット
+ * @param[in,out] backend    バックエンド
+ * @param[in]     indexFile  スナップショットのファイル名
+ * @param[in]     pool       学習に使うスレッドプール
+ * @param[out]    model      物体モデルデータベース（バックエンドが使わなければ解放して空にする）
+ *
+ * @return 成功ならtrue、失敗ならfalse
+ */
+inline bool prepareBackend(const RecognizerConfig& config, NNBackend& backend, const char* indexFile,
+                           ThreadPool& pool, ModelDB& model) {
+    // 探索に元の特徴ベクトルを使うバックエンドは先にデータベースをロードする
+    bool modelLoaded = false;
+    if (backend.needsModel()) {
+        std::cout << "物体モデルデータベースをロードします ... " << std::flush;
+        if (!loadModelDB(config.descDBFile, config.descFile, config.dim, model, backend.prefetchModel())) {
+            std::cerr << "cannot load description file" << std::endl;
+            return false;
+        }
+        std::cout << "OK" << std::endl;
+        modelLoaded = true;
+    }
+
+    // スナップショットがあればmmapするだけでインデックスを読み込む
+    bool loaded = false;
+    IndexSnapshot snapshot;
+    if (backend.snapshotType() != 0 && openIndexSnapshot(indexFile, backend.snapshotType(), snapshot)) {
+        std::cout << backend.name() << "のスナップショットをロードします: " << indexFile << " ... " << std::flush;
+        loaded = backend.load(snapshot, config.dim, modelLoaded ? &model : NULL);
+        if (loaded) {
+            std::cout << "OK" << std::endl;
+        } else {
+            std::cout << "NG" << std::endl;
+            std::cerr << "invalid " << backend.name() << " snapshot: " << indexFile << std::endl;
+        }
+    }
+
+    // なければ物体モデルデータベースをロードして起動のたびにインデックスを作る
+    if (!loaded) {
+        if (!modelLoaded) {
+            std::cout << "物体モデルデータベースをロードします ... " << std::flush;
+            if (!loadModelDB(config.descDBFile, config.descFile, config.dim, model)) {
+                std::cerr << "cannot load description file" << std::endl;
+                return false;
+            }
+            std::cout << "OK" << std::endl;
+        }
+        std::cout << "物体モデルデータベースをインデキシングします ... " << std::flush;
+        double bt = (double)cvGetTickCount();
+        if (!backend.build(model, pool)) {
+            std::cerr << "cannot build " << backend.name() << " index" << std::endl;
+            return false;
+        }
+        bt = (double)cvGetTickCount() - bt;
+        std::cout << "OK (" << bt / (cvGetTickFrequency() * 1000.0) << "ms)" << std::endl;
+    }
+
+    // インデックスが特徴ベクトルをコピーして持つなら、作ったらデータベースはいらない
+    if (!backend.needsModel()) {
+        releaseModelDB(model);
+    }
+    return true;
+}
+
+/**
+ * 認識プログラムの本体
+ * -backend でバックエンド、-index でスナップショット、-t で照合スレッド数を指定する。
+ * -filter、-ratio、-dist、-weighted、-margin で照合と投票のしかたを変える（parseVoteOptions()を参照）。
+ * -maxsize でクエリ画像を縮小する長辺の画素数、-maxkp で残すキーポイント数を指定する（parseSurfOptions()を参照）。
+ * -batch ならマニフェストのクエリ画像をまとめて認識する
+ * （-o 出力ファイル、-bs 1回の照合にまとめる画像数、-e 先読みスレッド数）。
+ * -socket か -port ならサーバとして常駐してリクエストを受け付ける（-w ワーカー数）。
+ * どちらでもなければ標準入力からクエリ画像名を読んで1枚ずつ認識する。
+ *
+ * @param[in] argc
+ * @param[in] argv
+ * @param[in] defaultBackend  -backend がないときのバックエンドの名前
+ * @param[in] config          データセット
+ *
+ * @return 成功なら0、失敗なら1
+ */
+inline int runRecognizer(int argc, char** argv, const char* defaultBackend,
+                         const RecognizerConfig& config = RecognizerConfig()) {
+    double tt = (double)cvGetTickCount();
+
+    NNBackend* backend = createNNBackend(stringOption(argc, argv, "-backend", defaultBackend), argc, argv);
+    if (backend == NULL) {
+        std::cerr << "unknown backend (" << NN_BACKEND_NAMES << ")" << std::endl;
+        return 1;
+    }
+
+    // 物体ID->物体ファイル名のハッシュを作成
+    std::cout << "物体ID->物体名のハッシュを作成します ... " << std::flush;
+    std::map<int, std::string> id2name;
+    if (!loadObjectId(config.objIdFile, id2name)) {
+        std::cerr << "cannot load object id file" << std::endl;
+        delete backend;
+        return 1;
+    }
+    std::cout << "OK" << std::endl;
+
+    // 照合用のスレッドプール（-t でスレッド数を指定、インデックスの学習にも使う）
+    ThreadPool pool(parseThreadOption(argc, argv));
+
+    ModelDB model;
+    std::string indexFile = stringOption(argc, argv, "-index", defaultIndexFile(config, *backend).c_str());
+    if (!prepareBackend(config, *backend, indexFile.c_str(), pool, model)) {
+        delete backend;
+        releaseModelDB(model);
+        return 1;
+    }
+
+    std::cout << "最近傍探索のバックエンド: " << backend->name() << std::endl;
+    std::cout << "物体モデルデータベースの物体数: " << id2name.size() << std::endl;
+    std::cout << "データベース中のキーポイント数: " << backend->rows(0) + backend->rows(1)
+              << " (" << backend->rows(0) << " + " << backend->rows(1) << ")" << std::endl;
+    std::cout << backend->describe() << std::endl;
+    std::cout << "インデックスの大きさ: " << backend->memoryUsage() << "バイト" << std::endl;
+    VoteParams params = parseVoteOptions(argc, argv);
+    std::cout << "ratio test: " << params.ratio << ", 距離の上限: " << params.distThreshold << ", 重みつきの票: "
+              << (params.weighted ? "on" : "off") << ", 打ち切る票差: " << params.voteMargin << std::endl;
+    SurfOptions surf = parseSurfOptions(argc, argv, config.surf);
+    std::cout << "クエリ画像の長辺の上限: " << surf.maxSize << ", キーポイント数の上限: " << surf.maxKeypoints
+              << " (0なら制限なし)" << std::endl;
+    std::cout << "照合スレッド数: " << pool.size() << std::endl;
+    tt = (double)cvGetTickCount() - tt;
+    std::cout << "Loading Models Time = " << tt / (cvGetTickFrequency() * 1000.0) << "ms" << std::endl;
+
+    // 区画pのインデックスでクエリのbegin〜end行目のk-NNを検索し、そのキーポイントの物体IDと距離を求める
+    const NNBackend* nn = backend;
+    auto nnSearch = [nn](int p, const CvMat* queries, int begin, int end, int k, int* labels, float* dists) {
+        nn->search(p, queries, begin, end, k, NULL, labels, dists);
+    };
+    int chunk = backend->queryChunk();
+
+    int ret = 0;
+    const char* manifest = stringOption(argc, argv, "-batch", NULL);
+    const char* socketPath = stringOption(argc, argv, "-socket", NULL);
+    int port = intOption(argc, argv, "-port", 0);
+    if (manifest != NULL) {
+        ret = runBatchRecognition(manifest, stringOption(argc, argv, "-o", NULL), config.imageDir, surf,
+                                  config.dim, intOption(argc, argv, "-bs", config.batchSize),
+                                  intOption(argc, argv, "-e", pool.size()), id2name, pool, chunk, params, nnSearch);
+    } else if (socketPath != NULL || port > 0) {
+        ret = runRecognitionServer(socketPath, port, config.imageDir, surf, config.dim,
+                                   intOption(argc, argv, "-w", pool.size()), id2name, chunk, params, nnSearch);
+    } else {
+        int numObjects = (int)id2name.size();  // データベース中の物体数
+        QueryWorkspace work;                   // クエリごとの行列や配列を使い回す
+        QueryImage& query = work.query;
+        std::vector<QueryImage*> single(1, &query);
+        while (1) {
+            // クエリファイルの入力
+            std::string input;
+            std::cout << "query? > ";
+            if (!(std::cin >> input)) {
+                break;
+            }
+
+            std::string queryFile = std::string(config.imageDir) + "/" + input;
+            std::cout << queryFile << std::endl;
+
+            tt = (double)cvGetTickCount();
+
+            // クエリ画像をロードしてSURF特徴量をラプラシアンの符号ごとに抽出
+            extractQueryImage(queryFile.c_str(), surf, config.dim, work.surf, query);
+            if (!query.ok) {
+                continue;
+            }
+            std::cout << "クエリのキーポイント数: " << query.numKeypoints << std::endl;
+
+            // 同じ符号の区画のインデックスで1-NNを検索し、そのキーポイントを含む物体に得票
+            // クエリをチャンクに分けて並列に検索する
+            mergeQueryImages(single, config.dim, work);
+            int matched = voteByNN(pool, chunk, work, 1, numObjects, params, nnSearch);
+            const std::vector<float>& votes = work.votes;  // 各物体の集めた得票数
+
+            // 投票数が最大の物体IDを物体ファイル名に変換
+            // （照合を捨てるオプションを使っていてどの物体にも票が入らなければ棄却）
+            int maxId = maxVotedObject(&votes[0], numObjects, params);
+            std::cout << "照合したキーポイント数: " << matched << std::endl;
+            std::cout << "識別結果: " << (maxId >= 0 ? id2name[maxId] : "-") << " (" << (maxId >= 0 ? votes[maxId] : 0)
+                      << "票)" << std::endl;
+
+            tt = (double)cvGetTickCount() - tt;
+            std::cout << "Recognition Time = " << tt / (cvGetTickFrequency() * 1000.0) << "ms" << std::endl;
+        }
+    }
+
+    // 後始末（インデックスはスナップショットやデータベースを指しているので先に解放する）
+    delete backend;
+    releaseModelDB(model);
+
+    return ret;
+}
+
+#endif
@@ -0,0 +1,247 @@
+#ifndef SIMD_NN_H
+#define SIMD_NN_H
+
+#include <cfloat>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_NN_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+ * 全探索用のユークリッド距離カーネル
+ *
+ * 距離の大小比較にしか使わないので平方根は取らず二乗距離を返す。
+ * 32次元ごとに途中までの和を現在の最小距離と比べ、超えた時点で打ち切る（early abandonment）。
+ * 打ち切った場合の戻り値は bound より大きい途中までの和になる。
+ * AVX-512 / AVX2 / SSE の実装を実行時にCPUを見て選ぶ。
+ */
+
+typedef float (*L2BoundedFunc)(const float* a, const float* b, int dim, float bound);
+
+/**
+ * 2つのベクトルの二乗ユークリッド距離を計算する（スカラー版）
+ *
+ * @param[in] a      ベクトル1の配列
+ * @param[in] b      ベクトル2の配列
+ * @param[in] dim    ベクトルの長さ
+ * @param[in] bound  これを超えたら計算を打ち切る距離
+ *
+ * @return 二乗ユークリッド距離（打ち切った場合はboundより大きい値）
+ */
+inline float l2BoundedScalar(const float* a, const float* b, int dim, float bound) {
+    float sum = 0.0f;
+    int i = 0;
+    for (; i + 32 <= dim; i += 32) {
+        for (int j = i; j < i + 32; j++) {
+            float d = a[j] - b[j];
+            sum += d * d;
+        }
+        if (sum > bound) {
+            return sum;
+        }
+    }
+    for (; i < dim; i++) {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+#ifdef SIMD_NN_X86
+
+inline float simdHsum128(__m128 v) {
+    __m128 shuf = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+    __m128 sums = _mm_add_ps(v, shuf);
+    shuf = _mm_movehl_ps(shuf, sums);
+    sums = _mm_add_ss(sums, shuf);
+    return _mm_cvtss_f32(sums);
+}
+
+__attribute__((target("sse2")))
+inline float l2BoundedSSE(const float* a, const float* b, int dim, float bound) {
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 32 <= dim; i += 32) {
+        for (int j = i; j < i + 32; j += 8) {
+            __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + j), _mm_loadu_ps(b + j));
+            __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + j + 4), _mm_loadu_ps(b + j + 4));
+            acc0 = _mm_add_ps(acc0, _mm_mul_ps(d0, d0));
+            acc1 = _mm_add_ps(acc1, _mm_mul_ps(d1, d1));
+        }
+        float partial = simdHsum128(_mm_add_ps(acc0, acc1));
+        if (partial > bound) {
+            return partial;
+        }
+    }
+    float sum = simdHsum128(_mm_add_ps(acc0, acc1));
+    for (; i < dim; i++) {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma")))
+inline float l2BoundedAVX2(const float* a, const float* b, int dim, float bound) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 32 <= dim; i += 32) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        __m256 d2 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 16), _mm256_loadu_ps(b + i + 16));
+        __m256 d3 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 24), _mm256_loadu_ps(b + i + 24));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+        acc0 = _mm256_fmadd_ps(d2, d2, acc0);
+        acc1 = _mm256_fmadd_ps(d3, d3, acc1);
+        __m256 s = _mm256_add_ps(acc0, acc1);
+        float partial = simdHsum128(_mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1)));
+        if (partial > bound) {
+            return partial;
+        }
+    }
+    __m256 s = _mm256_add_ps(acc0, acc1);
+    float sum = simdHsum128(_mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1)));
+    for (; i < dim; i++) {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+/**
+ * 512ビットの16要素の和（512→256→128ビットに畳んでからsimdHsum128）
+ * _mm512_reduce_add_ps()や_mm512_castps512_ps256()は未定義値を通すので
+ * GCC 12で-Wmaybe-uninitializedの警告が出る。ゼロマスク版で両半分を取り出す。
+ */
+__attribute__((target("avx512f")))
+inline float simdHsum512(__m512 v) {
+    __m512d vd = _mm512_castps_pd(v);
+    __m256 lo = _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xff, vd, 0));
+    __m256 hi = _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xff, vd, 1));
+    __m256 s = _mm256_add_ps(lo, hi);
+    return simdHsum128(_mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1)));
+}
+
+__attribute__((target("avx512f")))
+inline float l2BoundedAVX512(const float* a, const float* b, int dim, float bound) {
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 32 <= dim; i += 32) {
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+        acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+        float partial = simdHsum512(_mm512_add_ps(acc0, acc1));
+        if (partial > bound) {
+            return partial;
+        }
+    }
+    float sum = simdHsum512(_mm512_add_ps(acc0, acc1));
+    for (; i < dim; i++) {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+#endif  // SIMD_NN_X86
+
+/**
+ * 実行中のCPUで使える一番速い距離カーネルを返す
+ *
+ * @param[out] name  選んだ実装の名前（NULL可）
+ *
+ * @return 距離カーネルの関数ポインタ
+ */
+inline L2BoundedFunc selectL2Bounded(const char** name = 0) {
+    L2BoundedFunc func = l2BoundedScalar;
+    const char* selected = "scalar";
+#ifdef SIMD_NN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        func = l2BoundedAVX512;
+        selected = "avx512";
+    } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        func = l2BoundedAVX2;
+        selected = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        func = l2BoundedSSE;
+        selected = "sse";
+    }
+#endif
+    if (name != 0) {
+        *name = selected;
+    }
+    return func;
+}
+
+/**
+ * 選択済みの距離カーネルを返す（最初の呼び出しで1回だけCPUを調べる）
+ */
+inline L2BoundedFunc l2Bounded() {
+    static const L2BoundedFunc func = selectL2Bounded();
+    return func;
+}
+
+const int NN_QUERY_BLOCK = 8;    // 一度に処理するクエリベクトル数
+const int NN_DB_BLOCK = 256;     // 一度に処理するデータベースの行数（128次元で128KB）
+
+/**
+ * 複数のクエリベクトルの1-NNをデータベースから全探索で求める
+ * クエリNN_QUERY_BLOCK本 x データベースNN_DB_BLOCK行のブロック単位で走査し、
+ * キャッシュに載ったデータベースのブロックを複数のクエリで使い回す
+ *
+ * @param[in]  queries     クエリの特徴ベクトル（numQueries x dim、行優先）
+ * @param[in]  queryLaps   クエリのラプラシアン（NULLならラプラシアンで絞り込まない）
+ * @param[in]  numQueries  クエリの本数
+ * @param[in]  db          データベースの特徴ベクトル（rows x dim、行優先）
+ * @param[in]  dbLaps      データベースのラプラシアン（NULLならラプラシアンで絞り込まない）
+ * @param[in]  rows        データベースの行数
+ * @param[in]  dim         特徴ベクトルの次元数
+ * @param[out] nnIndex     各クエリの1-NNの行番号（見つからなければ-1）
+ * @param[out] nnDist      各クエリの1-NNまでの二乗距離
+ */
+inline void searchNNBlock(const float* queries, const int* queryLaps, int numQueries,
+                          const float* db, const int* dbLaps, int rows, int dim,
+                          int* nnIndex, float* nnDist) {
+    L2BoundedFunc l2 = l2Bounded();
+    bool useLap = queryLaps != 0 && dbLaps != 0;
+
+    for (int q0 = 0; q0 < numQueries; q0 += NN_QUERY_BLOCK) {
+        int q1 = std::min(q0 + NN_QUERY_BLOCK, numQueries);
+        for (int q = q0; q < q1; q++) {
+            nnIndex[q] = -1;
+            nnDist[q] = FLT_MAX;
+        }
+        for (int r0 = 0; r0 < rows; r0 += NN_DB_BLOCK) {
+            int r1 = std::min(r0 + NN_DB_BLOCK, rows);
+            for (int q = q0; q < q1; q++) {
+                const float* vec = queries + (size_t)q * dim;
+                int lap = useLap ? queryLaps[q] : 0;
+                int bestIndex = nnIndex[q];
+                float bestDist = nnDist[q];
+                for (int r = r0; r < r1; r++) {
+                    // クエリのキーポイントとラプラシアンが異なるキーポイントは無視
+                    if (useLap && dbLaps[r] != lap) {
+                        continue;
+                    }
+                    float d = l2(vec, db + (size_t)r * dim, dim, bestDist);
+                    if (d < bestDist) {
+                        bestIndex = r;
+                        bestDist = d;
+                    }
+                }
+                nnIndex[q] = bestIndex;
+                nnDist[q] = bestDist;
+            }
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,164 @@
+#ifndef SURF_CACHE_H
+#define SURF_CACHE_H
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/*
+ * 画像ごとのSURF特徴量のディスクキャッシュ
+ *
+ * キャッシュディレクトリに画像1枚につき1ファイル（パスのハッシュ値.surf）を置く。
+ *
+ *   SurfCacheHeader
+ *   char  path[pathLength]
+ *   float descriptors[count][dim]
+ *
+ * 画像のパス、サイズ、更新時刻、抽出のパラメータの識別子がすべて一致したときだけキャッシュを使う。
+ */
+
+const char SURF_CACHE_MAGIC[8] = { 'V', 'W', 'S', 'U', 'R', 'F', '0', '1' };
+
+/**
+ * 画像ファイルのサイズと更新時刻（変更されたかどうかの判定に使う）
+ */
+struct ImageStamp {
+    long long size;
+    long long mtime;
+};
+
+struct SurfCacheHeader {
+    char magic[8];
+    int64_t size;        // 画像ファイルのサイズ
+    int64_t mtime;       // 画像ファイルの更新時刻
+    int32_t dim;         // 特徴ベクトルの次元数
+    int32_t count;       // 特徴ベクトルの本数
+    int32_t pathLength;  // 画像のパスの長さ
+    int32_t variant;     // 抽出のパラメータの識別子（surfOptionsKey()、既定のパラメータなら0）
+};
+
+/**
+ * 画像ファイルのサイズと更新時刻を取得する
+ * @param[in]  filepath   画像ファイルのパス
+ * @param[out] stamp      サイズと更新時刻
+ * @return 成功ならtrue、失敗ならfalse
+ */
+inline bool statImage(const char* filepath, ImageStamp& stamp) {
+    struct stat st;
+    if (stat(filepath, &st) != 0) {
+        return false;
+    }
+    stamp.size = (long long)st.st_size;
+    stamp.mtime = (long long)st.st_mtime;
+    return true;
+}
+
+/**
+ * 画像のパスに対応するキャッシュファイルのパスを返す（パスのFNV-1aハッシュ値をファイル名にする）
+ */
+inline std::string surfCachePath(const char* cacheDir, const char* filepath) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char* p = filepath; *p != '\0'; p++) {
+        hash ^= (unsigned char)*p;
+        hash *= 1099511628211ULL;
+    }
+    char name[32];
+    snprintf(name, sizeof name, "%016llx.surf", (unsigned long long)hash);
+    return std::string(cacheDir) + "/" + name;
+}
+
+/**
+ * キャッシュからSURF特徴量をロードする
+ * @param[in]  cacheDir   キャッシュディレクトリ
+ * @param[in]  filepath   画像ファイルのパス
+ * @param[in]  stamp      画像ファイルの現在のサイズと更新時刻
+ * @param[in]  variant    抽出のパラメータの識別子
+ * @param[in]  dim        特徴ベクトルの次元数
+ * @param[out] data       特徴ベクトル（count x dim）
+ * @param[out] count      特徴ベクトルの本数
+ * @return キャッシュが有効ならtrue、なければ（または古ければ）false
+ */
+inline bool loadSurfCache(const char* cacheDir, const char* filepath, const ImageStamp& stamp, int32_t variant,
+                          int dim, std::vector<float>& data, int& count) {
+    std::string cachePath = surfCachePath(cacheDir, filepath);
+    FILE* fp = fopen(cachePath.c_str(), "rb");
+    if (fp == NULL) {
+        return false;
+    }
+
+    SurfCacheHeader header;
+    struct stat st;
+    bool ok = fstat(fileno(fp), &st) == 0 && fread(&header, sizeof header, 1, fp) == 1 &&
+              memcmp(header.magic, SURF_CACHE_MAGIC, sizeof header.magic) == 0 &&
+              header.size == stamp.size && header.mtime == stamp.mtime && header.variant == variant &&
+              header.dim == dim && dim > 0 && header.count >= 0 && header.pathLength == (int32_t)strlen(filepath);
+    if (ok) {
+        // 本数はファイルサイズと一致するときだけ信じる（壊れたキャッシュで巨大な確保をしない）
+        long long bodySize = (long long)st.st_size - (long long)sizeof header - header.pathLength;
+        ok = bodySize >= 0 && bodySize % ((long long)sizeof(float) * dim) == 0 &&
+             bodySize / ((long long)sizeof(float) * dim) == header.count;
+    }
+    if (ok) {
+        // ハッシュ値の衝突に備えてパスも比べる
+        std::vector<char> path(header.pathLength);
+        ok = header.pathLength == 0 ||
+             (fread(&path[0], 1, path.size(), fp) == path.size() && memcmp(&path[0], filepath, path.size()) == 0);
+    }
+    if (ok) {
+        data.resize((size_t)header.count * dim);
+        ok = header.count == 0 || fread(&data[0], sizeof(float), data.size(), fp) == data.size();
+        count = header.count;
+    }
+    fclose(fp);
+
+    if (!ok) {
+        data.clear();
+    }
+    return ok;
+}
+
+/**
+ * SURF特徴量をキャッシュに保存する（一時ファイルに書いてからrenameする）
+ * @param[in] cacheDir   キャッシュディレクトリ
+ * @param[in] filepath   画像ファイルのパス
+ * @param[in] stamp      画像ファイルのサイズと更新時刻
+ * @param[in] variant    抽出のパラメータの識別子
+ * @param[in] dim        特徴ベクトルの次元数
+ * @param[in] data       特徴ベクトル（count x dim）
+ * @param[in] count      特徴ベクトルの本数
+ * @return 成功ならtrue、失敗ならfalse
+ */
+inline bool saveSurfCache(const char* cacheDir, const char* filepath, const ImageStamp& stamp, int32_t variant,
+                          int dim, const float* data, int count) {
+    std::string cachePath = surfCachePath(cacheDir, filepath);
+    std::string tmpPath = cachePath + ".tmp";
+    FILE* fp = fopen(tmpPath.c_str(), "wb");
+    if (fp == NULL) {
+        return false;
+    }
+
+    SurfCacheHeader header;
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, SURF_CACHE_MAGIC, sizeof header.magic);
+    header.size = stamp.size;
+    header.mtime = stamp.mtime;
+    header.variant = variant;
+    header.dim = dim;
+    header.count = count;
+    header.pathLength = (int32_t)strlen(filepath);
+    fwrite(&header, sizeof header, 1, fp);
+    fwrite(filepath, 1, header.pathLength, fp);
+    if (count > 0) {
+        fwrite(data, sizeof(float), (size_t)count * dim, fp);
+    }
+    if (fclose(fp) != 0 || rename(tmpPath.c_str(), cachePath.c_str()) != 0) {
+        remove(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+#endif
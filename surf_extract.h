@@ -0,0 +1,321 @@
+#ifndef SURF_EXTRACT_H
+#define SURF_EXTRACT_H
+
+#include <cv.h>
+#include <highgui.h>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include "options.h"
+
+#ifdef HAVE_JPEG
+#include <csetjmp>
+extern "C" {
+#include <jpeglib.h>
+}
+#endif
+
+/*
+ * SURF特徴量の抽出の共通部分
+ *
+ * 大きな写真をそのままの解像度でデコードして抽出すると、デコードと抽出の時間もキーポイント数も
+ * 画素数に比例して増える。-maxsize を指定すると長辺がその画素数になるまで縮小してから抽出する。
+ * HAVE_JPEGを定義して（-DHAVE_JPEG、-ljpegでリンク）ビルドすると、JPEGはlibjpegでDCT領域のまま
+ * 1/2、1/4、1/8に縮小しながらデコードし（scale_num / scale_denom）、残りをCV_INTER_AREAで縮小する。
+ * それ以外の形式やHAVE_JPEGなしのビルドでは全体をcvLoadImage()でデコードしてから縮小する。
+ * -maxkp を指定するとhessianの大きい順にその数だけキーポイントを残す。
+ * どちらも指定しなければ従来どおり元の解像度のまま全キーポイントを使う。
+ *
+ * 抽出に使うメモリ領域などはスレッドごとのSurfWorkspaceに持たせ、画像ごとに作り直さずに使い回す。
+ */
+
+const int SURF_HESSIAN_THRESHOLD = 400;  // SURFのhessianThresholdの既定値
+
+/**
+ * SURFの抽出のパラメータ
+ */
+struct SurfOptions {
+    int hessianThreshold;  // SURFのhessianThreshold
+    int maxSize;           // 抽出する画像の長辺の上限（0なら縮小しない）
+    int maxKeypoints;      // 残すキーポイント数の上限（0なら制限しない）
+
+    SurfOptions() : hessianThreshold(SURF_HESSIAN_THRESHOLD), maxSize(0), maxKeypoints(0) {}
+};
+
+/**
+ * 1つのスレッドが画像ごとに使い回すSURFの抽出の作業領域
+ * CvMemStorageは画像ごとにcvClearMemStorage()で空にするだけで、確保済みのブロックを次の画像でも使う。
+ * 配列もclear()やresize()で容量を残すので、一番大きな画像に合わせて伸びたあとは確保しない。
+ * 複数のスレッドで同時に使ってはいけない。
+ */
+class SurfWorkspace {
+public:
+    SurfWorkspace() : storage(cvCreateMemStorage(0)) {}
+
+    ~SurfWorkspace() {
+        cvReleaseMemStorage(&storage);
+    }
+
+    CvMemStorage* storage;                      // cvExtractSURF()のキーポイントと特徴量の領域
+    std::vector<int> selected;                  // 残すキーポイントの番号（元の順）
+    std::vector<std::pair<float, int> > order;  // キーポイントを選ぶときの作業用
+
+private:
+    SurfWorkspace(const SurfWorkspace&);
+    SurfWorkspace& operator=(const SurfWorkspace&);
+};
+
+/**
+ * コマンドライン引数から -maxsize [長辺の画素数]、-maxkp [キーポイント数] を探す
+ *
+ * @param[in] argc
+ * @param[in] argv
+ * @param[in] defaults  指定がないときの値
+ *
+ * @return SURFの抽出のパラメータ
+ */
+inline SurfOptions parseSurfOptions(int argc, char** argv, const SurfOptions& defaults = SurfOptions()) {
+    SurfOptions surf = defaults;
+    surf.maxSize = std::max(intOption(argc, argv, "-maxsize", defaults.maxSize), 0);
+    surf.maxKeypoints = std::max(intOption(argc, argv, "-maxkp", defaults.maxKeypoints), 0);
+    return surf;
+}
+
+// 縮小するときのデコード方法（libjpegの縮小デコードとcvLoadImage()後の縮小では画素が変わる）
+#ifdef HAVE_JPEG
+const int SURF_DECODER = 1;
+#else
+const int SURF_DECODER = 0;
+#endif
+
+/**
+ * 抽出結果を変えるパラメータの識別子（SURFのキャッシュが同じパラメータで作られたかの判定に使う）
+ * 縮小するときはデコード方法も含める。縮小もキーポイント数の制限もしなければ0
+ */
+inline int32_t surfOptionsKey(const SurfOptions& surf) {
+    if (surf.maxSize <= 0 && surf.maxKeypoints <= 0) {
+        return 0;
+    }
+    uint32_t hash = 2166136261u;
+    int values[3] = { surf.maxSize, surf.maxKeypoints, surf.maxSize > 0 ? SURF_DECODER : 0 };
+    for (int i = 0; i < 3; i++) {
+        hash = (hash ^ (uint32_t)values[i]) * 16777619u;
+    }
+    return (int32_t)(hash | 1);
+}
+
+/**
+ * JPEGファイルのヘッダ（SOFマーカー）から画像の大きさを読む
+ *
+ * @param[in]  filename  画像ファイル
+ * @param[out] width     幅
+ * @param[out] height    高さ
+ *
+ * @return JPEGで大きさがわかればtrue、それ以外はfalse
+ */
+inline bool readJPEGSize(const char* filename, int& width, int& height) {
+    FILE* fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        return false;
+    }
+    bool found = false;
+    if (fgetc(fp) == 0xFF && fgetc(fp) == 0xD8) {
+        int c;
+        while ((c = fgetc(fp)) != EOF) {
+            if (c != 0xFF) {
+                continue;
+            }
+            int marker;
+            while ((marker = fgetc(fp)) == 0xFF) {
+            }
+            if (marker == EOF || marker == 0xD9) {
+                break;
+            }
+            if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+                continue;  // 長さを持たないマーカー
+            }
+            int length = (fgetc(fp) << 8) | fgetc(fp);
+            bool sof = marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC;
+            if (sof) {
+                unsigned char b[5];
+                if (fread(b, 1, sizeof b, fp) == sizeof b) {
+                    height = (b[1] << 8) | b[2];
+                    width = (b[3] << 8) | b[4];
+                    found = width > 0 && height > 0;
+                }
+                break;
+            }
+            if (length < 2 || fseek(fp, length - 2, SEEK_CUR) != 0) {
+                break;
+            }
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+#ifdef HAVE_JPEG
+/**
+ * libjpegのエラーでexit()せずにデコードを打ち切るためのエラーハンドラ
+ */
+struct JPEGErrorManager {
+    jpeg_error_mgr pub;
+    jmp_buf jump;
+};
+
+inline void jpegErrorExit(j_common_ptr cinfo) {
+    longjmp(((JPEGErrorManager*)cinfo->err)->jump, 1);
+}
+
+inline void jpegOutputMessage(j_common_ptr cinfo) {
+    // 警告は表示しない（デコードできなければcvLoadImage()でもう一度読む）
+}
+
+/**
+ * JPEGをDCT領域で1/scaleに縮小しながらグレースケールでデコードする
+ *
+ * @param[in] filename  JPEGファイル
+ * @param[in] scale     縮小率の逆数（1、2、4、8）
+ *
+ * @return グレースケール画像（cvReleaseImage()で解放）、デコードできなければNULL
+ */
+inline IplImage* loadReducedJPEG(const char* filename, int scale) {
+    FILE* fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        return NULL;
+    }
+    jpeg_decompress_struct cinfo;
+    JPEGErrorManager jerr;
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpegErrorExit;
+    jerr.pub.output_message = jpegOutputMessage;
+    IplImage* volatile img = NULL;
+    if (setjmp(jerr.jump) != 0) {
+        jpeg_destroy_decompress(&cinfo);
+        fclose(fp);
+        IplImage* partial = img;
+        if (partial != NULL) {
+            cvReleaseImage(&partial);
+        }
+        return NULL;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, fp);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = scale;
+    cinfo.out_color_space = JCS_GRAYSCALE;  // YCbCrならY成分だけを取り出す
+    jpeg_start_decompress(&cinfo);
+    img = cvCreateImage(cvSize(cinfo.output_width, cinfo.output_height), IPL_DEPTH_8U, 1);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = (JSAMPROW)(img->imageData + (size_t)cinfo.output_scanline * img->widthStep);
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    fclose(fp);
+    return img;
+}
+#endif
+
+/**
+ * 画像をグレースケールでロードし、長辺がmaxSizeを超えていれば縮小する
+ *
+ * @param[in] filename  画像ファイル
+ * @param[in] maxSize   長辺の上限（0なら縮小しない）
+ *
+ * @return グレースケール画像（cvReleaseImage()で解放）、ロードできなければNULL
+ */
+inline IplImage* loadGrayImage(const char* filename, int maxSize) {
+    if (maxSize <= 0) {
+        return cvLoadImage(filename, CV_LOAD_IMAGE_GRAYSCALE);
+    }
+
+    IplImage* img = NULL;
+#ifdef HAVE_JPEG
+    // JPEGは縮小しても長辺がmaxSize以上になる一番小さな倍率（1/2、1/4、1/8）でデコードする
+    int width, height;
+    if (readJPEGSize(filename, width, height)) {
+        int scale = 1;
+        while (scale < 8 && std::max(width, height) / (scale * 2) >= maxSize) {
+            scale *= 2;
+        }
+        if (scale > 1) {
+            img = loadReducedJPEG(filename, scale);
+        }
+    }
+#endif
+    if (img == NULL) {
+        img = cvLoadImage(filename, CV_LOAD_IMAGE_GRAYSCALE);
+        if (img == NULL) {
+            return NULL;
+        }
+    }
+
+    int longSide = std::max(img->width, img->height);
+    if (longSide > maxSize) {
+        double scale = (double)maxSize / longSide;
+        CvSize size = cvSize(std::max((int)(img->width * scale + 0.5), 1),
+                             std::max((int)(img->height * scale + 0.5), 1));
+        IplImage* reduced = cvCreateImage(size, img->depth, img->nChannels);
+        cvResize(img, reduced, CV_INTER_AREA);
+        cvReleaseImage(&img);
+        img = reduced;
+    }
+    return img;
+}
+
+/**
+ * hessianの大きい順にmaxKeypoints個のキーポイントを選ぶ
+ *
+ * @param[in]  keypoints     cvExtractSURF()で抽出したキーポイント
+ * @param[in]  maxKeypoints  残すキーポイント数の上限（0なら全部）
+ * @param[out] selected      選んだキーポイントの番号（元の順）
+ * @param[out] order         作業用の配列
+ */
+inline void selectStrongKeypoints(const CvSeq* keypoints, int maxKeypoints, std::vector<int>& selected,
+                                  std::vector<std::pair<float, int> >& order) {
+    int total = keypoints->total;
+    selected.resize(total);
+    for (int i = 0; i < total; i++) {
+        selected[i] = i;
+    }
+    if (maxKeypoints <= 0 || total <= maxKeypoints) {
+        return;
+    }
+    order.resize(total);
+    for (int i = 0; i < total; i++) {
+        const CvSURFPoint* kp = (const CvSURFPoint*)cvGetSeqElem(keypoints, i);
+        order[i] = std::make_pair(-kp->hessian, i);
+    }
+    std::nth_element(order.begin(), order.begin() + maxKeypoints, order.end());
+    selected.resize(maxKeypoints);
+    for (int i = 0; i < maxKeypoints; i++) {
+        selected[i] = order[i].second;
+    }
+    std::sort(selected.begin(), selected.end());
+}
+
+/**
+ * SURF特徴量（128次元）を抽出し、残すキーポイントをwork.selectedに選ぶ
+ * 前の画像のキーポイントと特徴量はworkのメモリ領域ごと捨てられる
+ *
+ * @param[in]     img          グレースケール画像
+ * @param[in]     surf         SURFの抽出のパラメータ
+ * @param[in,out] work         作業領域
+ * @param[out]    keypoints    キーポイント（次にworkを使うまで有効）
+ * @param[out]    descriptors  各キーポイントのSURF特徴量（次にworkを使うまで有効）
+ */
+inline void extractSurf(IplImage* img, const SurfOptions& surf, SurfWorkspace& work, CvSeq** keypoints,
+                        CvSeq** descriptors) {
+    cvClearMemStorage(work.storage);
+    CvSURFParams params = cvSURFParams(surf.hessianThreshold, 1);
+    cvExtractSURF(img, 0, keypoints, descriptors, work.storage, params);
+    selectStrongKeypoints(*keypoints, surf.maxKeypoints, work.selected, work.order);
+}
+
+#endif
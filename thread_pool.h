@@ -0,0 +1,249 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+#include <deque>
+#include "options.h"
+
+/*
+ * ワークスティーリング付きのスレッドプール
+ *
+ * parallelFor()は範囲をチャンクに分け、各ワーカーに連続したチャンクを割り当てる。
+ * 自分の分を先頭から処理し終えたワーカーは、他のワーカーの残りを末尾から奪って処理する。
+ * 呼び出し元のスレッドもワーカー0として処理に加わるので、スレッド数1ならスレッドは作らない。
+ */
+class ThreadPool {
+public:
+    /**
+     * @param[in] numThreads  ワーカー数（呼び出し元を含む、0以下ならCPUのコア数）
+     */
+    explicit ThreadPool(int numThreads = 0) : generation(0), running(0), quit(false) {
+        if (numThreads <= 0) {
+            numThreads = (int)std::thread::hardware_concurrency();
+        }
+        numThreads = std::max(numThreads, 1);
+        for (int i = 1; i < numThreads; i++) {
+            threads.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wake.notify_all();
+        for (size_t i = 0; i < threads.size(); i++) {
+            threads[i].join();
+        }
+    }
+
+    /**
+     * ワーカー数（呼び出し元を含む）
+     */
+    int size() const {
+        return (int)threads.size() + 1;
+    }
+
+    /**
+     * 全ワーカーでfn(worker)を1回ずつ実行し、全部終わるまで待つ
+     *
+     * @param[in] fn  ワーカー番号（0〜size()-1）を受け取る関数
+     */
+    void run(const std::function<void(int)>& fn) {
+        if (threads.empty()) {
+            fn(0);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = fn;
+            running = (int)threads.size();
+            generation++;
+        }
+        wake.notify_all();
+        fn(0);
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return running == 0; });
+        job = std::function<void(int)>();
+    }
+
+    /**
+     * [0, n)をchunk個ずつに分けてfn(begin, end, worker)を並列に実行し、全部終わるまで待つ
+     * 同じworkerのfnが同時に呼ばれることはないので、ワーカーごとの作業領域を安全に使える
+     *
+     * @param[in] n      範囲の大きさ
+     * @param[in] chunk  1回に処理する要素数
+     * @param[in] fn     範囲[begin, end)とワーカー番号を受け取る関数
+     */
+    template <class Func>
+    void parallelFor(int n, int chunk, Func fn) {
+        if (n <= 0) {
+            return;
+        }
+        chunk = std::max(chunk, 1);
+        int numChunks = (n + chunk - 1) / chunk;
+        int numWorkers = std::min(size(), numChunks);
+        if (numWorkers == 1) {
+            // 1ワーカーでも呼び出し側がチャンクの大きさのバッファを使えるようにチャンクごとに呼ぶ
+            for (int begin = 0; begin < n; begin += chunk) {
+                fn(begin, std::min(begin + chunk, n), 0);
+            }
+            return;
+        }
+
+        // 各ワーカーに連続したチャンクを割り当てる
+        std::vector<ChunkQueue> queues(size());
+        for (int w = 0; w < numWorkers; w++) {
+            queues[w].head = (int)((long long)numChunks * w / numWorkers);
+            queues[w].tail = (int)((long long)numChunks * (w + 1) / numWorkers);
+        }
+
+        run([&](int worker) {
+            int c;
+            while ((c = takeChunk(queues, worker)) >= 0) {
+                int begin = c * chunk;
+                fn(begin, std::min(begin + chunk, n), worker);
+            }
+        });
+    }
+
+private:
+    struct ChunkQueue {
+        std::mutex mutex;
+        int head;   // 次に自分で処理するチャンク
+        int tail;   // 末尾（他のワーカーはここから奪う）
+
+        ChunkQueue() : head(0), tail(0) {}
+    };
+
+    /**
+     * 自分のキューの先頭からチャンクを取り、空なら他のワーカーのキューの末尾から奪う
+     *
+     * @return チャンク番号（残りがなければ-1）
+     */
+    static int takeChunk(std::vector<ChunkQueue>& queues, int worker) {
+        int numQueues = (int)queues.size();
+        {
+            ChunkQueue& own = queues[worker];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (own.head < own.tail) {
+                return own.head++;
+            }
+        }
+        for (int i = 1; i < numQueues; i++) {
+            ChunkQueue& victim = queues[(worker + i) % numQueues];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (victim.head < victim.tail) {
+                return --victim.tail;
+            }
+        }
+        return -1;
+    }
+
+    void workerLoop(int worker) {
+        unsigned seen = 0;
+        while (true) {
+            std::function<void(int)> fn;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return quit || generation != seen; });
+                if (quit) {
+                    return;
+                }
+                seen = generation;
+                fn = job;
+            }
+            fn(worker);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--running == 0) {
+                    done.notify_all();
+                }
+            }
+        }
+    }
+
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator=(const ThreadPool&);
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::function<void(int)> job;
+    unsigned generation;
+    int running;
+    bool quit;
+};
+
+/*
+ * パイプラインの段の間でデータを受け渡す容量付きのキュー
+ * いっぱいならpush()、空ならpop()がブロックする。close()後はpush()がfalseを返して何も入れず、
+ * 残りを取り出し終えるとpop()がfalseを返す。
+ */
+template <class T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(std::max(capacity, (size_t)1)), closed(false) {}
+
+    bool push(const T& value) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this] { return items.size() < capacity || closed; });
+        if (closed) {
+            return false;
+        }
+        items.push_back(value);
+        notEmpty.notify_one();
+        return true;
+    }
+
+    bool pop(T& value) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this] { return !items.empty() || closed; });
+        if (items.empty()) {
+            return false;
+        }
+        value = items.front();
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+
+private:
+    BoundedQueue(const BoundedQueue&);
+    BoundedQueue& operator=(const BoundedQueue&);
+
+    size_t capacity;
+    bool closed;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+};
+
+/**
+ * コマンドライン引数から -t [スレッド数] を探して返す
+ *
+ * @param[in] argc
+ * @param[in] argv
+ *
+ * @return 指定されたスレッド数（指定がなければ0 = CPUのコア数）
+ */
+inline int parseThreadOption(int argc, char** argv) {
+    return intOption(argc, argv, "-t", 0);
+}
+
+#endif
@@ -3,215 +3,469 @@
 #include <iostream>
 #include <fstream>
 #include <dirent.h>
+#include <map>
+#include <algorithm>
+#include <thread>
+#include "thread_pool.h"
+#include "kmeans.h"
+#include "vocab_tree.h"
+#include "vocabulary.h"
+#include "surf_cache.h"
+#include "surf_extract.h"
+#include "hist_store.h"
+#include "kdtree_index.h"
 
 using namespace std;
 
 const char* IMAGE_DIR = "caltech10";
+const char* VOCAB_FILE = "vocabulary.bin";         // 学習したVisual Words
+const char* HIST_FILE = "histograms.bin";          // 各画像のヒストグラム（疎なバイナリ形式）
+const char* HIST_INDEX_FILE = "histograms.idx";    // ヒストグラムを計算済みの画像（ファイル名、サイズ、更新時刻）
 const int DIM = 128;
-const int SURF_PARAM = 400;
 const int MAX_CLUSTER = 500;  // クラスタ数 = Visual Wordsの次元数
+const int DECODE_QUEUE_SIZE = 8;  // デコード済みで特徴抽出待ちの画像の最大数
 
 /**
- * 画像ファイルからSURF特徴量を抽出する
- * @param[in]  filename            画像ファイル名
- * @param[out] imageKeypoints      キーポイント
- * @param[out] imageDescriptors    各キーポイントのSURF特徴量
- * @param[out] storage             メモリ領域
+ * IMAGE_DIRにある画像ファイル名をファイル名順に列挙する
+ * @param[out] files    画像ファイル名（ディレクトリ名は含まない）
  * @return 成功なら0、失敗なら1
  */
-int extractSURF(const char* filename, CvSeq** keypoints, CvSeq** descriptors, CvMemStorage** storage) {
-    // グレースケールで画像をロードする
-    IplImage* img = cvLoadImage(filename, CV_LOAD_IMAGE_GRAYSCALE);
-    if (img == NULL) {
-        cerr << "cannot load image: " << filename << endl;
-        return 1;
-    }
-
-    *storage = cvCreateMemStorage(0);
-    CvSURFParams params = cvSURFParams(SURF_PARAM, 1);
-    cvExtractSURF(img, 0, keypoints, descriptors, *storage, params);
-
-    return 0;
-}
-
-/**
- * IMAGE_DIRにある全画像から局所特徴量を抽出し行列へ格納する
- * @param[out]   samples    局所特徴量の行列
- * @param[out]   data       samplesのデータ領域
- * @return 成功なら0、失敗なら1
- */
-int loadDescriptors(CvMat& samples, vector<float>& data) {
-    // IMAGE_DIRを開く
+int listImages(vector<string>& files) {
     DIR* dp;
     if ((dp = opendir(IMAGE_DIR)) == NULL) {
         cerr << "cannot open directory: " << IMAGE_DIR << endl;
         return 1;
     }
 
-    // IMAGE_DIRの画像ファイル名を走査
     struct dirent* entry;
     while ((entry = readdir(dp)) != NULL) {
         char* filename = entry->d_name;
         if (strcmp(filename, ".") == 0 || strcmp(filename, "..") == 0) {
             continue;
         }
+        files.push_back(filename);
+    }
+    closedir(dp);
 
-        // パス名に変換
-        // XXX.jpg -> IMAGE_DIR/XXX.jpg
-        char filepath[256];
-        snprintf(filepath, sizeof filepath, "%s/%s", IMAGE_DIR, filename);
-
-        // SURFを抽出
-        CvSeq* keypoints = NULL;
-        CvSeq* descriptors = NULL;
-        CvMemStorage* storage = NULL;
-        int ret = extractSURF(filepath, &keypoints, &descriptors, &storage);
-        if (ret != 0) {
-            cerr << "error in extractSURF" << endl;
-            return 1;
-        }
+    // readdirの順序はファイルシステム依存なのでファイル名順に並べ替える
+    sort(files.begin(), files.end());
+
+    return 0;
+}
+
+/**
+ * 1画像分の局所特徴量
+ * 特徴抽出段のワーカー（またはキャッシュ）が書き込み、最後にファイル名順に連結する
+ */
+struct DescriptorBlock {
+    vector<float> data;    // numDescriptors x DIM の特徴ベクトル
+    int numDescriptors;
+    bool ok;               // 画像をロードできたか
 
-        // ファイル名と局所特徴点の数を表示
-        cout << filepath << "\t" << descriptors->total << endl;
+    DescriptorBlock() : numDescriptors(0), ok(false) {}
+};
 
-        // 特徴量を構造化せずにdataへ追加
-        for (int i = 0; i < descriptors->total; i++) {
-            float* d = (float*)cvGetSeqElem(descriptors, i);  // 128次元ベクトル
-            for (int j = 0; j < DIM; j++) {
-                data.push_back(d[j]);
+/**
+ * 局所特徴量の行列の中での1画像分の位置
+ * クラスタリングで使った特徴量をヒストグラムの計算でもそのまま使うためのオフセット表
+ */
+struct ImageDescriptors {
+    string filename;   // 画像ファイル名（ディレクトリ名は含まない）
+    int offset;        // 局所特徴量の行列の先頭行
+    int count;         // 局所特徴量の本数
+};
+
+/**
+ * 画像から局所特徴量を抽出し行列へ格納する
+ * デコード段（1スレッド）→ 特徴抽出段（poolの全ワーカー）→ 出力段（1スレッド）のパイプラインで処理する。
+ * 各画像の特徴量はその画像用に1回だけ確保したブロックに書き込み、最後にファイル名順に連結する。
+ * cacheDirを指定するとサイズと更新時刻が変わっていない画像はキャッシュから読み、抽出した特徴量はキャッシュに書く。
+ * @param[in]    files      画像ファイル名（ファイル名順）
+ * @param[out]   samples    局所特徴量の行列
+ * @param[out]   data       samplesのデータ領域
+ * @param[out]   images     各画像の局所特徴量がsamplesのどこにあるか
+ * @param[in]    pool       特徴抽出に使うスレッドプール
+ * @param[in]    cacheDir   SURF特徴量のキャッシュディレクトリ（NULLならキャッシュしない）
+ * @param[in]    surf       SURFの抽出のパラメータ（画像の縮小とキーポイント数の上限）
+ * @return 成功なら0、失敗なら1
+ */
+int loadDescriptors(const vector<string>& files, CvMat& samples, vector<float>& data,
+                    vector<ImageDescriptors>& images, ThreadPool& pool, const char* cacheDir, const SurfOptions& surf) {
+    int numImages = (int)files.size();
+    vector<DescriptorBlock> blocks(numImages);
+    vector<ImageStamp> stamps(numImages);
+    vector<char> stamped(numImages, 0);  // デコード段が書き、特徴抽出段が読む（vector<bool>は隣の要素と語を共有するので使わない）
+    int numCached = 0;
+    int32_t variant = surfOptionsKey(surf);  // 違うパラメータで抽出したキャッシュは使わない
+
+    // 出力段：抽出の終わった画像をファイル名順に揃えてファイル名と局所特徴点の数を表示
+    BoundedQueue<int> extracted(numImages + 1);
+    thread reporter([&] {
+        vector<bool> ready(numImages, false);
+        int next = 0;
+        int idx;
+        while (extracted.pop(idx)) {
+            ready[idx] = true;
+            for (; next < numImages && ready[next]; next++) {
+                if (blocks[next].ok) {
+                    cout << IMAGE_DIR << "/" << files[next] << "\t" << blocks[next].numDescriptors << endl;
+                }
+            }
+        }
+    });
+
+    // デコード段：ファイル名順に画像をロードして特徴抽出段へ渡す
+    // キャッシュにあればそこから読んで直接出力段へ渡す
+    // キューの容量でデコード済みの画像がメモリに溜まりすぎないようにする
+    BoundedQueue<pair<int, IplImage*> > decoded(DECODE_QUEUE_SIZE);
+    thread decoder([&] {
+        for (int i = 0; i < numImages; i++) {
+            // パス名に変換
+            // XXX.jpg -> IMAGE_DIR/XXX.jpg
+            char filepath[256];
+            snprintf(filepath, sizeof filepath, "%s/%s", IMAGE_DIR, files[i].c_str());
+            if (cacheDir != NULL) {
+                stamped[i] = statImage(filepath, stamps[i]);
+                if (stamped[i] && loadSurfCache(cacheDir, filepath, stamps[i], variant, DIM, blocks[i].data,
+                                                            blocks[i].numDescriptors)) {
+                    blocks[i].ok = true;
+                    numCached++;
+                    extracted.push(i);
+                    continue;
+                }
+            }
+            IplImage* img = loadGrayImage(filepath, surf.maxSize);
+            if (img == NULL) {
+                cerr << "cannot load image: " << filepath << endl;
+            }
+            decoded.push(make_pair(i, img));
+        }
+        decoded.close();
+    });
+
+    // 特徴抽出段：各ワーカーがデコード済みの画像からSURFを抽出してその画像のブロックに書き込む
+    pool.run([&](int worker) {
+        SurfWorkspace work;  // メモリ領域はワーカーごとに1つを画像ごとに空にして使い回す
+        pair<int, IplImage*> item;
+        while (decoded.pop(item)) {
+            DescriptorBlock& block = blocks[item.first];
+            IplImage* img = item.second;
+            if (img != NULL) {
+                CvSeq* keypoints = NULL;
+                CvSeq* descriptors = NULL;
+                extractSurf(img, surf, work, &keypoints, &descriptors);
+                const vector<int>& selected = work.selected;
+
+                // 残すキーポイントの特徴量を構造化せずにブロックへコピー（1画像分を一度に確保）
+                block.numDescriptors = (int)selected.size();
+                block.data.resize(selected.size() * DIM);
+                CvSeqReader reader;
+                cvStartReadSeq(descriptors, &reader);
+                size_t next = 0;
+                for (int i = 0; i < descriptors->total && next < selected.size(); i++) {
+                    if (selected[next] == i) {
+                        memcpy(&block.data[next * DIM], reader.ptr, DIM * sizeof(float));  // 128次元ベクトル
+                        next++;
+                    }
+                    CV_NEXT_SEQ_ELEM(reader.seq->elem_size, reader);
+                }
+                block.ok = true;
+
+                cvReleaseImage(&img);
+
+                if (cacheDir != NULL && stamped[item.first]) {
+                    char filepath[256];
+                    snprintf(filepath, sizeof filepath, "%s/%s", IMAGE_DIR, files[item.first].c_str());
+                    saveSurfCache(cacheDir, filepath, stamps[item.first], variant, DIM,
+                                  block.data.empty() ? NULL : &block.data[0], block.numDescriptors);
+                }
             }
+            extracted.push(item.first);
         }
+    });
+    decoder.join();
+    extracted.close();
+    reporter.join();
+    if (cacheDir != NULL) {
+        cout << "SURF cache: " << numCached << " / " << numImages << " images" << endl;
+    }
 
-        cvClearSeq(keypoints);
-        cvClearSeq(descriptors);
-        cvReleaseMemStorage(&storage);
+    // 各画像のブロックをファイル名順に連結し、オフセット表を作る
+    size_t total = 0;
+    for (int i = 0; i < numImages; i++) {
+        if (!blocks[i].ok) {
+            cerr << "error in extractSURF" << endl;
+            return 1;
+        }
+        total += blocks[i].data.size();
+    }
+    data.resize(total);
+    images.resize(numImages);
+    size_t offset = 0;
+    for (int i = 0; i < numImages; i++) {
+        images[i].filename = files[i];
+        images[i].offset = (int)(offset / DIM);
+        images[i].count = blocks[i].numDescriptors;
+        if (!blocks[i].data.empty()) {
+            memcpy(&data[offset], &blocks[i].data[0], blocks[i].data.size() * sizeof(float));
+            offset += blocks[i].data.size();
+        }
+        vector<float>().swap(blocks[i].data);  // 連結したブロックはすぐに解放
     }
 
     // dataをCvMat形式に変換
     // CvMatはdataを参照するためdataは解放されないので注意
     int rows = data.size() / DIM;  // CvMatの行数（=DIM次元特徴ベクトルの本数）
-    cvInitMatHeader(&samples, rows, DIM, CV_32FC1, &data[0]);
+    cvInitMatHeader(&samples, rows, DIM, CV_32FC1, total > 0 ? &data[0] : NULL);
 
     return 0;
 }
 
 /**
- * IMAEG_DIRの全画像をヒストグラムに変換して出力
+ * ヒストグラムを計算済みの画像の一覧をロードする
+ * 同じ画像が複数回あれば後の行（最後に計算したとき）を使う
+ * @param[out] index    ファイル名 -> 計算したときのサイズと更新時刻
+ */
+void loadHistogramIndex(map<string, ImageStamp>& index) {
+    ifstream fin(HIST_INDEX_FILE);
+    string line;
+    while (getline(fin, line, '\n')) {
+        // ファイル名\tサイズ\t更新時刻
+        size_t tab1 = line.find('\t');
+        size_t tab2 = line.find('\t', tab1 + 1);
+        if (tab1 == string::npos || tab2 == string::npos) {
+            continue;
+        }
+        ImageStamp stamp;
+        stamp.size = atoll(line.c_str() + tab1 + 1);
+        stamp.mtime = atoll(line.c_str() + tab2 + 1);
+        index[line.substr(0, tab1)] = stamp;
+    }
+}
+
+/**
+ * 画像をヒストグラムに変換して出力
  * 各画像の各局所特徴量を一番近いVisual Wordsに投票してヒストグラムを作成する
- * @param[in]   visualWords     Visual Words
+ * 局所特徴量はloadDescriptors()で抽出したものを使い、SURFを再計算しない
+ * visualWordsとtreeはどちらか一方だけを指定する
+ * @param[in]   visualWords     Visual Words（ランダムkd-treeで量子化する）
+ * @param[in]   tree            Visual Wordsの木（木をたどって量子化する）
+ * @param[in]   samples         局所特徴量の行列
+ * @param[in]   images          各画像の局所特徴量がsamplesのどこにあるか
+ * @param[in]   append          trueならHIST_FILEとHIST_INDEX_FILEに追記、falseなら作り直す
  * @return 成功なら0、失敗なら1
  */
-int calcHistograms(CvMat* visualWords) {
-    // 一番近いVisual Wordsを高速検索できるようにvisualWordsをkd-treeでインデキシング
-    CvFeatureTree* ft = cvCreateKDTree(visualWords);
-
-    // 各画像のヒストグラムを出力するファイルを開く
-    fstream fout;
-    fout.open("histograms.txt", ios::out);
-    if (!fout.is_open()) {
-        cerr << "cannot open file: histograms.txt" << endl;
-        return 1;
+int calcHistograms(CvMat* visualWords, const VocabTree* tree, const CvMat& samples,
+                   const vector<ImageDescriptors>& images, bool append) {
+    // 一番近いVisual Wordsを高速検索できるようにvisualWordsをランダムkd-treeでインデキシング
+    KDTreeIndex wordTree;
+    KDSearchContext context;
+    if (visualWords != NULL) {
+        buildKDTree(visualWords, NULL, NULL, KDTREE_TREES, KDTREE_LEAF_SIZE, wordTree);
     }
+    int numWords = visualWords != NULL ? visualWords->rows : tree->numWords;  // ヒストグラムのビン数
 
-    // IMAGE_DIRの各画像をヒストグラムに変換
-    DIR* dp;
-    if ((dp = opendir(IMAGE_DIR)) == NULL) {
-        cerr << "cannot open directory: " << IMAGE_DIR << endl;
+    // 各画像のヒストグラムを出力するファイルを開く
+    FILE* fout = createHistStore(HIST_FILE, numWords, append);
+    if (fout == NULL) {
         return 1;
     }
+    vector<string> indexLines;  // 計算済みの画像の一覧に書く行
+    vector<int> histogram(numWords);  // 画像ごとに0に戻して使い回す
+    bool written = true;              // すべてのレコードを書き込めたか
 
-    struct dirent* entry;
-    while ((entry = readdir(dp)) != NULL) {
-        char* filename = entry->d_name;
-        if (strcmp(filename, ".") == 0 || strcmp(filename, "..") == 0) {
-            continue;
-        }
-
+    // 各画像をヒストグラムに変換
+    for (size_t f = 0; f < images.size(); f++) {
         char filepath[256];
-        snprintf(filepath, sizeof filepath, "%s/%s", IMAGE_DIR, filename);
+        snprintf(filepath, sizeof filepath, "%s/%s", IMAGE_DIR, images[f].filename.c_str());
 
         // ヒストグラムを初期化
-        int* histogram = new int[visualWords->rows];
-        for (int i = 0; i < visualWords->rows; i++) {
-            histogram[i] = 0;
-        }
+        fill(histogram.begin(), histogram.end(), 0);
 
-        // SURFを抽出
-        CvSeq* keypoints = NULL;
-        CvSeq* descriptors = NULL;
-        CvMemStorage* storage = NULL;
-        int ret = extractSURF(filepath, &keypoints, &descriptors, &storage);
-        if (ret != 0) {
-            cerr << "error in extractSURF" << endl;
-            return 1;
-        }
+        // この画像の局所特徴量だけを参照する行列ヘッダ
+        int count = images[f].count;
+        CvMat mat;
+        cvGetRows(&samples, &mat, images[f].offset, images[f].offset + count);
 
-        // kd-treeで高速検索できるように特徴ベクトルをCvMatに展開
-        CvMat* mat = cvCreateMat(descriptors->total, DIM, CV_32FC1);
-        CvSeqReader reader;
-        float* ptr = mat->data.fl;
-        cvStartReadSeq(descriptors, &reader);
-        for (int i = 0; i < descriptors->total; i++) {
-            float* desc = (float*)reader.ptr;
-            CV_NEXT_SEQ_ELEM(reader.seq->elem_size, reader);
-            memcpy(ptr, desc, DIM*sizeof(float));
-            ptr += DIM;
+        // 各局所特徴点についてもっとも類似したVisual Wordsを見つけて投票
+        if (count == 0) {
+            // 局所特徴点がなければ空のヒストグラム
+        } else if (tree != NULL) {
+            for (int i = 0; i < count; i++) {
+                histogram[quantizeVocabTree(*tree, mat.data.fl + i * DIM)] += 1;
+            }
+        } else {
+            for (int i = 0; i < count; i++) {
+                float nnDist;
+                int idx = searchKDTree(wordTree, (const float*)(mat.data.ptr + (size_t)i * mat.step), KDTREE_CHECKS,
+                                       context, nnDist);
+                if (idx >= 0) {
+                    histogram[wordTree.ids[idx]] += 1;
+                }
+            }
         }
 
-        // 各局所特徴点についてもっとも類似したVisual Wordsを見つけて投票
-        int k = 1;  // 1-NN
-        CvMat* indices = cvCreateMat(keypoints->total, k, CV_32SC1);  // もっとも近いVisual Wordsのインデックス
-        CvMat* dists = cvCreateMat(keypoints->total, k, CV_64FC1);    // その距離
-        cvFindFeatures(ft, mat, indices, dists, k, 250);
-        for (int i = 0; i < indices->rows; i++) {
-            int idx = CV_MAT_ELEM(*indices, int, i, 0);
-            histogram[idx] += 1;
+        // ヒストグラムを0でないビンだけファイルに出力
+        if (!writeHistRecord(fout, filepath, histogram.data(), numWords)) {
+            written = false;
+            break;
         }
 
-        // ヒストグラムをファイルに出力
-        fout << filepath << "\t";
-        for (int i = 0; i < visualWords->rows; i++) {
-            fout << float(histogram[i]) / float(descriptors->total) << "\t";
+        ImageStamp stamp;
+        if (statImage(filepath, stamp)) {
+            char line[512];
+            snprintf(line, sizeof line, "%s\t%lld\t%lld", images[f].filename.c_str(), stamp.size, stamp.mtime);
+            indexLines.push_back(line);
         }
-        fout << endl;
+    }
 
-        // 後始末
-        delete[] histogram;
-        cvClearSeq(keypoints);
-        cvClearSeq(descriptors);
-        cvReleaseMemStorage(&storage);
-        cvReleaseMat(&mat);
-        cvReleaseMat(&indices);
-        cvReleaseMat(&dists);
+    // 書き込みに失敗していたら計算済みの一覧は更新しない（次回の追記で壊れたレコードは切り詰められる）
+    written = written && !ferror(fout);
+    if (fclose(fout) != 0 || !written) {
+        cerr << "cannot write file: " << HIST_FILE << endl;
+        return 1;
     }
 
-    fout.close();
-    cvReleaseFeatureTree(ft);
+    // ヒストグラムを書き終えてから計算済みとして記録する
+    fstream findex;
+    findex.open(HIST_INDEX_FILE, append ? ios::out | ios::app : ios::out);
+    if (!findex.is_open()) {
+        cerr << "cannot open file: " << HIST_INDEX_FILE << endl;
+        return 1;
+    }
+    for (size_t i = 0; i < indexLines.size(); i++) {
+        findex << indexLines[i] << endl;
+    }
+    findex.close();
+    if (findex.fail()) {
+        cerr << "cannot write file: " << HIST_INDEX_FILE << endl;
+        return 1;
+    }
 
     return 0;
 }
 
-int main() {
+int main(int argc, char** argv) {
     int ret;
 
+    // 特徴抽出用のスレッドプール（-t でスレッド数を指定）
+    ThreadPool pool(parseThreadOption(argc, argv));
+
+    // Visual Wordsの保存先（-vocab で指定）
+    const char* vocabFile = stringOption(argc, argv, "-vocab", VOCAB_FILE);
+
+    // SURF特徴量のキャッシュディレクトリ（-cache で指定したときだけ使う）
+    const char* cacheDir = stringOption(argc, argv, "-cache", NULL);
+    if (cacheDir != NULL) {
+        mkdir(cacheDir, 0755);
+    }
+
+    // 大きな画像を縮小する長辺の画素数（-maxsize）と残すキーポイント数（-maxkp）
+    SurfOptions surf = parseSurfOptions(argc, argv);
+
+    // -update なら保存済みのVisual Wordsを使い、新しい画像と変更された画像のヒストグラムだけを追記する
+    if (hasOption(argc, argv, "-update")) {
+        CvMat* visualWords;
+        VocabTree tree;
+        if (!loadVocabulary(vocabFile, visualWords, tree)) {
+            cerr << "cannot load visual words" << endl;
+            return 1;
+        }
+
+        vector<string> files;
+        if (listImages(files) != 0) {
+            return 1;
+        }
+        map<string, ImageStamp> index;
+        loadHistogramIndex(index);
+        vector<string> updated;
+        for (size_t i = 0; i < files.size(); i++) {
+            char filepath[256];
+            snprintf(filepath, sizeof filepath, "%s/%s", IMAGE_DIR, files[i].c_str());
+            ImageStamp stamp;
+            map<string, ImageStamp>::iterator it = index.find(files[i]);
+            if (!statImage(filepath, stamp) || it == index.end() ||
+                it->second.size != stamp.size || it->second.mtime != stamp.mtime) {
+                updated.push_back(files[i]);
+            }
+        }
+
+        cout << "Update Histograms: " << updated.size() << " / " << files.size() << " images" << endl;
+        CvMat samples;
+        vector<float> data;
+        vector<ImageDescriptors> images;
+        ret = loadDescriptors(updated, samples, data, images, pool, cacheDir, surf);
+        if (ret == 0) {
+            ret = calcHistograms(visualWords, visualWords != NULL ? NULL : &tree, samples, images, true);
+        }
+        if (visualWords != NULL) {
+            cvReleaseMat(&visualWords);
+        }
+        return ret;
+    }
+
     // IMAGE_DIRの各画像から局所特徴量を抽出
     cout << "Load Descriptors ..." << endl;
+    double tt = (double)cvGetTickCount();
+    vector<string> files;
+    if (listImages(files) != 0) {
+        return 1;
+    }
     CvMat samples;
     vector<float> data;
-    ret = loadDescriptors(samples, data);
+    vector<ImageDescriptors> images;  // 各画像の局所特徴量の位置（ヒストグラムの計算で使い回す）
+    ret = loadDescriptors(files, samples, data, images, pool, cacheDir, surf);
+    if (ret != 0) {
+        return 1;
+    }
+    tt = (double)cvGetTickCount() - tt;
+    cout << "Load Descriptors Time = " << tt / (cvGetTickFrequency() * 1000.0) << "ms (" << pool.size() << " threads)" << endl;
 
     // 局所特徴量をクラスタリングして各クラスタのセントロイドを計算
+    // -k クラスタ数、-i 反復回数、-b ミニバッチの大きさ（0ならLloyd）、-s 学習に使う最大サンプル数
+    // -seed random | kmeans++ | kmeans||
     cout << "Clustering ..." << endl;
-    CvMat* labels = cvCreateMat(samples.rows, 1, CV_32S);        // 各サンプル点が割り当てられたクラスタのラベル
-    CvMat* centroids = cvCreateMat(MAX_CLUSTER, DIM, CV_32FC1);  // 各クラスタの中心（セントロイド） DIM次元ベクトル
-    cvKMeans2(&samples, MAX_CLUSTER, labels, cvTermCriteria(CV_TERMCRIT_EPS+CV_TERMCRIT_ITER, 10, 1.0), 1, 0, 0, centroids, 0);
-    cvReleaseMat(&labels);  // ラベルは使わない
+    KMeansParams kmParams;
+    kmParams.k = intOption(argc, argv, "-k", MAX_CLUSTER);
+    kmParams.maxIter = intOption(argc, argv, "-i", 10);
+    kmParams.batchSize = intOption(argc, argv, "-b", 0);
+    kmParams.maxSamples = intOption(argc, argv, "-s", 0);
+    string seeding = stringOption(argc, argv, "-seed", "kmeans++");
+    kmParams.seeding = seeding == "random" ? KMEANS_SEED_RANDOM :
+                       seeding == "kmeans||" ? KMEANS_SEED_PARALLEL : KMEANS_SEED_PP;
+
+    // -q flat なら k個のVisual Words、-q tree なら分岐数 -branch、深さ -depth の木を学習する
+    // 各クラスターの中心ベクトル（centroids）または木の葉がそれぞれVisual Wordsになる
+    string quantizer = stringOption(argc, argv, "-q", "flat");
+    CvMat* centroids = NULL;
+    VocabTree tree;
+    if (quantizer == "tree") {
+        int branch = intOption(argc, argv, "-branch", 10);
+        int depth = intOption(argc, argv, "-depth", 3);
+        if (!trainVocabTree(&samples, branch, depth, kmParams, pool, tree)) {
+            cerr << "cannot train vocabulary tree" << endl;
+            return 1;
+        }
+    } else {
+        centroids = cvCreateMat(kmParams.k, DIM, CV_32FC1);  // 各クラスタの中心（セントロイド） DIM次元ベクトル
+        if (!trainKMeans(&samples, kmParams, pool, centroids)) {
+            cerr << "cannot train visual words" << endl;
+            return 1;
+        }
+    }
+
+    // 次回以降 -update で使えるようにVisual Wordsを保存
+    if (!saveVocabulary(vocabFile, centroids, centroids != NULL ? NULL : &tree)) {
+        cerr << "cannot save visual words" << endl;
+        return 1;
+    }
 
-    // 各画像をVisual Wordsのヒストグラムに変換する
-    // 各クラスターの中心ベクトル、centroidsがそれぞれVisual Wordsになる
+    // 各画像をVisual Wordsのヒストグラムに変換する（抽出済みの局所特徴量を使う）
     cout << "Calc Histograms ..." << endl;
-    calcHistograms(centroids);
-    cvReleaseMat(&centroids);
+    ret = calcHistograms(centroids, centroids != NULL ? NULL : &tree, samples, images, false);
+    if (centroids != NULL) {
+        cvReleaseMat(&centroids);
+    }
 
-    return 0;
+    return ret;
 }
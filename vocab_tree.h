@@ -0,0 +1,191 @@
+#ifndef VOCAB_TREE_H
+#define VOCAB_TREE_H
+
+#include <cv.h>
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <cfloat>
+#include <cstring>
+#include "simd_nn.h"
+#include "kmeans.h"
+#include "thread_pool.h"
+
+/*
+ * 階層的k-meansによるVisual Wordsの木（Nister & Stewenius, "Scalable Recognition with a Vocabulary Tree"）
+ *
+ * 各ノードのサンプルをbranch個にk-meansで分け、それを深さdepthまで繰り返す。葉がVisual Wordsになり、
+ * 最大 branch^depth 語まで作れる。量子化は根から一番近い子をたどるだけなので1特徴量あたり
+ * branch x depth 回の距離計算で済む。ノードとセントロイドは平坦な配列に幅優先順で並べる。
+ */
+
+struct VocabTreeNode {
+    int firstChild;   // 子ノードの先頭番号（子は連続して並ぶ、葉なら-1）
+    int numChildren;  // 子ノードの数
+    int word;         // 葉ならVisual Wordsの番号、葉でなければ-1
+};
+
+struct VocabTree {
+    int branch;                       // 分岐数
+    int depth;                        // 深さ
+    int dim;                          // 特徴ベクトルの次元数
+    int numWords;                     // 葉（Visual Words）の数
+    std::vector<VocabTreeNode> nodes; // nodes[0]が根
+    std::vector<float> centers;       // 各ノードのセントロイド（nodes.size() x dim）
+
+    VocabTree() : branch(0), depth(0), dim(0), numWords(0) {}
+};
+
+/**
+ * サンプルからVisual Wordsの木を学習する
+ *
+ * @param[in]  samples  サンプルの行列（各行が1つの特徴ベクトル、CV_32FC1）
+ * @param[in]  branch   分岐数
+ * @param[in]  depth    深さ
+ * @param[in]  params   各ノードのk-meansのパラメータ（kとverboseは無視する）
+ * @param[in]  pool     スレッドプール
+ * @param[out] tree     学習した木
+ *
+ * @return 成功ならtrue、失敗ならfalse
+ */
+inline bool trainVocabTree(const CvMat* samples, int branch, int depth, const KMeansParams& params,
+                           ThreadPool& pool, VocabTree& tree) {
+    int dim = samples->cols;
+    if (branch < 2 || depth < 1 || samples->rows == 0) {
+        std::cerr << "invalid vocabulary tree: branch = " << branch << ", depth = " << depth << std::endl;
+        return false;
+    }
+    tree = VocabTree();
+    tree.branch = branch;
+    tree.depth = depth;
+    tree.dim = dim;
+
+    // 根のセントロイドは使わないので0
+    VocabTreeNode root = { -1, 0, -1 };
+    tree.nodes.push_back(root);
+    tree.centers.assign(dim, 0.0f);
+
+    KMeansParams nodeParams = params;
+    nodeParams.k = branch;
+    nodeParams.verbose = false;
+
+    // 幅優先で各ノードのサンプルを分割していく
+    struct Pending {
+        int node;
+        int level;
+        std::vector<int> rows;   // このノードに割り当てられたサンプルの行番号
+    };
+    std::deque<Pending> queue;
+    Pending first;
+    first.node = 0;
+    first.level = 0;
+    first.rows.resize(samples->rows);
+    for (int i = 0; i < samples->rows; i++) {
+        first.rows[i] = i;
+    }
+    queue.push_back(first);
+
+    double tt = (double)cvGetTickCount();
+    int currentLevel = 0;
+    while (!queue.empty()) {
+        Pending item;
+        item.node = queue.front().node;
+        item.level = queue.front().level;
+        item.rows.swap(queue.front().rows);
+        queue.pop_front();
+
+        if (params.verbose && item.level != currentLevel) {
+            double elapsed = ((double)cvGetTickCount() - tt) / (cvGetTickFrequency() * 1000.0);
+            std::cout << "  level " << currentLevel + 1 << ": " << tree.nodes.size() << " nodes, "
+                      << elapsed << "ms" << std::endl;
+            currentLevel = item.level;
+        }
+
+        // 最下層かサンプルが分岐数より少なければ葉にする
+        int n = (int)item.rows.size();
+        if (item.level == depth || n < branch) {
+            tree.nodes[item.node].word = tree.numWords++;
+            continue;
+        }
+
+        // このノードのサンプルを集めてbranch個にクラスタリング
+        std::vector<float> data((size_t)n * dim);
+        for (int i = 0; i < n; i++) {
+            memcpy(&data[(size_t)i * dim], samples->data.ptr + (size_t)item.rows[i] * samples->step, dim * sizeof(float));
+        }
+        CvMat subset;
+        cvInitMatHeader(&subset, n, dim, CV_32FC1, &data[0]);
+        CvMat* centroids = cvCreateMat(branch, dim, CV_32FC1);
+        if (!trainKMeans(&subset, nodeParams, pool, centroids)) {
+            cvReleaseMat(&centroids);
+            return false;
+        }
+
+        int firstChild = (int)tree.nodes.size();
+        tree.nodes[item.node].firstChild = firstChild;
+        tree.nodes[item.node].numChildren = branch;
+        for (int c = 0; c < branch; c++) {
+            VocabTreeNode child = { -1, 0, -1 };
+            tree.nodes.push_back(child);
+            tree.centers.insert(tree.centers.end(), centroids->data.fl + (size_t)c * dim,
+                                centroids->data.fl + (size_t)(c + 1) * dim);
+        }
+        cvReleaseMat(&centroids);
+
+        // サンプルを一番近い子に振り分ける
+        std::vector<int> labels(n);
+        std::vector<float> dists(n);
+        assignNearest(&data[0], n, &tree.centers[(size_t)firstChild * dim], branch, dim, &labels[0], &dists[0], pool);
+        std::vector<Pending> children(branch);
+        for (int c = 0; c < branch; c++) {
+            children[c].node = firstChild + c;
+            children[c].level = item.level + 1;
+        }
+        for (int i = 0; i < n; i++) {
+            children[labels[i]].rows.push_back(item.rows[i]);
+        }
+        for (int c = 0; c < branch; c++) {
+            queue.push_back(Pending());
+            queue.back().node = children[c].node;
+            queue.back().level = children[c].level;
+            queue.back().rows.swap(children[c].rows);
+        }
+    }
+
+    if (params.verbose) {
+        double elapsed = ((double)cvGetTickCount() - tt) / (cvGetTickFrequency() * 1000.0);
+        std::cout << "  vocabulary tree: " << tree.numWords << " words, " << tree.nodes.size() << " nodes, "
+                  << elapsed << "ms" << std::endl;
+    }
+
+    return true;
+}
+
+/**
+ * 特徴ベクトルを木をたどって量子化する
+ *
+ * @param[in] tree  Visual Wordsの木
+ * @param[in] vec   特徴ベクトル
+ *
+ * @return Visual Wordsの番号
+ */
+inline int quantizeVocabTree(const VocabTree& tree, const float* vec) {
+    L2BoundedFunc l2 = l2Bounded();
+    int node = 0;
+    while (tree.nodes[node].word < 0) {
+        const VocabTreeNode& n = tree.nodes[node];
+        int best = n.firstChild;
+        float bestDist = FLT_MAX;
+        for (int c = n.firstChild; c < n.firstChild + n.numChildren; c++) {
+            float d = l2(vec, &tree.centers[(size_t)c * tree.dim], tree.dim, bestDist);
+            if (d < bestDist) {
+                best = c;
+                bestDist = d;
+            }
+        }
+        node = best;
+    }
+    return tree.nodes[node].word;
+}
+
+#endif
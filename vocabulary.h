@@ -0,0 +1,169 @@
+#ifndef VOCABULARY_H
+#define VOCABULARY_H
+
+#include <cv.h>
+#include <iostream>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include "vocab_tree.h"
+
+/*
+ * 学習したVisual Wordsのバイナリ形式
+ *
+ *   VocabHeader
+ *   平坦な場合: float words[numWords][dim]
+ *   木の場合:   int32 nodes[numNodes][3]（firstChild, numChildren, word）
+ *               float centers[numNodes][dim]
+ *
+ * 数値はすべてネイティブのバイトオーダー。
+ */
+
+const char VOCAB_MAGIC[8] = { 'V', 'W', 'V', 'O', 'C', 'A', 'B', '1' };
+const int32_t VOCAB_FLAT = 0;
+const int32_t VOCAB_TREE = 1;
+
+struct VocabHeader {
+    char magic[8];
+    int32_t type;       // VOCAB_FLAT / VOCAB_TREE
+    int32_t dim;
+    int32_t numWords;
+    int32_t numNodes;   // 木のノード数（平坦なら0）
+    int32_t branch;
+    int32_t depth;
+};
+
+/**
+ * 学習したVisual Wordsをファイルに保存する
+ * visualWordsとtreeはどちらか一方だけを指定する
+ *
+ * @param[in] filename     出力ファイル名
+ * @param[in] visualWords  平坦なVisual Words（各行が1語）
+ * @param[in] tree         Visual Wordsの木
+ *
+ * @return 成功ならtrue、失敗ならfalse
+ */
+inline bool saveVocabulary(const char* filename, const CvMat* visualWords, const VocabTree* tree) {
+    FILE* fp = fopen(filename, "wb");
+    if (fp == NULL) {
+        std::cerr << "cannot open file: " << filename << std::endl;
+        return false;
+    }
+
+    VocabHeader header;
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, VOCAB_MAGIC, sizeof header.magic);
+    if (tree != NULL) {
+        header.type = VOCAB_TREE;
+        header.dim = tree->dim;
+        header.numWords = tree->numWords;
+        header.numNodes = (int32_t)tree->nodes.size();
+        header.branch = tree->branch;
+        header.depth = tree->depth;
+    } else {
+        header.type = VOCAB_FLAT;
+        header.dim = visualWords->cols;
+        header.numWords = visualWords->rows;
+    }
+    bool ok = fwrite(&header, sizeof header, 1, fp) == 1;
+
+    if (tree != NULL) {
+        for (size_t i = 0; i < tree->nodes.size() && ok; i++) {
+            int32_t node[3] = { tree->nodes[i].firstChild, tree->nodes[i].numChildren, tree->nodes[i].word };
+            ok = fwrite(node, sizeof(int32_t), 3, fp) == 3;
+        }
+        ok = ok && fwrite(&tree->centers[0], sizeof(float), tree->centers.size(), fp) == tree->centers.size();
+    } else {
+        for (int i = 0; i < visualWords->rows && ok; i++) {
+            ok = fwrite(visualWords->data.ptr + (size_t)i * visualWords->step, sizeof(float), visualWords->cols,
+                        fp) == (size_t)visualWords->cols;
+        }
+    }
+
+    if (fclose(fp) != 0 || !ok) {
+        std::cerr << "cannot write file: " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * 保存したVisual Wordsをロードする
+ * 平坦な場合はvisualWordsに、木の場合はtreeに格納する（もう一方はNULL / 空のまま）
+ *
+ * @param[in]  filename     入力ファイル名
+ * @param[out] visualWords  平坦なVisual Words（使い終わったらcvReleaseMat()で解放）
+ * @param[out] tree         Visual Wordsの木
+ *
+ * @return 成功ならtrue、失敗ならfalse
+ */
+inline bool loadVocabulary(const char* filename, CvMat*& visualWords, VocabTree& tree) {
+    visualWords = NULL;
+    tree = VocabTree();
+
+    FILE* fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        std::cerr << "cannot open file: " << filename << std::endl;
+        return false;
+    }
+
+    VocabHeader header;
+    if (fread(&header, sizeof header, 1, fp) != 1 || memcmp(header.magic, VOCAB_MAGIC, sizeof header.magic) != 0 ||
+        (header.type != VOCAB_FLAT && header.type != VOCAB_TREE) || header.dim <= 0 || header.numWords <= 0 ||
+        header.numNodes < 0 || (header.type == VOCAB_TREE && header.numNodes == 0)) {
+        std::cerr << "invalid vocabulary file: " << filename << std::endl;
+        fclose(fp);
+        return false;
+    }
+
+    bool ok;
+    if (header.type == VOCAB_TREE) {
+        tree.branch = header.branch;
+        tree.depth = header.depth;
+        tree.dim = header.dim;
+        tree.numWords = header.numWords;
+        tree.nodes.resize(header.numNodes);
+        ok = true;
+        for (int i = 0; i < header.numNodes && ok; i++) {
+            int32_t node[3];
+            ok = fread(node, sizeof(int32_t), 3, fp) == 3;
+            tree.nodes[i].firstChild = node[0];
+            tree.nodes[i].numChildren = node[1];
+            tree.nodes[i].word = node[2];
+        }
+        tree.centers.resize((size_t)header.numNodes * header.dim);
+        ok = ok && fread(&tree.centers[0], sizeof(float), tree.centers.size(), fp) == tree.centers.size();
+
+        // 葉の語の番号と子ノードの範囲を確かめる（子は親より後ろに並ぶので、たどれば必ず葉に着く）
+        for (int i = 0; i < header.numNodes && ok; i++) {
+            const VocabTreeNode& node = tree.nodes[i];
+            bool valid = node.word >= 0 ? node.word < header.numWords
+                                        : node.numChildren > 0 && node.firstChild > i &&
+                                              node.firstChild <= header.numNodes - node.numChildren;
+            if (!valid) {
+                std::cerr << "invalid vocabulary tree node " << i << ": " << filename << std::endl;
+                fclose(fp);
+                tree = VocabTree();
+                return false;
+            }
+        }
+    } else {
+        visualWords = cvCreateMat(header.numWords, header.dim, CV_32FC1);
+        ok = fread(visualWords->data.fl, sizeof(float), (size_t)header.numWords * header.dim, fp) ==
+             (size_t)header.numWords * header.dim;
+    }
+    fclose(fp);
+
+    if (!ok) {
+        std::cerr << "truncated vocabulary file: " << filename << std::endl;
+        if (visualWords != NULL) {
+            cvReleaseMat(&visualWords);
+        }
+        tree = VocabTree();
+        return false;
+    }
+    return true;
+}
+
+#endif